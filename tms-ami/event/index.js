@@ -6,6 +6,12 @@ function handler(amiEvent) {
     console.log('AMI-Event SessionTimeout', amiEvent)
   } else if ('AgentRingNoAnswer' === amiEvent.Event) {
     console.log('AMI-Event AgentRingNoAnswer', amiEvent)
+  } else if ('TMSPlaybackStart' === amiEvent.Event) {
+    console.log('AMI-Event TMSPlaybackStart', amiEvent)
+  } else if ('TMSPlaybackProgress' === amiEvent.Event) {
+    console.log('AMI-Event TMSPlaybackProgress', amiEvent)
+  } else if ('TMSPlaybackEnd' === amiEvent.Event) {
+    console.log('AMI-Event TMSPlaybackEnd', amiEvent)
   }
 }
 module.exports = handler
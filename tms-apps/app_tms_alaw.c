@@ -21,6 +21,11 @@
  * \ingroup applications
  */
 
+/*** MODULEINFO
+	<depend>res_tms</depend>
+	<support_level>extended</support_level>
+ ***/
+
 #include <asterisk.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,19 +46,20 @@
 #include "asterisk/pbx.h"
 #include "asterisk/utils.h"
 
+#include "tms_control.h"
+#include "tms_framer.h"
+#include "tms_pacer.h"
+#include "tms_playback.h"
+#include "tms_timeline.h"
+
 static const char *app_play = "TMSAlawPlay";                                                  // 应用的名字，在extensions.conf中使用
 static const char *syn_play = "alaw file playblack";                                          // Synopsis，应用简介
-static const char *des_play = "TMSAlawPlay(filename,[options]):  Play alaw file to user. \n"; // 应用描述
+static const char *des_play = "TMSAlawPlay(filename,[options],[stopdtmfs]):  Play alaw file to user. \n"; // 应用描述
 
 #define AST_FRAME_GET_BUFFER(fr) ((uint8_t *)((fr)->data.ptr))
 
-#define PKT_PAYLOAD 1460
-#define PKT_SIZE (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET + PKT_PAYLOAD)
-#define PKT_OFFSET (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET)
-
 #define ALAW_SAMPLE_RATE 8000 // alaw采样率
 #define BYTES_PER_SAMPLE 1    // 每个采样的字节数
-#define MAX_PKT_SAMPLES 320   // 每个rtp帧中包含的采样数
 
 static int alaw_play(struct ast_channel *chan, const char *data)
 {
@@ -62,8 +68,21 @@ static int alaw_play(struct ast_channel *chan, const char *data)
   int ret = 0;
   char src[128]; // rtp.src
   char *parse;
-
-  AST_DECLARE_APP_ARGS(args, AST_APP_ARG(filename); AST_APP_ARG(options););
+  TmsPacerSession *pacer = NULL; // 发送调度会话
+  TmsPacerPool *pool = NULL;     // 音频帧池
+  int64_t start_time_us = 0;     // 开始发送的时间
+  TmsChannelTimeline *timeline = NULL; // 通道的媒体时间线
+  uint32_t base_ts = 0;          // 开始位置的帧时间戳，单位毫秒
+  uint32_t last_ts = 0;          // 最后1帧的时间戳
+  int64_t last_deadline_us = 0;  // 最后1帧的发送时间
+  int nb_rtps = 0;               // rtp包发送数据
+  int nb_total_samples = 0;      // 总采样数
+  TmsControl control;            // 检测挂机和停止键
+  TmsControlEvent event;
+  TmsPlayback *playback = NULL;  // 发送AMI事件
+  TmsPlaybackReason reason = TMS_PLAYBACK_ERROR;
+
+  AST_DECLARE_APP_ARGS(args, AST_APP_ARG(filename); AST_APP_ARG(options); AST_APP_ARG(stopdtmfs););
 
   ast_debug(1, "alawplay %s\n", (char *)data);
 
@@ -80,6 +99,8 @@ static int alaw_play(struct ast_channel *chan, const char *data)
   AST_STANDARD_APP_ARGS(args, parse);
 
   char *filename = (char *)args.filename;
+  tms_control_init(&control, chan, args.stopdtmfs);
+  playback = tms_playback_start(chan, app_play, filename);
 
   struct ast_str *codec_buf = ast_str_alloca(AST_FORMAT_CAP_NAMES_LEN);
 
@@ -97,64 +118,91 @@ static int alaw_play(struct ast_channel *chan, const char *data)
     goto clean;
   }
 
-  int nb_rtps = 0;          // rtp包发送数据
-  int nb_total_samples = 0; // 总采样数
+  int pkt_samples = tms_framer_get_ptime(chan) * ALAW_SAMPLE_RATE / 1000; // 按打包时长计算每个rtp帧中包含的采样数
+
+  pacer = tms_pacer_session_create(chan);
+  pool = tms_pacer_pool_create(pacer, AST_FRAME_VOICE, ast_format_alaw, src, 1);
+  if (!pool)
+  {
+    ast_log(LOG_ERROR, "通道 %s 建立发送会话失败，无法播放文件 %s\n", ast_channel_name(chan), filename);
+    goto clean;
+  }
+  start_time_us = tms_pacer_now_us();
+  tms_pacer_session_set_info(pacer, app_play, filename);
+  /* 帧带有时间戳，从通道上次播放结束的位置继续 */
+  timeline = tms_timeline_get(chan);
+  base_ts = tms_timeline_start(timeline, AST_FRAME_VOICE, start_time_us) / (ALAW_SAMPLE_RATE / 1000);
 
   while (!feof(file_alaw))
   {
     nb_rtps++;
 
-    int duration = 0;                                   // 每帧之间添加的发送延时
-    int8_t samples[BYTES_PER_SAMPLE * MAX_PKT_SAMPLES]; // 从文件中读取的采样
-    size_t nb_samples;                                  // 获得的采样数
+    int64_t deadline_us = 0; // 本帧的发送时间
+    size_t nb_samples;       // 获得的采样数
+    struct ast_frame *f;
 
-    nb_samples = fread(samples, BYTES_PER_SAMPLE, MAX_PKT_SAMPLES, file_alaw);
+    tms_pacer_session_stage_begin(pacer);
+    /* 采样直接读入帧池中的帧，帧头已经设置好 */
+    if (!(f = tms_pacer_pool_get(pool)))
+    {
+      ast_log(LOG_WARNING, "通道 %s 获取音频帧失败\n", ast_channel_name(chan));
+      goto clean;
+    }
+    nb_samples = fread(AST_FRAME_GET_BUFFER(f), BYTES_PER_SAMPLE, pkt_samples, file_alaw);
     if (nb_samples <= 0)
     {
+      tms_pacer_pool_put(pool, f);
+      nb_rtps--;
       break;
     }
+    tms_pacer_session_stage(pacer, TMS_PACER_STAGE_READ);
+    /* 发送时间等于开始时间加上采样位置，不受之前发送耗时的影响 */
+    deadline_us = start_time_us + (int64_t)nb_total_samples * 1000000 / ALAW_SAMPLE_RATE;
+    f->ts = base_ts + nb_total_samples / (ALAW_SAMPLE_RATE / 1000);
+    last_ts = f->ts;
+    last_deadline_us = deadline_us;
     nb_total_samples += nb_samples;
 
-    unsigned char buffer[PKT_SIZE];
-    struct ast_frame *f = (struct ast_frame *)buffer;
-
-    /* Unset */
-    memset(f, 0, PKT_SIZE);
-
-    AST_FRAME_SET_BUFFER(f, f, PKT_OFFSET, PKT_PAYLOAD);
-    f->src = strdup(src);
-    /* 设置帧类型和编码格式 */
-    f->frametype = AST_FRAME_VOICE;
-    f->subclass.format = ast_format_alaw;
-    f->delivery.tv_usec = 0;
-    f->delivery.tv_sec = 0;
-    /* Don't free the frame outside */
-    f->mallocd = 0;
-    f->offset = AST_FRIENDLY_OFFSET;
-
     /* 帧中包含的采样数 */
     f->samples = nb_samples;
     /* 每帧包含的采样数据 */
     f->datalen = nb_samples;
-    uint8_t *data;
-    data = AST_FRAME_GET_BUFFER(f);
-    memcpy(data, samples, nb_samples);
 
     ast_debug(2, "准备发送第 %d 个RTP帧，包含采样数 %ld\n", nb_rtps, nb_samples);
 
-    /* Write frame */
-    ast_write(chan, f);
+    /* 由调度器在发送时间写入通道 */
+    if (tms_pacer_pool_write(pool, f, deadline_us) < 0)
+    {
+      goto clean;
+    }
+    tms_pacer_session_stage(pacer, TMS_PACER_STAGE_PACKETIZE);
+    tms_pacer_session_set_position(pacer, (int64_t)nb_total_samples * 1000000 / ALAW_SAMPLE_RATE);
+
+    /* 每个包检查1次通道，挂机或者按停止键时丢弃排队的帧，立即结束 */
+    if ((event = tms_control_poll(&control)) == TMS_CONTROL_HANGUP || event == TMS_CONTROL_STOP)
+    {
+      ast_debug(1, "停止播放文件 %s\n", filename);
+      ret = event == TMS_CONTROL_HANGUP ? -1 : 0;
+      reason = tms_control_reason(event);
+      goto clean;
+    }
 
-    /* 计算每一帧采样的持续时间，设置发送延迟 */
-    duration = (int)(((float)nb_samples / (float)ALAW_SAMPLE_RATE) * 1000 * 1000);
-    ast_debug(2, "完成第 %d 个RTP帧发送，添加延时 %d\n", nb_rtps, duration);
-    usleep(duration);
+    ast_debug(2, "完成第 %d 个RTP帧发送，发送时间 %ld\n", nb_rtps, deadline_us);
   }
 
   /* Log end */
-  ast_debug(1, "结束播放文件 %s，共发送RTP包 %d 个，采样 %d 个\n", filename, nb_rtps, nb_total_samples);
+  ast_debug(1, "结束播放文件 %s，共发送RTP包 %d 个，采样 %d 个，最大发送延迟 %ld 微秒\n", filename, nb_rtps, nb_total_samples, tms_pacer_session_max_late_us(pacer));
+
+  /* 等待排队的帧发送完 */
+  tms_pacer_session_close(pacer, 1);
+  pacer = NULL;
+  reason = TMS_PLAYBACK_COMPLETE;
 
 clean:
+  tms_pacer_session_close(pacer, 0);
+  tms_timeline_end(timeline, AST_FRAME_VOICE, last_ts * (ALAW_SAMPLE_RATE / 1000), last_deadline_us, nb_rtps, nb_total_samples);
+  tms_playback_end(playback, reason);
+
   if (file_alaw)
     fclose(file_alaw);
 
@@ -183,4 +231,9 @@ static int load_module(void)
   return res;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "TMS alaw applications");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "TMS alaw applications",
+  .support_level = AST_MODULE_SUPPORT_EXTENDED,
+  .load = load_module,
+  .unload = unload_module,
+  .nonoptreq = "res_tms",
+);
@@ -21,6 +21,11 @@
  * \ingroup applications
  */
 
+/*** MODULEINFO
+	<depend>res_tms</depend>
+	<support_level>extended</support_level>
+ ***/
+
 #include <asterisk.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,21 +55,18 @@
 #include <libavutil/time.h>
 #include <libavutil/timestamp.h>
 
+#include "tms_avc.h"
+#include "tms_control.h"
+#include "tms_h264.h"
+#include "tms_pacer.h"
+#include "tms_playback.h"
+#include "tms_rtp.h"
+#include "tms_timeline.h"
+
 static const char *app_play = "TMSH264Play";
 static const char *syn_play = "H264 file playblack";
-static const char *des_play = "  TMSH264Play(filename,[options]):  Play h264 file to user. \n";
-
-#define AST_FRAME_GET_BUFFER(fr) ((uint8_t *)((fr)->data.ptr))
-
-#define PKT_PAYLOAD 1460
-#define PKT_SIZE (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET + PKT_PAYLOAD)
-#define PKT_OFFSET (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET)
+static const char *des_play = "  TMSH264Play(filename,[options],[stopdtmfs]):  Play h264 file to user. \n";
 
-#define FF_RTP_FLAG_H264_MODE0 8
-
-#define RTP_H264_TIME_BASE 90000
-
-#define TMS_H264_DEBUG_RTP 0
 #define TMS_H264_DEBUG_AV_FRAME 0
 #define TMS_H264_DEBUG_FFMPEG 0
 
@@ -84,292 +86,6 @@ typedef struct InputStream
   int64_t dts; ///< dts of the last packet read for this stream (in AV_TIME_BASE units)
 } InputStream;
 
-typedef struct RTPMuxContext
-{
-  const AVClass *av_class;
-  AVFormatContext *ic;
-  AVStream *st;
-  int payload_type;
-  uint32_t ssrc;
-  const char *cname;
-  int seq;
-  uint32_t timestamp;
-  uint32_t base_timestamp;
-  uint32_t cur_timestamp;
-  int max_payload_size;
-  int num_frames;
-
-  /* rtcp sender statistics */
-  int64_t last_rtcp_ntp_time;
-  int64_t first_rtcp_ntp_time;
-  unsigned int packet_count;
-  unsigned int octet_count;
-  unsigned int last_octet_count;
-  int first_packet;
-  /* buffer for output */
-  uint8_t *buf;
-  uint8_t *buf_ptr;
-
-  int max_frames_per_packet;
-
-  /**
-     * Number of bytes used for H.264 NAL length, if the MP4 syntax is used
-     * (1, 2 or 4)
-     */
-  int nal_length_size;
-  int buffered_nals;
-
-  int flags;
-
-  unsigned int nb_rtp_frames;
-
-  InputStream *video;
-} RTPMuxContext;
-
-static void ff_rtp_send_data(RTPMuxContext *s, const uint8_t *buf1, int len, int m)
-{
-  if (TMS_H264_DEBUG_RTP)
-  {
-    ast_debug(1, "进入ff_rtp_send_data len=%d M=%d\n", len, m);
-  }
-
-  uint8_t *data;
-
-  uint8_t buffer[PKT_SIZE];
-  struct ast_frame *f = (struct ast_frame *)buffer;
-  s->timestamp = s->cur_timestamp;
-
-  /* Unset */
-  memset(f, 0, PKT_SIZE);
-
-  AST_FRAME_SET_BUFFER(f, f, PKT_OFFSET, PKT_PAYLOAD);
-
-  f->src = strdup(s->video->src);
-  /* Set type */
-  f->frametype = AST_FRAME_VIDEO;
-  /* Set number of samples */
-  f->samples = 1;
-  f->delivery.tv_usec = 0;
-  f->delivery.tv_sec = 0;
-  // 告知asterisk使用指定的时间戳
-  ast_set_flag(f, AST_FRFLAG_HAS_TIMING_INFO);
-  f->ts = s->timestamp;
-  /* Don't free the frame outside */
-  f->mallocd = 0;
-  f->subclass.format = ast_format_h264;
-  f->subclass.frame_ending = m;
-  f->offset = AST_FRIENDLY_OFFSET;
-
-  /* Get data pointer */
-  data = AST_FRAME_GET_BUFFER(f);
-
-  f->datalen = len;
-
-  memcpy(data, buf1, len);
-
-  s->nb_rtp_frames++;
-
-  /* Write frame */
-  ast_write(s->video->chan, f);
-
-  ast_frfree(f);
-
-  if (TMS_H264_DEBUG_RTP)
-  {
-    ast_debug(1, "[chan %p] 完成第 %d 个视频RTP帧发送 \n", s->video->chan, s->nb_rtp_frames);
-  }
-}
-
-static void flush_buffered(RTPMuxContext *s, int last)
-{
-  if (TMS_H264_DEBUG_RTP)
-  {
-    ast_debug(1, "flush_buffered\n");
-  }
-  if (s->buf_ptr != s->buf)
-  {
-    // If we're only sending one single NAL unit, send it as such, skip
-    // the STAP-A/AP framing
-    if (s->buffered_nals == 1)
-    {
-      ff_rtp_send_data(s, s->buf + 3, s->buf_ptr - s->buf - 3, last);
-    }
-    else
-    {
-      ff_rtp_send_data(s, s->buf, s->buf_ptr - s->buf, last);
-    }
-  }
-  s->buf_ptr = s->buf;
-  s->buffered_nals = 0;
-}
-
-static void h264_nal_send(RTPMuxContext *s, const uint8_t *buf, int size, int last)
-{
-  int nalu_type = buf[0] & 0x1F;
-
-  if (TMS_H264_DEBUG_RTP)
-  {
-    ast_debug(1, "Sending NAL %x of len %d M=%d\n", nalu_type, size, last);
-  }
-  // 跳过sei
-  // if (nalu_type == 6)
-  // 	return;
-
-  if (size <= s->max_payload_size)
-  {
-    int buffered_size = s->buf_ptr - s->buf;
-    int header_size;
-    int skip_aggregate = 1;
-
-    header_size = 1;
-    //skip_aggregate = s->flags & FF_RTP_FLAG_H264_MODE0;
-
-    // Flush buffered NAL units if the current unit doesn't fit
-    if (buffered_size + 2 + size > s->max_payload_size)
-    {
-      flush_buffered(s, 0);
-      buffered_size = 0;
-    }
-    // If we aren't using mode 0, and the NAL unit fits including the
-    // framing (2 bytes length, plus 1/2 bytes for the STAP-A/AP marker),
-    // write the unit to the buffer as a STAP-A/AP packet, otherwise flush
-    // and send as single NAL.
-    if (buffered_size + 2 + header_size + size <= s->max_payload_size &&
-        !skip_aggregate)
-    {
-      if (buffered_size == 0)
-      {
-        *s->buf_ptr++ = 24;
-      }
-      AV_WB16(s->buf_ptr, size);
-      s->buf_ptr += 2;
-      memcpy(s->buf_ptr, buf, size);
-      s->buf_ptr += size;
-      s->buffered_nals++;
-    }
-    else
-    {
-      flush_buffered(s, 0);
-      ff_rtp_send_data(s, buf, size, last);
-    }
-  }
-  else
-  {
-    int flag_byte, header_size;
-    flush_buffered(s, 0);
-    if (s->flags & FF_RTP_FLAG_H264_MODE0)
-    {
-      ast_debug(1, "NAL size %d > %d, try -slice-max-size %d\n", size, s->max_payload_size, s->max_payload_size);
-      return;
-    }
-    if (TMS_H264_DEBUG_RTP)
-    {
-      ast_debug(1, "NAL size %d > %d\n", size, s->max_payload_size);
-    }
-
-    uint8_t type = buf[0] & 0x1F;
-    uint8_t nri = buf[0] & 0x60;
-
-    s->buf[0] = 28; /* FU Indicator; Type = 28 ---> FU-A */
-    s->buf[0] |= nri;
-    s->buf[1] = type;
-    s->buf[1] |= 1 << 7;
-    buf += 1;
-    size -= 1;
-
-    flag_byte = 1;
-    header_size = 2;
-
-    while (size + header_size > s->max_payload_size)
-    {
-      memcpy(&s->buf[header_size], buf, s->max_payload_size - header_size);
-      ff_rtp_send_data(s, s->buf, s->max_payload_size, 0);
-      buf += s->max_payload_size - header_size;
-      size -= s->max_payload_size - header_size;
-      s->buf[flag_byte] &= ~(1 << 7);
-    }
-    s->buf[flag_byte] |= 1 << 6;
-    memcpy(&s->buf[header_size], buf, size);
-    ff_rtp_send_data(s, s->buf, size + header_size, last);
-  }
-}
-
-static const uint8_t *ff_avc_find_startcode_internal(const uint8_t *p, const uint8_t *end)
-{
-  const uint8_t *a = p + 4 - ((intptr_t)p & 3);
-
-  for (end -= 3; p < a && p < end; p++)
-  {
-    if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-      return p;
-  }
-
-  for (end -= 3; p < end; p += 4)
-  {
-    uint32_t x = *(const uint32_t *)p;
-    //      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
-    //      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
-    if ((x - 0x01010101) & (~x) & 0x80808080)
-    { // generic
-      if (p[1] == 0)
-      {
-        if (p[0] == 0 && p[2] == 1)
-          return p;
-        if (p[2] == 0 && p[3] == 1)
-          return p + 1;
-      }
-      if (p[3] == 0)
-      {
-        if (p[2] == 0 && p[4] == 1)
-          return p + 2;
-        if (p[4] == 0 && p[5] == 1)
-          return p + 3;
-      }
-    }
-  }
-
-  for (end += 3; p < end; p++)
-  {
-    if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-      return p;
-  }
-
-  return end + 3;
-}
-
-static const uint8_t *ff_avc_find_startcode(const uint8_t *p, const uint8_t *end)
-{
-  const uint8_t *out = ff_avc_find_startcode_internal(p, end);
-  if (p < out && out < end && !out[-1])
-    out--;
-  return out;
-}
-
-static void ff_rtp_send_h264(RTPMuxContext *s, const uint8_t *buf1, int size)
-{
-  const uint8_t *r, *end = buf1 + size;
-
-  s->buf_ptr = s->buf;
-
-  r = ff_avc_find_startcode(buf1, end);
-  while (r < end)
-  {
-    const uint8_t *r1;
-
-    while (!*(r++))
-      ;
-    r1 = ff_avc_find_startcode(r, end);
-    h264_nal_send(s, r, r1 - r, r1 == end);
-
-    if (TMS_H264_DEBUG_RTP)
-    {
-      ast_debug(1, "ff_rtp_send_h264.h264_nal_send r = %p r1 = %p end = %p\n", r, r1, end);
-    }
-    r = r1;
-  }
-  flush_buffered(s, 1);
-}
-
 /* 输出视频帧调试信息 */
 static void tms_dump_h264_frame(int nb_frames, AVFrame *frame, AVCodecContext *cctx)
 {
@@ -476,21 +192,26 @@ static int h264_play(struct ast_channel *chan, const char *data)
       .dts = AV_NOPTS_VALUE};
 
   uint8_t buf[1470];
-  RTPMuxContext rtp_mux_ctx = {
+  TmsVideoRtpContext rtp_mux_ctx = {
       .buf = buf,
       .max_payload_size = 1400,
       .buffered_nals = 0,
       .flags = 0,
-      .nb_rtp_frames = 0,
-      .video = &video};
+      .deadline_us = 0,
+      .history = {.buf = NULL}};
+  TmsPlayerContext player = {.chan = chan, .rtcp_fd = -1, .pacer = NULL, .video_pool = NULL}; // 发送调度和视频流的发送统计
 
   char *filename;                 // 要打开的文件
   int option_rtp_frame_tight = 0; // 是否在rtp帧间添加时间间隔
   int ret = 0;                    // 返回结果
   char src[128];                  // rtp.src
   char *parse;
+  TmsChannelTimeline *timeline = NULL; // 通道的媒体时间线
+  TmsControl control;                  // 检测挂机和停止键
+  TmsPlayback *playback = NULL;        // 发送AMI事件
+  TmsPlaybackReason reason = TMS_PLAYBACK_ERROR;
 
-  AST_DECLARE_APP_ARGS(args, AST_APP_ARG(filename); AST_APP_ARG(options););
+  AST_DECLARE_APP_ARGS(args, AST_APP_ARG(filename); AST_APP_ARG(options); AST_APP_ARG(stopdtmfs););
 
   ast_debug(1, "TMSH264Play %s\n", (char *)data);
 
@@ -510,6 +231,8 @@ static int h264_play(struct ast_channel *chan, const char *data)
   AVFormatContext *ictx = NULL;
 
   filename = (char *)args.filename;
+  tms_control_init(&control, chan, args.stopdtmfs);
+  playback = tms_playback_start(chan, app_play, filename);
   if (args.options)
   {
     if (strcasestr(args.options, "tight"))
@@ -583,17 +306,31 @@ static int h264_play(struct ast_channel *chan, const char *data)
   AVPacket *pkt = av_packet_alloc();
   AVFrame *frame = av_frame_alloc();
 
-  // 应用有可能在一个dialplan中多次调用，所以应该用当前时间保证多个应用间的时间戳是连续增长的
-  struct timeval now = ast_tvnow();
-  rtp_mux_ctx.base_timestamp = now.tv_sec * 1000000 + now.tv_usec;
+  int64_t start_time = av_gettime_relative(); // 开始时间（microseconds）
+
+  // 应用有可能在一个dialplan中多次调用，RTP时间戳从通道上次播放结束的位置按经过的时间继续
+  timeline = tms_timeline_get(chan);
+  rtp_mux_ctx.base_timestamp = tms_timeline_start(timeline, AST_FRAME_VIDEO, start_time);
   rtp_mux_ctx.timestamp = rtp_mux_ctx.base_timestamp;
   rtp_mux_ctx.cur_timestamp = 0;
 
-  int64_t start_time = av_gettime_relative(); // 开始时间（microseconds）
+  player.pacer = tms_pacer_session_create(chan);
+  player.video_pool = tms_pacer_pool_create(player.pacer, AST_FRAME_VIDEO, ast_format_h264, src, 1);
+  if (!player.video_pool)
+  {
+    ast_log(LOG_ERROR, "通道 %s 建立发送会话失败，无法播放文件 %s\n", ast_channel_name(chan), filename);
+    goto clean;
+  }
+  tms_pacer_session_set_info(player.pacer, app_play, filename);
+  if (!tms_avc_packetization_mode(chan))
+    rtp_mux_ctx.flags |= FF_RTP_FLAG_H264_MODE0;
+  rtp_mux_ctx.inject_param_sets = tms_avc_param_sets_mode(chan);
+
   int64_t elapse = 0, end_time = 0, latest_dts = 0;
   int nb_packets = 0, nb_frames = 0;
   while (1)
   {
+    tms_pacer_session_stage_begin(player.pacer);
     if ((ret = av_read_frame(ictx, pkt)) == AVERROR_EOF)
     {
       end_time = av_gettime_relative();
@@ -606,6 +343,7 @@ static int h264_play(struct ast_channel *chan, const char *data)
     }
 
     nb_packets++;
+    tms_pacer_session_stage(player.pacer, TMS_PACER_STAGE_READ);
 
     tms_dump_h264_packet(nb_packets, pkt, ist);
 
@@ -613,6 +351,7 @@ static int h264_play(struct ast_channel *chan, const char *data)
     int packet_new = 1;
     while (process_frame(filename, cctx, pkt, frame, &nb_frames, &packet_new) < 0)
       ;
+    tms_pacer_session_stage(player.pacer, TMS_PACER_STAGE_DECODE);
 
     /* 计算时间戳 */
     if (!video.saw_first_ts)
@@ -630,28 +369,39 @@ static int h264_play(struct ast_channel *chan, const char *data)
     latest_dts = video.dts;
     elapse = av_gettime_relative() - start_time;
 
-    /* 每帧之间添加时间间隔 */
-    if (latest_dts >= 0)
-    {
-      if (latest_dts > elapse)
-      {
-        if (!option_rtp_frame_tight)
-          usleep(latest_dts - elapse);
-      }
-    }
+    /* 按解码时间发送，帧之间不添加间隔时尽快发送 */
+    rtp_mux_ctx.deadline_us = option_rtp_frame_tight ? 0 : start_time + latest_dts;
     /* 用每个帧的播放时长作为dts时间间隔 */
     video.next_dts += av_rescale_q(pkt->duration, video.st->time_base, AV_TIME_BASE_Q);
 
-    // 视频的以ffmpeg时间基数计算的时间戳
-    int64_t av_ts = rtp_mux_ctx.base_timestamp + latest_dts;
     // 用rpt时间基数计算的时间戳
-    int64_t rtp_ts = av_rescale(av_ts, RTP_H264_TIME_BASE, AV_TIME_BASE);
+    uint32_t rtp_ts = rtp_mux_ctx.base_timestamp + av_rescale(latest_dts, RTP_H264_TIME_BASE, AV_TIME_BASE);
     rtp_mux_ctx.cur_timestamp = rtp_ts;
 
-    ast_debug(2, "发送 packet #%d elapse = %ld dts = %ld av_ts = %ld rtp_ts = %ld\n", nb_packets, elapse, latest_dts, av_ts, rtp_ts);
+    ast_debug(2, "发送 packet #%d elapse = %ld dts = %ld rtp_ts = %u\n", nb_packets, elapse, latest_dts, rtp_ts);
+
+    /* 发送RTP包，记录关键帧；重发关键帧后丢弃非关键帧，直到文件中的下1个关键帧 */
+    if (tms_video_history_begin(&rtp_mux_ctx.history, pkt->flags & AV_PKT_FLAG_KEY))
+      ff_rtp_send_h264(&rtp_mux_ctx, pkt->data, pkt->size, &player);
+    av_packet_unref(pkt);
+    tms_pacer_session_stage(player.pacer, TMS_PACER_STAGE_PACKETIZE);
+    tms_pacer_session_set_position(player.pacer, latest_dts);
 
-    /* 发送RTP包 */
-    ff_rtp_send_h264(&rtp_mux_ctx, pkt->data, pkt->size);
+    /* 挂机或者按停止键时立即停止，丢弃排队的帧 */
+    if ((ret = tms_control_poll(&control)) == TMS_CONTROL_HANGUP || ret == TMS_CONTROL_STOP)
+    {
+      ast_debug(1, "停止播放文件 %s\n", filename);
+      reason = tms_control_reason(ret);
+      ret = 0;
+      goto clean;
+    }
+    /* 对端请求关键帧（VIDUPDATE）时立即重发最近的关键帧，不等文件中的下1个IDR */
+    if (control.keyframe_requested)
+    {
+      control.keyframe_requested = 0;
+      player.video_rtcp.nb_keyframe_requests++;
+      tms_video_history_resend(&rtp_mux_ctx, &player);
+    }
   }
 
   av_packet_unref(pkt);
@@ -661,12 +411,18 @@ static int h264_play(struct ast_channel *chan, const char *data)
     ;
 
   elapse = end_time - start_time;
-  ast_debug(1, "完成从文件中读取媒体包，共读取 %d 个包，发送 %d 个包，耗时 %ld，最后解码时间：%ld\n", nb_packets, rtp_mux_ctx.nb_rtp_frames, elapse, latest_dts);
+  ast_debug(1, "完成从文件中读取媒体包，共读取 %d 个包，发送 %d 个包，耗时 %ld，最后解码时间：%ld\n", nb_packets, player.nb_video_rtps, elapse, latest_dts);
+
+  /* 等待排队的帧发送完 */
+  tms_pacer_session_close(player.pacer, 1);
+  player.pacer = NULL;
+  reason = TMS_PLAYBACK_COMPLETE;
 
+  /* 等到播放时长，期间挂机时立即返回 */
   if (option_rtp_frame_tight)
   {
-    if (latest_dts)
-      usleep(latest_dts - elapse);
+    if (latest_dts > elapse && ast_safe_sleep(chan, (latest_dts - elapse) / 1000) < 0)
+      reason = TMS_PLAYBACK_HANGUP;
   }
 
 end:
@@ -674,6 +430,11 @@ end:
   ast_log(LOG_DEBUG, "TMSH264Play(%d) end.\n", ret);
 
 clean:
+  tms_pacer_session_close(player.pacer, 0);
+  tms_timeline_end(timeline, AST_FRAME_VIDEO, rtp_mux_ctx.timestamp, player.video_rtcp.last_deadline_us, player.video_rtcp.packet_count, player.video_rtcp.octet_count);
+  tms_video_history_free(&rtp_mux_ctx.history);
+  tms_playback_end(playback, reason);
+
   if (frame)
     av_frame_free(&frame);
 
@@ -711,4 +472,9 @@ static int load_module(void)
   return res;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "TMS h264 player applications");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "TMS h264 player applications",
+  .support_level = AST_MODULE_SUPPORT_EXTENDED,
+  .load = load_module,
+  .unload = unload_module,
+  .nonoptreq = "res_tms",
+);
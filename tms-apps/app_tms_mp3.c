@@ -21,6 +21,11 @@
  * \ingroup applications
  */
 
+/*** MODULEINFO
+	<depend>res_tms</depend>
+	<support_level>extended</support_level>
+ ***/
+
 #include <asterisk.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,19 +58,23 @@
 #include <libavutil/timestamp.h>
 #include <libswresample/swresample.h>
 
+#include "tms_control.h"
+#include "tms_framer.h"
+#include "tms_pacer.h"
+#include "tms_playback.h"
+#include "tms_pcma_cache.h"
+#include "tms_timeline.h"
+
 static const char *app_play = "TMSMp3Play";                                                 // 应用的名字，在extensions.conf中使用
 static const char *syn_play = "mp3 file playblack";                                         // Synopsis，应用简介
-static const char *des_play = "TMSMp3Play(filename,[options]):  Play mp3 file to user. \n"; // 应用描述
+static const char *des_play = "TMSMp3Play(filename,[options],[stopdtmfs]):  Play mp3 file to user. \n"; // 应用描述
 
 #define AST_FRAME_GET_BUFFER(fr) ((uint8_t *)((fr)->data.ptr))
 
-#define PKT_PAYLOAD 1460
-#define PKT_SIZE (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET + PKT_PAYLOAD)
-#define PKT_OFFSET (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET)
-
 #define ALAW_SAMPLE_RATE 8000 // alaw采样率
 #define BYTES_PER_SAMPLE 1    // 每个采样的字节数
-#define MAX_PKT_SAMPLES 320   // 每个rtp帧中包含的采样数
+
+#define TMS_CONFIG_FILE "tms.conf"
 
 /**
  * 解码器 
@@ -108,6 +117,26 @@ typedef struct Encoder
   AVFrame *frame;
   AVPacket packet;
 } Encoder;
+/**
+ * RTP发送
+ */
+typedef struct Sender
+{
+  struct ast_channel *chan;
+  char *src;
+  TmsPacerSession *pacer; // 发送调度会话
+  TmsPacerPool *pool;     // 音频帧池
+  int64_t start_time_us;  // 开始发送的时间
+  int64_t nb_samples;     // 已经发送的采样数
+  TmsFramer framer;       // 按RTP包大小拆分编码结果
+  TmsChannelTimeline *timeline; // 通道的媒体时间线
+  uint32_t base_ts;             // 开始位置的帧时间戳，单位毫秒
+  uint32_t last_ts;             // 最后1帧的时间戳
+  int64_t last_deadline_us;     // 最后1帧的发送时间
+  unsigned int nb_rtps;         // 已经发送的RTP包数
+  TmsControl control;           // 检测挂机和停止键
+  TmsControlEvent event;        // 停止发送的原因
+} Sender;
 
 /* 输出音频包调试信息 */
 static void tms_dump_audio_packet(int nb_packets, AVPacket *packet)
@@ -390,74 +419,40 @@ end:
   return ret;
 }
 /* 发送RTP包 */
-static int send_rtp(struct ast_channel *chan, char *src, char *buff,int buflen)
+static int send_rtp(Sender *sender, const uint8_t *buff,int buflen)
 {
-  //uint8_t *output_data = (uint8_t *)buff;//encoder->packet.data;
-  //int nb_samples = encoder->nb_samples;
-  
-  //---add wpc 2020-12-10 
-  //int count = buflen;//nb_samples;
-  //int i = 0;
-  //while(count > 0)
-  //{
-  unsigned char buffer[PKT_SIZE];
-  struct ast_frame *f = (struct ast_frame *)buffer;
-  //---add wpc 2020-12-10 
-  /* Unset */
-  memset(f, 0, PKT_SIZE);
-
-  AST_FRAME_SET_BUFFER(f, f, PKT_OFFSET, PKT_PAYLOAD);
-  f->src = strdup(src);
-  /* 设置帧类型和编码格式 */
-  f->frametype = AST_FRAME_VOICE;
-  f->subclass.format = ast_format_alaw;
-  /* 时间戳 */
-  f->delivery.tv_usec = 0;
-  f->delivery.tv_sec = 0;
-  /* Don't free the frame outside */
-  f->mallocd = 0;
-  f->offset = AST_FRIENDLY_OFFSET;
-  /* 设置包含的采样数 */
-  //f->samples = nb_samples;
-  /* 设置采样 */
-  uint8_t *data;
-  data = AST_FRAME_GET_BUFFER(f);
-  /*
-  if(count - 320 >=0)
+  /* 帧池中的帧已经设置好类型、格式和src */
+  struct ast_frame *f = tms_pacer_pool_get(sender->pool);
+  if (!f)
   {
-    
-  memcpy(data, output_data+i, 320);
-  count -= 320;
-  i +=320;
-  f->datalen = 320;
-  f->samples = 160;
-  ast_debug(2, "@@@f->samples:%d\n", f->samples);
-
-  }else 
-  {	
-    memcpy(data, output_data+i, count);
-    f->datalen = count;
-    i += count;
-    f->samples = count/2;
-    ast_debug(2, "@@@f->samples:%d\n", f->samples);
-    count = 0;
+    ast_log(LOG_WARNING, "通道 %s 获取音频帧失败\n", ast_channel_name(sender->chan));
+    return -1;
   }
-  */
-  memcpy(data, buff, buflen);
+  /* 设置采样 */
+  memcpy(AST_FRAME_GET_BUFFER(f), buff, buflen);
   f->datalen = buflen;
   f->samples = buflen;
-  //encoder->nb_rtps++;
 
-  //ast_debug(2, "@@@@duration@@@@\n");
- /* Write frame */
-  ast_write(chan, f);
-  ast_frfree(f);
-  int duration = 20000;
-  usleep(duration);
- //}
-  //ast_debug(2, "完成 #%d 个音频RTP包发送 \n", encoder->nb_rtps);
+  /* 发送时间等于开始时间加上采样位置，不受之前发送耗时的影响 */
+  int64_t deadline_us = sender->start_time_us + sender->nb_samples * 1000000 / ALAW_SAMPLE_RATE;
+  f->ts = sender->base_ts + sender->nb_samples / (ALAW_SAMPLE_RATE / 1000);
+  sender->last_ts = f->ts;
+  sender->last_deadline_us = deadline_us;
+  sender->nb_rtps++;
+  int ret = tms_pacer_pool_write(sender->pool, f, deadline_us);
+  sender->nb_samples += buflen;
+  tms_pacer_session_stage(sender->pacer, TMS_PACER_STAGE_PACKETIZE);
+  tms_pacer_session_set_position(sender->pacer, sender->nb_samples * 1000000 / ALAW_SAMPLE_RATE);
+
+  /* 每个包检查1次通道，挂机或者按停止键时停止解码和发送 */
+  if (ret == 0)
+  {
+    sender->event = tms_control_poll(&sender->control);
+    if (sender->event == TMS_CONTROL_HANGUP || sender->event == TMS_CONTROL_STOP)
+      ret = -1;
+  }
 
-  return 0;
+  return ret;
 }
 
 
@@ -664,105 +659,10 @@ static int send_rtp(struct ast_channel *chan, char *src, char *buff,int buflen)
 //   return ret;
 // }
 
-static void split_packet_size(struct ast_channel *chan,char *src,int split_packet_size,char *data,int data_memory_size, Encoder *encoder)
+/* 分包输出的RTP包 */
+static int sender_output(void *opaque, const uint8_t *data, int len)
 {
-  char buff[640] = {'\0'};
-  int index = 0,  j = 0, k = 0;
-  if(encoder->packet.size > split_packet_size)
-  {
-    ast_debug(2,"@@@encoder->packet.size >%d,strlen(data):%d \n",split_packet_size,(int)strlen(data));
-    if(strlen(data)>0)
-    {
-      memcpy(buff,data,strlen(data)>data_memory_size ? data_memory_size : strlen(data));
-      memcpy(buff+(strlen(data)>data_memory_size ? data_memory_size : strlen(data)),encoder->packet.data,split_packet_size - (strlen(data)>data_memory_size ? data_memory_size : strlen(data)));
-      send_rtp(chan, src, buff,strlen(buff));
-      index = split_packet_size - (strlen(data)>data_memory_size ? data_memory_size : strlen(data));
-      ast_debug(2,"@@@encoder->packet.size >%d strlen(data)>0,index:%d@@@\n",split_packet_size,index);
-
-      //剩余数据/160循环发送,不足160再次保存到data中
-      for(j=0;j<(encoder->packet.size - (split_packet_size - (strlen(data)>data_memory_size ? data_memory_size : strlen(data))))/split_packet_size;j++)
-      {
-        memset(buff,0,sizeof(buff));
-        memcpy(buff,encoder->packet.data+(split_packet_size -(strlen(data)>data_memory_size ? data_memory_size : strlen(data)) + split_packet_size * j),split_packet_size);
-        send_rtp(chan, src, buff,strlen(buff));             
-        index += split_packet_size;
-        ast_debug(2,"@@@encoder->packet.size >%d index:%d@@@\n",split_packet_size,index);
-      }
-      //encoder->packet.size %160余数保存到data中
-      memset(data,0,data_memory_size);
-      memcpy(data,encoder->packet.data+index,encoder->packet.size - index);
-      ast_debug(2,"@@@encoder->packet.size >%d strlen(data)>0 data:%d@@@\n",split_packet_size,encoder->packet.size - index);            
-      
-    }else 
-    {
-        index = 0;
-        memset(data,0,data_memory_size);
-        for(j=0;j<encoder->packet.size/split_packet_size;j++)
-      {
-        memset(buff,0,sizeof(buff));
-        memcpy(buff,encoder->packet.data + split_packet_size * j,split_packet_size);
-        send_rtp(chan, src, buff,strlen(buff));
-        index += split_packet_size;
-        ast_debug(2,"@@@encoder->packet.size >%d strlen(data)<0 index:%d@@@\n",split_packet_size,index);
-      }           
-      //memcpy(buff,encoder->packet.data,160);
-      memcpy(data,encoder->packet.data+index,encoder->packet.size % split_packet_size);
-      ast_debug(2,"@@@encoder->packet.size >%d strlen(data)<0 data:%d@@@\n",split_packet_size,encoder->packet.size % split_packet_size);
-    }
-
-
-  }else if(encoder->packet.size==split_packet_size) 
-  {
-    
-    memcpy(buff,encoder->packet.data,split_packet_size);
-    send_rtp(chan, src, buff,strlen(buff));
-    ast_debug(2,"@@@encoder->packet.size ==%d strlen(data)<0 @@@\n",split_packet_size);
-    memset(buff,0,sizeof(buff));
-  }else
-  {
-    /* 小于160 */
-    /* code */
-    ast_debug(2,"@@@encoder->packet.size < %d @@@\n",split_packet_size);
-    if(strlen(data)>0)
-    {
-      //因为只要数据达到160就发送，encoder->packet.size<160，data<160也小于160
-      ast_debug(2,"@@@encoder->packet.size < %d strlen(data)>0 @@@\n",split_packet_size);
-      if((strlen(data)+encoder->packet.size)>split_packet_size)
-      {
-        memcpy(buff,data,(strlen(data)>data_memory_size ? data_memory_size : strlen(data)));
-        memcpy(buff+(strlen(data)>data_memory_size ? data_memory_size : strlen(data)),encoder->packet.data,split_packet_size - (strlen(data)>data_memory_size ? data_memory_size : strlen(data)));
-        send_rtp(chan, src, buff,strlen(buff));
-        
-        j = split_packet_size -(strlen(data)>data_memory_size ? data_memory_size : strlen(data));
-        memset(data,0,data_memory_size);
-        memcpy(data,encoder->packet.data+j,encoder->packet.size - j);
-        ast_debug(2,"@@@(strlen(data)+encoder->packet.size)>%d ,j:%d, data:%d@@@\n",split_packet_size,j,encoder->packet.size - j);
-
-      }else if((strlen(data)+encoder->packet.size)==split_packet_size)
-      {
-        memcpy(buff,data,(strlen(data)>data_memory_size ? data_memory_size : strlen(data)));
-        memcpy(buff+(strlen(data)>data_memory_size ? data_memory_size : strlen(data)),encoder->packet.data,encoder->packet.size);
-        send_rtp(chan, src, buff,strlen(buff));
-        ast_debug(2,"@@@(strlen(data)+encoder->packet.size)==%d @@@\n",split_packet_size);
-        memset(buff,0,sizeof(buff));
-        memset(data,0,data_memory_size);
-      }else
-      {
-        /* code */
-        k = strlen(data)>data_memory_size ? data_memory_size : strlen(data);
-        memcpy(data + k,encoder->packet.data,encoder->packet.size);
-        ast_debug(2,"@@@(strlen(data)+encoder->packet.size)<%d packet.size:%d@@@\n",split_packet_size,encoder->packet.size);
-      }
-      
-    }else 
-    {
-      memset(data,0,data_memory_size);
-      memcpy(data,encoder->packet.data,encoder->packet.size);
-      ast_debug(2,"@@@(strlen(data)<0 packet.size:%d@@@\n",encoder->packet.size);
-    }
-  }
-
-
+  return send_rtp(opaque, data, len);
 }
 
 static int mp3_play(struct ast_channel *chan, const char *data)
@@ -772,21 +672,25 @@ static int mp3_play(struct ast_channel *chan, const char *data)
   Decoder decoder = {.nb_bytes = 0, .nb_packets = 0, .nb_frames = 0, .nb_samples = 0};
   Resampler resampler = {.max_nb_samples = 0};
   Encoder encoder = {.nb_bytes = 0, .nb_packets = 0, .nb_frames = 0, .nb_rtps = 0};
+  Sender sender = {.chan = chan, .pacer = NULL, .pool = NULL, .nb_samples = 0, .timeline = NULL, .nb_rtps = 0};
+  TmsPcmaCache pcma_cache = {.state = TMS_PCMA_CACHE_NONE}; // alaw转码结果缓存
+  TmsPlayback *playback = NULL; // 发送AMI事件
+  TmsPlaybackReason reason = TMS_PLAYBACK_ERROR;
 
   int ret = 0;
   char src[128]; // rtp.src
   char *parse;
   //char buff[8192] = {'\0'};
   //char buff[640] = {'\0'};
-  char tmp[2048] = {'\0'};
   //int index = 0, i = 0, j = 0, k = 0;
-  int split_size = 160;
-  AST_DECLARE_APP_ARGS(args, AST_APP_ARG(filename); AST_APP_ARG(options););
+  int split_size = 160; // 每个RTP包包含的采样数，由打包时长计算
+  AST_DECLARE_APP_ARGS(args, AST_APP_ARG(filename); AST_APP_ARG(options); AST_APP_ARG(stopdtmfs););
 
   ast_debug(1, "mp3play %s\n", (char *)data);
 
   /* Set random src */
   snprintf(src, 128, "mp3play%08lx", ast_random());
+  sender.src = src;
 
   /* Lock module */
   u = ast_module_user_add(chan);
@@ -800,6 +704,48 @@ static int mp3_play(struct ast_channel *chan, const char *data)
   char *filename = (char *)args.filename;
 
   decoder.filename = filename;
+  tms_control_init(&sender.control, chan, args.stopdtmfs);
+  playback = tms_playback_start(chan, app_play, filename);
+
+  /* 由调度器按发送时间发送RTP包 */
+  split_size = tms_framer_get_ptime(chan) * ALAW_SAMPLE_RATE / 1000;
+  sender.pacer = tms_pacer_session_create(chan);
+  sender.pool = tms_pacer_pool_create(sender.pacer, AST_FRAME_VOICE, ast_format_alaw, sender.src, 1);
+  if (!sender.pool)
+  {
+    ast_log(LOG_ERROR, "通道 %s 建立发送会话失败，无法播放文件 %s\n", ast_channel_name(chan), filename);
+    goto clean;
+  }
+  sender.start_time_us = tms_pacer_now_us();
+  tms_pacer_session_set_info(sender.pacer, app_play, filename);
+  /* 帧带有时间戳，从通道上次播放结束的位置继续 */
+  sender.timeline = tms_timeline_get(chan);
+  sender.base_ts = tms_timeline_start(sender.timeline, AST_FRAME_VOICE, sender.start_time_us) / (ALAW_SAMPLE_RATE / 1000);
+  tms_framer_init(&sender.framer, split_size, sender_output, &sender);
+
+  /* 已经有转码结果，直接发送缓存中的采样，不需要编解码 */
+  if (tms_pcma_cache_open(&pcma_cache, filename) == TMS_PCMA_CACHE_READ)
+  {
+    uint8_t *samples;
+    size_t nb_samples;
+    while ((nb_samples = tms_pcma_cache_read(&pcma_cache, split_size, &samples)) > 0)
+    {
+      encoder.nb_rtps++;
+      if (send_rtp(&sender, samples, nb_samples) < 0)
+      {
+        ast_debug(1, "停止播放文件 %s\n", filename);
+        ret = sender.event == TMS_CONTROL_STOP ? 0 : -1;
+        reason = tms_control_reason(sender.event);
+        goto clean;
+      }
+    }
+    ast_debug(1, "结束播放文件 %s，使用转码缓存，共发送RTP包 %d 个\n", filename, encoder.nb_rtps);
+    /* 等待排队的包发送完 */
+    tms_pacer_session_close(sender.pacer, 1);
+    sender.pacer = NULL;
+    reason = TMS_PLAYBACK_COMPLETE;
+    goto clean;
+  }
 
   /* 设置解码器 */
   if ((ret = init_decoder(&decoder)) < 0)
@@ -821,8 +767,11 @@ static int mp3_play(struct ast_channel *chan, const char *data)
 
   while (1)
   {
+    tms_pacer_session_stage_begin(sender.pacer);
     if ((ret = av_read_frame(decoder.ictx, decoder.packet)) == AVERROR_EOF)
     {
+      /* 读完文件是正常结束，和使用转码缓存时一样返回0，拨号计划继续执行 */
+      ret = 0;
       break;
     }
     else if (ret < 0)
@@ -830,6 +779,7 @@ static int mp3_play(struct ast_channel *chan, const char *data)
       ast_log(LOG_WARNING, "文件 %s 读取编码包失败 %s\n", filename, av_err2str(ret));
       goto clean;
     }
+    tms_pacer_session_stage(sender.pacer, TMS_PACER_STAGE_READ);
 
     decoder.nb_packets++;
     decoder.nb_bytes += decoder.packet->size;
@@ -859,6 +809,7 @@ static int mp3_play(struct ast_channel *chan, const char *data)
 
       decoder.nb_frames++;
       decoder.nb_samples += decoder.frame->nb_samples;
+      tms_pacer_session_stage(sender.pacer, TMS_PACER_STAGE_DECODE);
       tms_dump_audio_frame(decoder.nb_packets, decoder.nb_frames, decoder.frame);
       ast_debug(2, "decoder.nb_frames:%d,decoder.frame->nb_samples:%d,decoder.nb_samples:%d\n",decoder.nb_frames,decoder.frame->nb_samples,decoder.nb_samples);
       /* 添加时间间隔 */
@@ -878,6 +829,7 @@ static int mp3_play(struct ast_channel *chan, const char *data)
       {
         goto clean;
       }
+      tms_pacer_session_stage(sender.pacer, TMS_PACER_STAGE_RESAMPLE);
       encoder.nb_frames++;
 
       /* 音频帧送编码器准备编码 */
@@ -904,7 +856,16 @@ static int mp3_play(struct ast_channel *chan, const char *data)
         }
         encoder.nb_packets++;
         encoder.nb_bytes += encoder.packet.size;
-        split_packet_size(chan,src,split_size,tmp,sizeof(tmp), &encoder);
+        /* 记录转码结果，后续播放直接使用 */
+        tms_pcma_cache_write(&pcma_cache, encoder.packet.data, encoder.packet.size);
+        tms_pacer_session_stage(sender.pacer, TMS_PACER_STAGE_ENCODE);
+        if (tms_framer_push(&sender.framer, encoder.packet.data, encoder.packet.size) < 0)
+        {
+          ast_debug(1, "停止播放文件 %s\n", filename);
+          ret = sender.event == TMS_CONTROL_STOP ? 0 : -1;
+          reason = tms_control_reason(sender.event);
+          goto clean;
+        }
         //ast_debug(2, "生成编码包 #%d size= %d \n", encoder.nb_packets, encoder.packet.size);
       }
       av_packet_unref(&encoder.packet);
@@ -913,13 +874,16 @@ static int mp3_play(struct ast_channel *chan, const char *data)
     ast_debug(2,"@@@avcodec_receive_frame while after!@@@\n");
     av_packet_unref(decoder.packet);
   }
-  ast_debug(2,"@@@av_read_frame while after,strlen(tmp):%d !@@@\n",(int)strlen(tmp));
-  if(strlen(tmp)>0)
-  {
-
-    send_rtp(chan, src, tmp,strlen(tmp));
-    ast_debug(2,"@@@av_read_frame while after,#####send_rtp####strlen(tmp):%d !@@@\n",(int)strlen(tmp));
-  }
+  /* 发送最后不足1个包的采样 */
+  tms_framer_flush(&sender.framer);
+  encoder.nb_rtps += sender.framer.nb_frames;
+  /* 完整播放后保存转码结果 */
+  tms_pcma_cache_close(&pcma_cache, 1);
+  ast_debug(1, "文件 %s 最大发送延迟 %ld 微秒\n", filename, tms_pacer_session_max_late_us(sender.pacer));
+  /* 等待排队的包发送完 */
+  tms_pacer_session_close(sender.pacer, 1);
+  sender.pacer = NULL;
+  reason = TMS_PLAYBACK_COMPLETE;
  
   
   int64_t end_time = av_gettime_relative();
@@ -927,17 +891,37 @@ static int mp3_play(struct ast_channel *chan, const char *data)
   ast_debug(1, "结束播放文件 %s，共读取 %d 个包，共 %d 字节，共生成 %d 个包，共 %d 字节，共发送RTP包 %d 个，采样 %d 个，耗时 %ld\n", filename, decoder.nb_packets, decoder.nb_bytes, encoder.nb_packets, encoder.nb_bytes, encoder.nb_rtps, decoder.nb_samples, end_time - start_time);
 
 clean:
+  tms_pcma_cache_close(&pcma_cache, 0);
+  tms_pacer_session_close(sender.pacer, 0);
+  tms_timeline_end(sender.timeline, AST_FRAME_VOICE, sender.last_ts * (ALAW_SAMPLE_RATE / 1000), sender.last_deadline_us, sender.nb_rtps, sender.nb_samples);
+  tms_playback_end(playback, reason);
+
   if (resampler.data)
     av_freep(&resampler.data);
 
-  // if (decoder.frame)
-  //   av_frame_free(&decoder.frame);
+  if (resampler.swrctx)
+    swr_free(&resampler.swrctx);
+
+  /* 中途停止时编码器中还有没有取出的包和帧 */
+  av_packet_unref(&encoder.packet);
+
+  if (encoder.frame)
+    av_frame_free(&encoder.frame);
 
-  // if (input_pkt)
-  //   av_packet_free(&input_pkt);
+  if (encoder.cctx)
+    avcodec_free_context(&encoder.cctx);
 
-  // if (ictx)
-  //   avformat_close_input(&ictx);
+  if (decoder.frame)
+    av_frame_free(&decoder.frame);
+
+  if (decoder.packet)
+    av_packet_free(&decoder.packet);
+
+  if (decoder.cctx)
+    avcodec_free_context(&decoder.cctx);
+
+  if (decoder.ictx)
+    avformat_close_input(&decoder.ictx);
 
   /* Unlock module*/
   ast_module_user_remove(u);
@@ -960,11 +944,37 @@ static int unload_module(void)
   return res;
 }
 
+/* 读取alaw转码缓存配置 */
+static void tms_load_config(void)
+{
+  struct ast_flags config_flags = {0};
+  struct ast_config *cfg = ast_config_load(TMS_CONFIG_FILE, config_flags);
+  const char *val;
+
+  if (!cfg || cfg == CONFIG_STATUS_FILEINVALID)
+  {
+    ast_debug(1, "没有找到配置文件 %s，使用默认缓存配置\n", TMS_CONFIG_FILE);
+    return;
+  }
+
+  val = ast_variable_retrieve(cfg, "pcma_cache", "enabled");
+  tms_pcma_cache_config(!val || ast_true(val), ast_variable_retrieve(cfg, "pcma_cache", "dir"));
+
+  ast_config_destroy(cfg);
+}
+
 static int load_module(void)
 {
+  tms_load_config();
+
   int res = ast_register_application(app_play, mp3_play, syn_play, des_play);
 
   return res;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "TMS mp3 applications");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "TMS mp3 applications",
+  .support_level = AST_MODULE_SUPPORT_EXTENDED,
+  .load = load_module,
+  .unload = unload_module,
+  .nonoptreq = "res_tms",
+);
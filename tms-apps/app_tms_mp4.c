@@ -21,6 +21,11 @@
  * \ingroup applications
  */
 
+/*** MODULEINFO
+	<depend>res_tms</depend>
+	<support_level>extended</support_level>
+ ***/
+
 #include <asterisk.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,63 +58,144 @@
 #include <libavutil/timestamp.h>
 #include <libswresample/swresample.h>
 
+#include "tms_cache.h"
+#include "tms_control.h"
 #include "tms_h264.h"
 #include "tms_pcma.h"
+#include "tms_pcma_cache.h"
+#include "tms_playback.h"
 #include "tms_rtp.h"
 #include "tms_stream.h"
 
 static const char *app_play = "TMSMp4Play";
 static const char *syn_play = "MP4 file playblack";
-static const char *des_play = "  TMSMp4Play(filename,[stopdtmfs]):  Play mp4 file to user. \n";
+static const char *des_play = "  TMSMp4Play(filename,[repeat],[duration],[stopdtmfs],[pausedtmfs],[resumedtmfs],[ffdtmfs],[rwdtmfs],[skip],[offset]):  Play mp4 file to user. \n";
+
+#define TMS_MAX_STREAMS 2 // 支持的最大媒体流数量
+
+#define TMS_DEFAULT_SKIP_MS 10000 // 快进快退的默认时长
+
+#define TMS_POSITION_VAR "TMSPOSITION" // 记录结束播放位置的通道变量，单位秒
+
+static const char *app_playlist = "TMSPlaylist";
+static const char *syn_playlist = "Gapless mp4/h264 playlist";
+static const char *des_playlist = "  TMSPlaylist(file1[&file2[&...]],[stopdtmfs],[pausedtmfs],[resumedtmfs]):  Play files one after another on one timeline. \n";
 
-/* 打开指定的文件，获得媒体流信息 */
-static int tms_open_file(char *filename, AVFormatContext **ictx, AVBSFContext **h264bsfc, Resampler *resampler, PCMAEnc *pcma_enc, TmsInputStream **ists, int *out_nb_streams)
+/**
+ * 播放列表中多个文件共用的时钟
+ *
+ * 后面的文件的发送时间从前1个文件结束的位置继续，RTP时间戳由通道的时间线（tms_timeline.h）按发送时间推算。
+ */
+typedef struct TmsPlaylistClock
+{
+  int started;
+  int64_t start_time_us;        // 第1个文件的开始发送时间
+  int64_t media_offset_us;      // 当前文件在时间线上的开始位置，不包含暂停
+  int64_t pause_duration_us;    // 之前的文件暂停的总时长
+} TmsPlaylistClock;
+
+/**
+ * 在后台线程中打开播放列表的下1个文件
+ *
+ * 读取媒体缓存（第一次播放时解封装整个文件）或者打开文件、读取媒体流信息都在后台完成，当前文件播放结束时直接使用。
+ */
+typedef struct TmsPreload
+{
+  pthread_t thread;
+  int started;
+  char *filename;
+  TmsPacketReader reader;
+  int ret;
+} TmsPreload;
+
+#define TMS_CONFIG_FILE "tms.conf"
+
+/**
+ * 打开指定的文件，获得媒体流信息。文件的媒体包优先从缓存中读取。
+ *
+ * reader已经打开（播放列表预先打开）时直接使用。
+ */
+static int tms_open_file(char *filename, TmsPacketReader *reader, AVBSFContext **h264bsfc, TmsAvcConfig *avc, Resampler *resampler, PCMAEnc *pcma_enc, TmsPcmaCache *pcma_cache, TmsInputStream **ists, int *out_nb_streams)
 {
   int ret = 0;
+  int nb_streams = 0;
 
-  /* 打开指定的媒体文件 */
-  if ((ret = avformat_open_input(ictx, filename, NULL, NULL)) < 0)
+  if (!reader->entry && !reader->ictx && tms_packet_reader_open(reader, filename) < 0)
   {
-    ast_log(LOG_WARNING, "无法打开媒体文件 %s\n", filename);
     return -1;
   }
+  if (reader->ictx)
+  {
+    /* 文件超出缓存上限，直接读取文件 */
+    nb_streams = reader->ictx->nb_streams;
+    ast_debug(1, "媒体文件 %s nb_streams = %d , duration = %s\n", filename, nb_streams, av_ts2str(reader->ictx->duration));
+  }
+  else
+  {
+    nb_streams = reader->entry->nb_streams;
+    ast_debug(1, "媒体文件 %s 使用缓存 nb_streams = %d , duration = %s\n", filename, nb_streams, av_ts2str(reader->entry->duration));
+  }
+  tms_packet_reader_init(reader);
 
-  /* 获得指定的视频文件的信息 */
-  if ((ret = avformat_find_stream_info(*ictx, NULL)) < 0)
+  if (nb_streams > TMS_MAX_STREAMS)
   {
-    ast_log(LOG_WARNING, "无法获取媒体文件信息 %s\n", filename);
+    ast_log(LOG_WARNING, "媒体文件 %s 包含 %d 个媒体流，最多支持 %d 个\n", filename, nb_streams, TMS_MAX_STREAMS);
     return -1;
   }
 
-  int nb_streams = (*ictx)->nb_streams;
-
-  ast_debug(1, "媒体文件 %s nb_streams = %d , duration = %s\n", filename, nb_streams, av_ts2str((*ictx)->duration));
-
   int i = 0;
   for (; i < nb_streams; i++)
   {
     TmsInputStream *ist = malloc(sizeof(TmsInputStream));
-    tms_init_input_stream(*ictx, i, ist);
+    if (reader->entry)
+    {
+      TmsCacheStream *cs = &reader->entry->streams[i];
+      ret = tms_init_input_stream_par(i, cs->codecpar, cs->time_base, cs->avg_frame_rate, cs->duration, ist);
+    }
+    else
+    {
+      ret = tms_init_input_stream(reader->ictx, i, ist);
+    }
+    if (ret < 0)
+    {
+      free(ist);
+      *out_nb_streams = i;
+      return -1;
+    }
     tms_dump_stream_format(ist);
 
     ists[i] = ist;
 
     if (ist->codec->type == AVMEDIA_TYPE_VIDEO)
     {
+      /* avcC格式直接按长度前缀分包，不需要转换为annexb格式 */
+      if (ist->codecpar->codec_id == AV_CODEC_ID_H264 &&
+          tms_avc_parse_extradata(ist->codecpar->extradata, ist->codecpar->extradata_size, avc) == 0)
+      {
+        ast_debug(1, "视频流 #%d 是avcC格式 nal_length_size = %d，包含 %d 个参数集\n", i, avc->nal_length_size, avc->nb_param_sets);
+        continue;
+      }
+
       const AVBitStreamFilter *filter = av_bsf_get_by_name("h264_mp4toannexb");
       ret = av_bsf_alloc(filter, h264bsfc);
-      avcodec_parameters_copy((*h264bsfc)->par_in, ist->st->codecpar);
+      avcodec_parameters_copy((*h264bsfc)->par_in, ist->codecpar);
       av_bsf_init(*h264bsfc);
     }
     else if (ist->codec->type == AVMEDIA_TYPE_AUDIO)
     {
+      /* 已经有转码结果，不需要编码器和重采样 */
+      if (tms_pcma_cache_open(pcma_cache, filename) == TMS_PCMA_CACHE_READ)
+        continue;
+
       if ((ret = tms_init_pcma_encoder(pcma_enc)) < 0)
       {
+        *out_nb_streams = i + 1;
         return -1;
       }
       /* 设置重采样，将解码出的fltp采样格式，转换为s16采样格式 */
       if ((ret = tms_init_audio_resampler(ist->dec_ctx, pcma_enc->cctx, resampler)) < 0)
       {
+        *out_nb_streams = i + 1;
         return -1;
       }
     }
@@ -125,20 +211,11 @@ static void tms_free_input_streams(TmsInputStream **ists, int nb_streams)
   int i = 0;
   for (; i < nb_streams; i++)
   {
+    tms_free_input_stream(ists[i]);
     free(ists[i]);
   }
 }
-/* 根据指定的开始时间生成rtp起始时间戳 */
-static uint32_t tms_rtp_base_timestamp(struct timeval tvstart)
-{
-  uint64_t base_timestamp = tvstart.tv_sec * AV_TIME_BASE + tvstart.tv_usec; // 单位是微秒
-  uint32_t rtp_base_timestamp = base_timestamp;
-
-  ast_debug(1, "tvstart.tv_sec = %ld tvstart.tv_usec = %ld base_timestamp = %ld rtp_base_timestamp = %u\n", (uint64_t)tvstart.tv_sec, (uint64_t)tvstart.tv_usec, base_timestamp, rtp_base_timestamp);
-
-  return rtp_base_timestamp;
-}
-/* 初始化视频rtp发送上下文 */
+/* 初始化视频rtp发送上下文，base_timestamp是媒体位置0的RTP时间戳 */
 static int tms_init_video_rtp_context(TmsVideoRtpContext *video_rtp_ctx, uint8_t *video_buf, uint32_t base_timestamp)
 {
   video_rtp_ctx->buf = video_buf;
@@ -148,10 +225,17 @@ static int tms_init_video_rtp_context(TmsVideoRtpContext *video_rtp_ctx, uint8_t
 
   video_rtp_ctx->cur_timestamp = 0;
   video_rtp_ctx->base_timestamp = base_timestamp;
+  video_rtp_ctx->deadline_us = 0;
+
+  memset(&video_rtp_ctx->history, 0, sizeof(TmsVideoHistory));
+
+  video_rtp_ctx->param_cache.nb_param_sets = 0;
+  video_rtp_ctx->inject_param_sets = 1;
+  video_rtp_ctx->nb_param_sets_sent = 0;
 
   return 0;
 }
-/* 初始化音频rtp发送上下文 */
+/* 初始化音频rtp发送上下文，base_timestamp是媒体位置0的帧时间戳，单位是毫秒 */
 static int tms_init_audio_rtp_context(TmsAudioRtpContext *audio_rtp_ctx, uint32_t base_timestamp)
 {
   audio_rtp_ctx->cur_timestamp = base_timestamp;
@@ -159,86 +243,31 @@ static int tms_init_audio_rtp_context(TmsAudioRtpContext *audio_rtp_ctx, uint32_
   return 0;
 }
 
-/* 发送rtcp包，控制音视频流的同步 */
-static int tms_audio_rtcp_first_sr(TmsPlayerContext *player, TmsAudioRtpContext *audio_rtp_ctx)
-{
-  int ret = 0;
-
-  struct timeval now = ast_tvnow();
-  uint8_t rtcp[28]; // 28个字节
-  uint32_t audio_first_rtcp_ts = audio_rtp_ctx->cur_timestamp * 8 - 8000;
-  tms_rtcp_first_sr(rtcp, player->rtp_audio_ssrc, now, audio_first_rtcp_ts);
-  int sockfd;
-  if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
-  {
-    ast_log(LOG_ERROR, "建立socket失败\n");
-  }
-  else
-  {
-    struct sockaddr_in rtcp_addr = player->rtp_audio_dest_addr;
-    int port = ntohs(rtcp_addr.sin_port) + 1;
-    rtcp_addr.sin_port = htons(port);
-    ret = sendto(sockfd, rtcp, 28, 0, (struct sockaddr *)&rtcp_addr, sizeof(struct sockaddr_in));
-    if (ret < 0)
-    {
-      ast_log(LOG_ERROR, "Audio RTCP 首个发送失败 fd = %d %d\n", sockfd, ret);
-    }
-  }
-
-  player->first_rtcp_auido = 1;
-
-  return 0;
-}
-/* 发送rtcp包，控制音视频流的同步 */
-static int tms_video_rtcp_first_sr(TmsPlayerContext *player, TmsVideoRtpContext *video_rtp_ctx)
-{
-  int ret = 0;
-
-  struct timeval now = ast_tvnow();
-  uint8_t rtcp[28]; // 28个字节
-  uint32_t video_first_rtcp_ts = video_rtp_ctx->cur_timestamp;
-  tms_rtcp_first_sr(rtcp, player->rtp_video_ssrc, now, video_first_rtcp_ts);
-  int sockfd;
-  if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
-  {
-    ast_log(LOG_ERROR, "建立socket失败\n");
-  }
-  else
-  {
-    struct sockaddr_in rtcp_addr = player->rtp_video_dest_addr;
-    int port = ntohs(rtcp_addr.sin_port) + 1;
-    rtcp_addr.sin_port = htons(port);
-    ret = sendto(sockfd, rtcp, 28, 0, (struct sockaddr *)&rtcp_addr, sizeof(struct sockaddr_in));
-    if (ret < 0)
-    {
-      ast_log(LOG_ERROR, "Video RTCP 首个发送失败 fd = %d %d\n", sockfd, ret);
-    }
-  }
-  player->first_rtcp_video = 1;
-
-  return 0;
-}
 /* 处理视频媒体包 */
-static int tms_handle_video_packet(TmsPlayerContext *player, TmsInputStream *ist, AVPacket *pkt, AVBSFContext *h264bsfc, TmsVideoRtpContext *video_rtp_ctx)
+static int tms_handle_video_packet(TmsPlayerContext *player, TmsInputStream *ist, AVPacket *pkt, AVBSFContext *h264bsfc, const TmsAvcConfig *avc, TmsVideoRtpContext *video_rtp_ctx)
 {
   int ret = 0;
 
   player->nb_video_packets++;
-  /*将avcc格式转为annexb格式*/
-  if ((ret = av_bsf_send_packet(h264bsfc, pkt)) < 0)
+  /*将avcc格式转为annexb格式，avcC格式的h264流直接发送*/
+  if (h264bsfc)
   {
-    ast_log(LOG_ERROR, "av_bsf_send_packet error");
-    return -1;
+    if ((ret = av_bsf_send_packet(h264bsfc, pkt)) < 0)
+    {
+      ast_log(LOG_ERROR, "av_bsf_send_packet error");
+      return -1;
+    }
+    while ((ret = av_bsf_receive_packet(h264bsfc, pkt)) == 0)
+      ;
   }
-  while ((ret = av_bsf_receive_packet(h264bsfc, pkt)) == 0)
-    ;
+  tms_pacer_session_stage(player->pacer, TMS_PACER_STAGE_BSF);
 
   tms_dump_video_packet(pkt, player);
 
   /* 处理视频包 */
   if (!ist->saw_first_ts)
   {
-    ist->dts = ist->st->avg_frame_rate.num ? -ist->dec_ctx->has_b_frames * AV_TIME_BASE / av_q2d(ist->st->avg_frame_rate) : 0;
+    ist->dts = ist->avg_frame_rate.num ? -ist->dec_ctx->has_b_frames * AV_TIME_BASE / av_q2d(ist->avg_frame_rate) : 0;
     ist->next_dts = ist->dts;
     ist->saw_first_ts = 1;
   }
@@ -247,36 +276,40 @@ static int tms_handle_video_packet(TmsPlayerContext *player, TmsInputStream *ist
     ist->dts = ist->next_dts;
   }
 
-  /* 添加发送间隔 */
+  /* 按照dts指定发送时间 */
   int64_t dts = ist->dts;
   int64_t elapse = av_gettime_relative() - player->start_time_us - player->pause_duration_us;
-  if (dts > elapse)
-    usleep(dts - elapse);
+  video_rtp_ctx->deadline_us = player->start_time_us + player->pause_duration_us + dts;
 
-  ist->next_dts += av_rescale_q(pkt->duration, ist->st->time_base, AV_TIME_BASE_Q);
+  ist->next_dts += av_rescale_q(pkt->duration, ist->time_base, AV_TIME_BASE_Q);
 
-  /* 指定帧时间戳，单位是毫秒 */
-  int64_t video_ts = video_rtp_ctx->base_timestamp + dts; // 微秒
   /**
-   * int h264_sample_rate = (int)ast_format_get_sample_rate(ast_format_h264);
-   * asterisk中，h264的sample_rate取到的值是1000，实际上应该是90000，需要在设置ts的时候修正
+   * 指定帧时间戳
+   * asterisk中h264的采样率是1000，ts直接作为RTP时间戳，需要按90000的RTP时钟设置（见tms_rtp_write_video）
    */
-  video_rtp_ctx->cur_timestamp = video_ts / 1000 * (RTP_H264_TIME_BASE / 1000); // 毫秒
-  if (!player->first_rtcp_video)
+  video_rtp_ctx->cur_timestamp = video_rtp_ctx->base_timestamp + av_rescale(dts, RTP_H264_TIME_BASE, AV_TIME_BASE);
+
+  /* 记录关键帧，对端请求关键帧时重发；重发后丢弃非关键帧，直到文件中的下1个关键帧 */
+  if (!tms_video_history_begin(&video_rtp_ctx->history, pkt->flags & AV_PKT_FLAG_KEY))
   {
-    tms_video_rtcp_first_sr(player, video_rtp_ctx);
+    ast_debug(2, "重发关键帧后丢弃非关键帧 dts = %ld\n", dts);
+    return 0;
   }
 
-  ast_debug(2, "elapse = %ld dts = %ld base_timestamp = %d video_ts = %ld\n", elapse, dts, video_rtp_ctx->base_timestamp, video_ts);
+  ast_debug(2, "elapse = %ld dts = %ld base_timestamp = %u rtp_ts = %u\n", elapse, dts, video_rtp_ctx->base_timestamp, video_rtp_ctx->cur_timestamp);
 
   /* 发送RTP包 */
-  ff_rtp_send_h264(video_rtp_ctx, pkt->data, pkt->size, player);
+  if (h264bsfc)
+    ff_rtp_send_h264(video_rtp_ctx, pkt->data, pkt->size, player);
+  else
+    tms_rtp_send_h264_avcc(video_rtp_ctx, pkt->data, pkt->size, avc, player);
+  tms_pacer_session_stage(player->pacer, TMS_PACER_STAGE_PACKETIZE);
 
   return 0;
 }
 /* 处理音频媒体包 */
 // --- 2020-12-24 by wpc modify , add two parameter char *sendbuff,int sendbuff_memory_size end ---
-static int tms_handle_audio_packet(TmsPlayerContext *player, TmsInputStream *ist, Resampler *resampler, PCMAEnc *pcma_enc, AVPacket *pkt, AVFrame *frame, TmsAudioRtpContext *audio_rtp_ctx,rtp_split_msg *msg)
+static int tms_handle_audio_packet(TmsPlayerContext *player, TmsInputStream *ist, Resampler *resampler, PCMAEnc *pcma_enc, TmsPcmaCache *pcma_cache, AVPacket *pkt, AVFrame *frame, TmsAudioRtpContext *audio_rtp_ctx,rtp_split_msg *msg)
 {
   int ret = 0;
   player->nb_audio_packets++;
@@ -308,6 +341,7 @@ static int tms_handle_audio_packet(TmsPlayerContext *player, TmsInputStream *ist
     }
     nb_packet_frames++;
     player->nb_audio_frames++;
+    tms_pacer_session_stage(player->pacer, TMS_PACER_STAGE_DECODE);
     tms_dump_audio_frame(frame, player);
 
     /* 添加发送间隔 */
@@ -327,6 +361,7 @@ static int tms_handle_audio_packet(TmsPlayerContext *player, TmsInputStream *ist
     {
       return -1;
     }
+    tms_pacer_session_stage(player->pacer, TMS_PACER_STAGE_RESAMPLE);
     player->nb_pcma_frames++;
 
     /* 音频帧送编码器准备编码 */
@@ -354,14 +389,18 @@ static int tms_handle_audio_packet(TmsPlayerContext *player, TmsInputStream *ist
       /* 计算时间戳，单位毫秒（milliseconds） a*b/c */
       //---2020-12-24 by wpc add --- 由于pcma在大网传输中进行每160采样发送一次,所以从mp4中读取的一个音频帧要拆分多个指定大小160包进行发送
       audio_rtp_ctx->cur_timestamp += av_rescale(pcma_enc->nb_samples, AV_TIME_BASE, RTP_PCMA_TIME_BASE) / 1000;
-      if (!player->first_rtcp_auido)
+      if (!player->audio_started)
       {
-        tms_audio_rtcp_first_sr(player, audio_rtp_ctx);
+        player->audio_started = 1;
         *(msg->rtp_timestamp) =  audio_rtp_ctx->cur_timestamp;
       }
+      /* 记录转码结果，后续播放直接使用 */
+      tms_pcma_cache_write(pcma_cache, pcma_enc->packet.data, pcma_enc->packet.size);
       /* 通过rtp发送音频 */
       //tms_rtp_send_audio(audio_rtp_ctx, pcma_enc, player);
-      split_packet_size(msg,pcma_enc,player);
+      tms_pacer_session_stage(player->pacer, TMS_PACER_STAGE_ENCODE);
+      split_packet_size(msg, pcma_enc->packet.data, pcma_enc->packet.size);
+      tms_pacer_session_stage(player->pacer, TMS_PACER_STAGE_PACKETIZE);
     }
     av_packet_unref(&pcma_enc->packet);
     av_frame_free(&pcma_enc->frame);
@@ -375,179 +414,348 @@ static int tms_handle_audio_packet(TmsPlayerContext *player, TmsInputStream *ist
   */
   return 0;
 }
+/* 发送缓存中的alaw采样 */
+static int tms_send_cached_audio(TmsPlayerContext *player, TmsPcmaCache *pcma_cache, size_t nb_samples, TmsAudioRtpContext *audio_rtp_ctx, rtp_split_msg *msg)
+{
+  uint8_t *samples;
+  int ret;
+
+  if ((nb_samples = tms_pcma_cache_read(pcma_cache, nb_samples, &samples)) == 0)
+    return 0;
+
+  player->nb_pcma_frames++;
+
+  audio_rtp_ctx->cur_timestamp += av_rescale(nb_samples, AV_TIME_BASE, RTP_PCMA_TIME_BASE) / 1000;
+  if (!player->audio_started)
+  {
+    player->audio_started = 1;
+    *(msg->rtp_timestamp) = audio_rtp_ctx->cur_timestamp;
+  }
+
+  ret = split_packet_size(msg, samples, nb_samples);
+  tms_pacer_session_stage(player->pacer, TMS_PACER_STAGE_PACKETIZE);
+
+  return ret;
+}
 /**
- * 等恢复播放 
+ * 处理有转码缓存的音频媒体包
+ * 
+ * 不解码，按照媒体包的时长从缓存中取出对应数量的alaw采样
  */
-static int tms_wait_resume(struct ast_channel *chan, char *resumedtmfs, int64_t *pause_duration_us, int *stop)
+static int tms_handle_cached_audio_packet(TmsPlayerContext *player, TmsInputStream *ist, TmsPcmaCache *pcma_cache, AVPacket *pkt, TmsAudioRtpContext *audio_rtp_ctx, rtp_split_msg *msg)
 {
-  int64_t start = av_gettime_relative();
-  int ms = -1;
+  player->nb_audio_packets++;
 
-  while (1)
+  /* 第1个包或者跳转后的第1个包，按包的时间确定缓存中的位置 */
+  if (!ist->saw_first_ts)
   {
-    ms = ast_waitfor(chan, ms);
-    if (ms < 0)
-    {
-      ast_debug(1, "Hangup detected\n");
-      *stop = 1;
-      break;
-    }
-    if (ms)
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    if (ist->start == AV_NOPTS_VALUE)
+      ist->start = ts;
+    ist->next_dts = FFMAX(ts - ist->start, 0);
+    pcma_cache->pos = FFMIN(av_rescale_q(ist->next_dts, ist->time_base, (AVRational){1, RTP_PCMA_TIME_BASE}), pcma_cache->nb_samples);
+    ist->saw_first_ts = 1;
+  }
+
+  /* 按累计时长计算结束位置，避免取整误差累积 */
+  ist->next_dts += pkt->duration;
+  int64_t end = av_rescale_q(ist->next_dts, ist->time_base, (AVRational){1, RTP_PCMA_TIME_BASE});
+  if (end <= pcma_cache->pos)
+    return 0;
+
+  return tms_send_cached_audio(player, pcma_cache, end - pcma_cache->pos, audio_rtp_ctx, msg);
+}
+/* 指定类型的媒体流，没有时返回NULL */
+static TmsInputStream *tms_find_input_stream(TmsInputStream **ists, int nb_streams, enum AVMediaType type)
+{
+  int i;
+
+  for (i = 0; i < nb_streams; i++)
+  {
+    if (ists[i]->codec->type == type)
+      return ists[i];
+  }
+
+  return NULL;
+}
+/**
+ * 音频和视频中较晚的已经发送到的位置，相对文件的开始发送时间，单位微秒
+ *
+ * @param video_delay 视频dts比pts提前的时长（有b帧时）
+ */
+static int64_t tms_mp4_sent_position_us(TmsInputStream **ists, int nb_streams, rtp_split_msg *msg, int64_t *video_delay)
+{
+  TmsInputStream *video = tms_find_input_stream(ists, nb_streams, AVMEDIA_TYPE_VIDEO);
+  int64_t pos_us = msg->nb_samples * AV_TIME_BASE / ALAW_SAMPLE_RATE;
+
+  *video_delay = 0;
+  if (video)
+  {
+    *video_delay = video->avg_frame_rate.num ? video->dec_ctx->has_b_frames * AV_TIME_BASE / av_q2d(video->avg_frame_rate) : 0;
+    if (video->saw_first_ts)
+      pos_us = FFMAX(pos_us, video->next_dts + *video_delay);
+  }
+
+  return pos_us;
+}
+/**
+ * 快进或者快退
+ *
+ * 按关键帧索引跳转到目标位置附近的IDR。发送的时间线不跳变：音频和视频都从跳转前已经发送到的较晚位置继续，
+ * 发送时间和RTP时间戳继续递增，文件中的关键帧对应这个位置。音频中间空出的部分不发送，RTP时间戳跳过对应的采样数。
+ *
+ * @param forward 不为0时跳转到目标位置之后的关键帧，否则跳转到之前的关键帧
+ * @return 0 成功或者不能跳转，继续播放；1 跳转到了文件结尾
+ */
+static int tms_mp4_seek(TmsPacketReader *reader, TmsInputStream **ists, int nb_streams, AVBSFContext *h264bsfc, TmsPcmaCache *pcma_cache, TmsAudioRtpContext *audio_rtp_ctx, rtp_split_msg *msg, int64_t target_us, int forward)
+{
+  TmsInputStream *video = tms_find_input_stream(ists, nb_streams, AVMEDIA_TYPE_VIDEO);
+  TmsInputStream *audio = tms_find_input_stream(ists, nb_streams, AVMEDIA_TYPE_AUDIO);
+  int64_t from_us = reader->position_us;
+  int64_t keyframe_us = 0, video_delay = 0, pos_us, gap;
+  int ret;
+
+  /* 跳转前已经发送到的位置 */
+  tms_flush_split_msg(msg);
+  pos_us = tms_mp4_sent_position_us(ists, nb_streams, msg, &video_delay);
+
+  target_us = FFMAX(target_us, 0);
+  if ((ret = tms_packet_reader_seek(reader, target_us, forward, &keyframe_us)) < 0)
+    return 0;
+  if (ret > 0)
+  {
+    ast_debug(1, "跳转到 %" PRId64 " 微秒，之后没有关键帧，结束播放\n", target_us);
+    /* 结束时不再发送转码缓存中剩余的采样 */
+    if (pcma_cache->state == TMS_PCMA_CACHE_READ)
+      pcma_cache->pos = pcma_cache->nb_samples;
+    return 1;
+  }
+
+  ast_debug(1, "从 %" PRId64 " 跳转到 %" PRId64 " 微秒，关键帧 %" PRId64 " 微秒，发送位置 %" PRId64 " 微秒\n", from_us, target_us, keyframe_us, pos_us);
+
+  if (video)
+  {
+    video->dts = video->next_dts = pos_us - video_delay;
+    video->saw_first_ts = 1;
+    if (h264bsfc)
+      av_bsf_flush(h264bsfc);
+  }
+
+  if (audio)
+  {
+    /* 音频发送位置对齐到毫秒，和RTP时间戳（毫秒）一致 */
+    gap = (pos_us * ALAW_SAMPLE_RATE / AV_TIME_BASE - msg->nb_samples) / (ALAW_SAMPLE_RATE / 1000) * (ALAW_SAMPLE_RATE / 1000);
+    if (gap > 0)
     {
-      struct ast_frame *f = ast_read(chan);
-      if (!f)
-      {
-        ast_debug(1, "Null frame == hangup() detected\n");
-        *stop = 1;
-        break;
-      }
-      /* 如果是dtmf，检查是否需要处理按键控制逻辑 */
-      if (f->frametype == AST_FRAME_DTMF)
-      {
-        char key[2] = {(char)f->subclass.integer, '\0'};
-        ast_debug(2, "等待恢复，收到DTMF：key=%s\n", key);
-        /* 恢复播放 */
-        if (!ast_strlen_zero(resumedtmfs) && strchr(resumedtmfs, key[0]))
-        {
-          break;
-        }
-      }
-      ast_frfree(f);
+      msg->nb_samples += gap;
+      *(msg->rtp_timestamp) += gap / (ALAW_SAMPLE_RATE / 1000);
+      audio_rtp_ctx->cur_timestamp += gap / (ALAW_SAMPLE_RATE / 1000);
     }
+    /* 转码缓存按新位置读取，还没有读到音频包时按从0开始；没有完整播放，不能生成转码缓存 */
+    audio->saw_first_ts = 0;
+    if (audio->start == AV_NOPTS_VALUE)
+      audio->start = 0;
+    if (pcma_cache->state == TMS_PCMA_CACHE_WRITE)
+      tms_pcma_cache_close(pcma_cache, 0);
+    avcodec_flush_buffers(audio->dec_ctx);
   }
 
-  *pause_duration_us += (av_gettime_relative() - start);
-
   return 0;
 }
+/**
+ * 记录结束播放的位置
+ *
+ * 读取位置减去已经排队但是没有发送的时长。正常结束时排队的帧都会发送，等于读取位置。
+ */
+static void tms_mp4_set_position(struct ast_channel *chan, TmsPacketReader *reader, TmsPlayerContext *player, int drain)
+{
+  int64_t position_us = reader->position_us;
+  int64_t queued_us = FFMAX(player->audio_rtcp.last_deadline_us, player->video_rtcp.last_deadline_us) - tms_pacer_now_us();
+  char buf[32];
+
+  if (!drain && queued_us > 0)
+    position_us = FFMAX(position_us - queued_us, 0);
+
+  snprintf(buf, sizeof(buf), "%.3f", position_us / 1000000.0);
+  pbx_builtin_setvar_helper(chan, TMS_POSITION_VAR, buf);
+
+  ast_debug(1, "结束播放位置 %s 秒\n", buf);
+}
 /**
  * 播放指定的mp4文件
+ *
+ * @param stop 停止播放的原因，等于TMS_PLAYBACK_COMPLETE时继续播放下1次或者下1个文件
+ * @param control 控制播放的按键
+ * @param offset_ms 开始播放的位置，从这个位置之前最近的关键帧开始，等于0时从头播放
+ * @param preloaded 预先打开的文件，可以为NULL；使用后清空
+ * @param playlist_clock 播放列表的时钟，可以为NULL；完整播放后前进到文件结束的位置
  */
-static int mp4_play_once(struct ast_channel *chan, char *filename, int *stop, int max_playing_ms, char *stopdtmfs, char *pausedtmfs, char *resumedtmfs, int64_t *out_pause_duration_us)
+static int mp4_play_once(struct ast_channel *chan, char *filename, TmsPlaybackReason *stop, int max_playing_ms, TmsControl *control, int skip_ms, int offset_ms, int64_t *out_pause_duration_us, TmsPacketReader *preloaded, TmsPlaylistClock *playlist_clock)
 {
   int ret = 0;
   int pause = 0; // 暂停状态
-  int ms = -1;
-  char tmp[2048] = {'\0'};
-  TmsInputStream *ists[2]; // 记录媒体流信息
-  AVFormatContext *ictx = NULL;
-  AVBSFContext *h264bsfc; // mp4转h264，将sps和pps放到推送流中
+  int seek = 0;  // 快进（1）或者快退（-1）
+  TmsPlayerContext player = {.pacer = NULL, .rtcp_fd = -1};
+  TmsVideoRtpContext video_rtp_ctx = {.buf = NULL}; // 在clean中释放记录的关键帧
+  TmsInputStream *ists[TMS_MAX_STREAMS]; // 记录媒体流信息
+  TmsPacketReader reader = {.entry = NULL, .next = 0, .ictx = NULL};
+  AVBSFContext *h264bsfc = NULL; // mp4转h264，将sps和pps放到推送流中
+  TmsAvcConfig avc = {.nal_length_size = 0}; // avcC格式的h264流不使用h264bsfc
   /* 音频重采样 */
   Resampler resampler = {.max_nb_samples = 0};
   PCMAEnc pcma_enc = {.nb_samples = 0};
+  TmsPcmaCache pcma_cache = {.state = TMS_PCMA_CACHE_NONE}; // alaw转码结果缓存
   int nb_streams = 0; // 媒体流的数量
   uint32_t cur_timestamp = 0;
   rtp_split_msg msg;
-  memset(&msg,0,sizeof(msg));
-  msg.buff = tmp;
-  msg.buff_memory_size = sizeof(tmp);
-  msg.split_packet_size = 160;
 
-  if ((ret = tms_open_file(filename, &ictx, &h264bsfc, &resampler, &pcma_enc, ists, &nb_streams)) < 0)
+  AVPacket *pkt = NULL;
+  AVFrame *frame = NULL;
+
+  if (preloaded)
+  {
+    reader = *preloaded;
+    preloaded->entry = NULL;
+    preloaded->ictx = NULL;
+  }
+
+  if ((ret = tms_open_file(filename, &reader, &h264bsfc, &avc, &resampler, &pcma_enc, &pcma_cache, ists, &nb_streams)) < 0)
   {
-    *stop = 1;
+    *stop = TMS_PLAYBACK_ERROR;
     goto clean;
   }
 
   struct timeval tvstart = ast_tvnow(); // tv_sec 有10位，tv_usec 有6位
 
-  uint32_t rtp_base_timestamp = tms_rtp_base_timestamp(tvstart); // 如果dialplan中连续调用应用，需要让每次推送的rtp流的timestamp具有连续性，因此要基于当前时间生成rtp起始时间戳
   uint8_t video_buf[1470];
-  TmsVideoRtpContext video_rtp_ctx;
   TmsAudioRtpContext audio_rtp_ctx;
 
-  tms_init_video_rtp_context(&video_rtp_ctx, video_buf, rtp_base_timestamp);
-  tms_init_audio_rtp_context(&audio_rtp_ctx, rtp_base_timestamp);
-
-  TmsPlayerContext player;
   if ((ret = tms_init_player_context(chan, &player)) < 0)
   {
-    *stop = 1;
+    *stop = TMS_PLAYBACK_ERROR;
     goto clean;
   }
+  tms_pacer_session_set_info(player.pacer, playlist_clock ? "TMSPlaylist" : "TMSMp4Play", filename);
+  /* 播放列表中后面的文件从时间线的当前位置继续 */
+  if (playlist_clock)
+  {
+    if (!playlist_clock->started)
+    {
+      playlist_clock->started = 1;
+      playlist_clock->start_time_us = player.start_time_us;
+    }
+    else
+    {
+      player.start_time_us = playlist_clock->start_time_us + playlist_clock->media_offset_us + playlist_clock->pause_duration_us;
+    }
+  }
 
-  AVPacket *pkt = av_packet_alloc(); // ffmpeg媒体包
-  AVFrame *frame = av_frame_alloc(); // ffmpeg媒体帧
-  msg.rtp_timestamp = &cur_timestamp;
+  /* 如果dialplan中连续调用应用，RTP时间戳从通道上次播放结束的位置按经过的时间继续 */
+  tms_init_video_rtp_context(&video_rtp_ctx, video_buf, tms_timeline_start(player.timeline, AST_FRAME_VIDEO, player.start_time_us));
+  if (!tms_avc_packetization_mode(chan))
+    video_rtp_ctx.flags |= FF_RTP_FLAG_H264_MODE0;
+  video_rtp_ctx.inject_param_sets = tms_avc_param_sets_mode(chan);
+  tms_avc_param_cache_load(&video_rtp_ctx.param_cache, &avc);
+  tms_init_audio_rtp_context(&audio_rtp_ctx, tms_timeline_start(player.timeline, AST_FRAME_VOICE, player.start_time_us) / (RTP_PCMA_TIME_BASE / 1000));
+
+  pkt = av_packet_alloc();   // ffmpeg媒体包
+  frame = av_frame_alloc(); // ffmpeg媒体帧
+  tms_init_split_msg(&msg, &player, &cur_timestamp, tms_framer_get_ptime(chan) * ALAW_SAMPLE_RATE / 1000);
+
+  /* 从指定位置开始播放，音频从关键帧的时间开始 */
+  if (offset_ms > 0)
+    tms_mp4_seek(&reader, ists, nb_streams, h264bsfc, &pcma_cache, &audio_rtp_ctx, &msg, (int64_t)offset_ms * 1000, 0);
   while (1)
   {
     /**
      * 处理获得的媒体包 
      */
     player.nb_packets++;
-    if ((ret = av_read_frame(ictx, pkt)) == AVERROR_EOF)
+    tms_pacer_session_stage_begin(player.pacer);
+    if ((ret = tms_packet_reader_read(&reader, pkt)) == AVERROR_EOF)
     {
       player.end_time_us = av_gettime_relative();
+      /* 发送缓存中剩余的采样，完整播放后保存转码结果 */
+      tms_send_cached_audio(&player, &pcma_cache, SIZE_MAX, &audio_rtp_ctx, &msg);
+      tms_pcma_cache_close(&pcma_cache, 1);
       break;
     }
     else if (ret < 0)
     {
       ast_log(LOG_WARNING, "读取媒体包 #%d 失败 %s\n", player.nb_packets, av_err2str(ret));
-      *stop = 1;
+      *stop = TMS_PLAYBACK_ERROR;
       goto clean;
     }
 
+    tms_pacer_session_stage(player.pacer, TMS_PACER_STAGE_READ);
+    tms_pacer_session_set_position(player.pacer, reader.position_us);
+
     TmsInputStream *ist = ists[pkt->stream_index];
     if (ist->codec->type == AVMEDIA_TYPE_VIDEO)
     {
-      if ((ret = tms_handle_video_packet(&player, ist, pkt, h264bsfc, &video_rtp_ctx)) < 0)
+      if ((ret = tms_handle_video_packet(&player, ist, pkt, h264bsfc, &avc, &video_rtp_ctx)) < 0)
       {
-        *stop = 1;
+        *stop = TMS_PLAYBACK_ERROR;
         goto clean;
       }
     }
     else if (ist->codec->type == AVMEDIA_TYPE_AUDIO)
     {
       //--- 2020-12-24 by wpc modify ---
-      if ((ret = tms_handle_audio_packet(&player, ist, &resampler, &pcma_enc, pkt, frame, &audio_rtp_ctx,&msg)) < 0)
+      if (pcma_cache.state == TMS_PCMA_CACHE_READ)
+        ret = tms_handle_cached_audio_packet(&player, ist, &pcma_cache, pkt, &audio_rtp_ctx, &msg);
+      else
+        ret = tms_handle_audio_packet(&player, ist, &resampler, &pcma_enc, &pcma_cache, pkt, frame, &audio_rtp_ctx, &msg);
+      if (ret < 0)
       {
-        *stop = 1;
+        *stop = TMS_PLAYBACK_ERROR;
         goto clean;
       }
     }
 
     av_packet_unref(pkt);
 
-    /** 
-     * 解决挂机后数据清理问题和dtmf处理
-     * 是否会存在没有输入的情况？
-     */
-    ms = ast_waitfor(chan, ms);
-    if (ms < 0)
+    /* 定期发送SR，对端据此同步音视频 */
+    tms_rtcp_poll(&player);
+
+    /* 挂机后立即停止，处理控制播放的按键和关键帧请求 */
+    switch (tms_control_poll(control))
     {
-      ast_debug(1, "Hangup detected\n");
-      *stop = 1;
+    case TMS_CONTROL_HANGUP:
+      *stop = TMS_PLAYBACK_HANGUP;
       goto clean;
+    case TMS_CONTROL_STOP:
+      *stop = TMS_PLAYBACK_STOP;
+      goto end;
+    case TMS_CONTROL_PAUSE:
+      pause = 1;
+      break;
+    case TMS_CONTROL_FORWARD:
+      seek = 1;
+      break;
+    case TMS_CONTROL_REWIND:
+      seek = -1;
+      break;
+    default:
+      break;
     }
-    if (ms)
+    if (control->keyframe_requested)
     {
-      struct ast_frame *f = ast_read(chan);
-      if (!f)
-      {
-        ast_debug(1, "Null frame == hangup() detected\n");
-        *stop = 1;
-        goto clean;
-      }
-      /* 如果是dtmf，检查是否需要处理按键控制逻辑 */
-      if (f->frametype == AST_FRAME_DTMF)
-      {
-        char key[2] = {(char)f->subclass.integer, '\0'};
-        ast_debug(2, "收到DTMF(%s)，检查是否需要播放控制\n", key);
-        /* 停止播放 */
-        if (!ast_strlen_zero(stopdtmfs) && strchr(stopdtmfs, key[0]))
-        {
-          pbx_builtin_setvar_helper(chan, "TMSDTMFKEY", key);
-          ast_frfree(f);
-          *stop = 1;
-          goto end;
-        }
-        /* 停止播放 */
-        else if (!ast_strlen_zero(pausedtmfs) && strchr(pausedtmfs, key[0]))
-        {
-          pause = 1;
-        }
-      }
-      ast_frfree(f);
+      control->keyframe_requested = 0;
+      player.video_rtcp.nb_keyframe_requests++;
+      player.keyframe_requested = 1;
+    }
+    /* 对端请求关键帧时立即重发最近的关键帧 */
+    if (player.keyframe_requested)
+    {
+      player.keyframe_requested = 0;
+      tms_video_history_resend(&video_rtp_ctx, &player);
+    }
+    /* 快进快退，跳到文件结尾时按正常结束处理 */
+    if (seek)
+    {
+      tms_mp4_seek(&reader, ists, nb_streams, h264bsfc, &pcma_cache, &audio_rtp_ctx, &msg, reader.position_us + seek * (int64_t)skip_ms * 1000, seek > 0);
+      seek = 0;
     }
     /** 
      * 检查是否已经达到播放时间 
@@ -557,7 +765,7 @@ static int mp4_play_once(struct ast_channel *chan, char *filename, int *stop, in
       if (ast_remaining_ms(tvstart, max_playing_ms + (player.pause_duration_us / 1000)) <= 0)
       {
         ast_debug(1, "播放超时，结束本次播放 %s\n", filename);
-        *stop = 1;
+        *stop = TMS_PLAYBACK_TIMEOUT;
         goto end;
       }
     }
@@ -566,9 +774,11 @@ static int mp4_play_once(struct ast_channel *chan, char *filename, int *stop, in
      */
     if (pause)
     {
-      tms_wait_resume(chan, resumedtmfs, &player.pause_duration_us, stop);
-      if (*stop)
+      if (tms_control_wait_resume(control, &player.pause_duration_us) == TMS_CONTROL_HANGUP)
+      {
+        *stop = TMS_PLAYBACK_HANGUP;
         goto end;
+      }
 
       ast_debug(2, "暂停播放 %ld 微秒\n", player.pause_duration_us);
 
@@ -577,17 +787,31 @@ static int mp4_play_once(struct ast_channel *chan, char *filename, int *stop, in
         *out_pause_duration_us = player.pause_duration_us;
     }
   }
-  if(strlen(tmp)>0)
+  /* 发送最后不足1个包的采样 */
+  tms_flush_split_msg(&msg);
+
+  /* 下1个文件从这个文件结束的位置继续 */
+  if (playlist_clock)
   {
-    tms_send_audio_rtp(&msg, &player, tmp,strlen(tmp));
-    ast_debug(2,"@@@av_read_frame while after,#####send_rtp####strlen(tmp):%d !@@@\n",(int)strlen(tmp));
-  } 
+    int64_t video_delay;
+    playlist_clock->media_offset_us += tms_mp4_sent_position_us(ists, nb_streams, &msg, &video_delay);
+    playlist_clock->pause_duration_us += player.pause_duration_us;
+  }
 
 end:
   /* Log end */
-  ast_debug(1, "完成文件播放 %s，共读取 %d 个包，包含：%d 个视频包，%d 个音频包，用时：%ld微秒\n", filename, player.nb_packets, player.nb_video_packets, player.nb_audio_packets, player.end_time_us - player.start_time_us);
+  ast_debug(1, "完成文件播放 %s，共读取 %d 个包，包含：%d 个视频包，%d 个音频包，用时：%ld微秒，最大发送延迟：%ld微秒\n", filename, player.nb_packets, player.nb_video_packets, player.nb_audio_packets, player.end_time_us - player.start_time_us, tms_pacer_session_max_late_us(player.pacer));
 
 clean:
+  if (nb_streams > 0)
+    tms_mp4_set_position(chan, &reader, &player, !*stop);
+
+  /* 正常结束时等待排队的帧发送完成，停止播放时直接丢弃 */
+  tms_pacer_session_close(player.pacer, !*stop);
+  tms_rtcp_set_channel_vars(&player);
+  tms_rtcp_close(&player);
+  tms_video_history_free(&video_rtp_ctx.history);
+
   if (nb_streams > 0)
     tms_free_input_streams(ists, nb_streams);
 
@@ -603,8 +827,9 @@ clean:
   if (resampler.swrctx)
     swr_free(&resampler.swrctx);
 
-  if (ictx)
-    avformat_close_input(&ictx);
+  tms_pcma_cache_close(&pcma_cache, 0);
+
+  tms_packet_reader_close(&reader);
 
   return ret;
 }
@@ -616,12 +841,15 @@ static int mp4_exec(struct ast_channel *chan, const char *data)
   struct ast_module_user *u = NULL;
 
   char *filename;                             // 要打开的文件
-  char *stopdtmfs, *pausedtmfs, *resumedtmfs; // 控制播放的按键，停止，暂停，恢复
+  TmsControl control;                         // 控制播放的按键，停止，暂停，恢复，快进，快退
+  int skip_ms = TMS_DEFAULT_SKIP_MS;          // 快进快退的时长，单位毫秒
+  int offset_ms = 0;                          // 第1次播放的开始位置，单位毫秒
   int repeat = 0;                             // 重复播放的次数，等于0不重复，共播放1+repeat次
   int max_duration_ms = 0;                    // 播放总时长，单位毫秒
   int remaining_ms = 0;                       // 剩余播放时长，单位毫秒
   int nb_play_times = 0;                      // 已经播放的次数
-  int stop = 0;                               // 是否停止播放
+  TmsPlaybackReason stop = TMS_PLAYBACK_COMPLETE; // 停止播放的原因
+  TmsPlayback *playback;                      // 发送AMI事件
 
   char *parse;
 
@@ -632,7 +860,11 @@ static int mp4_exec(struct ast_channel *chan, const char *data)
       AST_APP_ARG(duration);
       AST_APP_ARG(stopdtmfs);
       AST_APP_ARG(pausedtmfs);
-      AST_APP_ARG(resumedtmfs););
+      AST_APP_ARG(resumedtmfs);
+      AST_APP_ARG(ffdtmfs);
+      AST_APP_ARG(rwdtmfs);
+      AST_APP_ARG(skip);
+      AST_APP_ARG(offset););
 
   ast_debug(1, "进入TMSMp4Play(%s)\n", data);
 
@@ -647,9 +879,12 @@ static int mp4_exec(struct ast_channel *chan, const char *data)
 
   /* 处理传入的参数 */
   filename = args.filename;
-  stopdtmfs = args.stopdtmfs;
-  pausedtmfs = args.pausedtmfs;
-  resumedtmfs = args.resumedtmfs;
+  tms_control_init(&control, chan, args.stopdtmfs);
+  control.pausedtmfs = args.pausedtmfs;
+  control.resumedtmfs = args.resumedtmfs;
+  control.ffdtmfs = args.ffdtmfs;
+  control.rwdtmfs = args.rwdtmfs;
+  playback = tms_playback_start(chan, app_play, filename);
 
   if (!ast_strlen_zero(args.repeat))
   {
@@ -661,6 +896,14 @@ static int mp4_exec(struct ast_channel *chan, const char *data)
     max_duration_ms = atof(args.duration);
     max_duration_ms = max_duration_ms <= 0 ? 0 : max_duration_ms * 1000.0;
   }
+  if (!ast_strlen_zero(args.skip) && atof(args.skip) > 0)
+  {
+    skip_ms = atof(args.skip) * 1000.0;
+  }
+  if (!ast_strlen_zero(args.offset) && atof(args.offset) > 0)
+  {
+    offset_ms = atof(args.offset) * 1000.0;
+  }
 
   struct timeval tvstart = ast_tvnow(); // 开始播放时间
 
@@ -673,18 +916,19 @@ static int mp4_exec(struct ast_channel *chan, const char *data)
       if (remaining_ms <= 0)
       {
         ast_log(LOG_DEBUG, "播放超时，结束播放 %s\n", data);
+        stop = TMS_PLAYBACK_TIMEOUT;
         break;
       }
       else
       {
         int64_t pause_duration_us = 0; // 暂停播放时长
-        mp4_play_once(chan, filename, &stop, remaining_ms, stopdtmfs, pausedtmfs, resumedtmfs, &pause_duration_us);
+        mp4_play_once(chan, filename, &stop, remaining_ms, &control, skip_ms, offset_ms, &pause_duration_us, NULL, NULL);
         max_duration_ms += (pause_duration_us / 1000);
       }
     }
     else
     {
-      mp4_play_once(chan, filename, &stop, 0, stopdtmfs, pausedtmfs, resumedtmfs, NULL);
+      mp4_play_once(chan, filename, &stop, 0, &control, skip_ms, offset_ms, NULL, NULL, NULL);
     }
 
     if (stop)
@@ -694,8 +938,12 @@ static int mp4_exec(struct ast_channel *chan, const char *data)
     }
 
     nb_play_times++;
+    /* 重复播放时从头开始 */
+    offset_ms = 0;
   }
 
+  tms_playback_end(playback, stop);
+
   /* Unlock module*/
   ast_module_user_remove(u);
 
@@ -707,20 +955,192 @@ static int mp4_exec(struct ast_channel *chan, const char *data)
   return 0;
 }
 
+/* 预先打开文件的线程 */
+static void *tms_preload_thread(void *data)
+{
+  TmsPreload *preload = data;
+
+  preload->ret = tms_packet_reader_open(&preload->reader, preload->filename);
+
+  ast_debug(1, "完成预先打开文件 %s ret = %d\n", preload->filename, preload->ret);
+
+  return NULL;
+}
+
+/* 开始在后台打开文件，失败时由播放时再打开 */
+static void tms_preload_start(TmsPreload *preload, char *filename)
+{
+  memset(preload, 0, sizeof(TmsPreload));
+  preload->filename = filename;
+
+  if (ast_pthread_create(&preload->thread, NULL, tms_preload_thread, preload))
+  {
+    ast_log(LOG_WARNING, "无法创建线程预先打开文件 %s\n", filename);
+    return;
+  }
+  preload->started = 1;
+}
+
+/**
+ * 等待后台打开文件完成
+ *
+ * @param reader 不为NULL时获得打开的文件；否则关闭文件
+ */
+static void tms_preload_finish(TmsPreload *preload, TmsPacketReader *reader)
+{
+  if (!preload->started)
+    return;
+
+  pthread_join(preload->thread, NULL);
+  preload->started = 0;
+
+  if (preload->ret < 0 || !reader)
+  {
+    tms_packet_reader_close(&preload->reader);
+    return;
+  }
+
+  *reader = preload->reader;
+}
+
+/**
+ * 播放列表应用主程序
+ *
+ * 按顺序播放用&分隔的多个mp4或h264文件，所有文件共用1个时间线。播放当前文件时在后台打开下1个文件。
+ * 按停止键或者有文件播放失败时结束整个播放列表。
+ */
+static int playlist_exec(struct ast_channel *chan, const char *data)
+{
+  struct ast_module_user *u = NULL;
+  TmsPlaylistClock playlist_clock = {.started = 0};
+  TmsPreload preload = {.started = 0};
+  TmsControl control;
+  TmsPacketReader reader;
+  char *parse, *files, *filename, *next;
+  TmsPlaybackReason stop = TMS_PLAYBACK_COMPLETE;
+  TmsPlayback *playback;
+  int nb_files = 0;
+
+  AST_DECLARE_APP_ARGS(
+      args,
+      AST_APP_ARG(files);
+      AST_APP_ARG(stopdtmfs);
+      AST_APP_ARG(pausedtmfs);
+      AST_APP_ARG(resumedtmfs););
+
+  ast_debug(1, "进入TMSPlaylist(%s)\n", data);
+
+  if (ast_strlen_zero(data))
+  {
+    ast_log(LOG_WARNING, "TMSPlaylist需要指定文件\n");
+    return -1;
+  }
+
+  u = ast_module_user_add(chan);
+
+  parse = ast_strdupa(data);
+  AST_STANDARD_APP_ARGS(args, parse);
+
+  tms_control_init(&control, chan, args.stopdtmfs);
+  control.pausedtmfs = args.pausedtmfs;
+  control.resumedtmfs = args.resumedtmfs;
+  playback = tms_playback_start(chan, app_playlist, args.files);
+
+  files = args.files;
+  filename = strsep(&files, "&");
+  while (!ast_strlen_zero(filename))
+  {
+    memset(&reader, 0, sizeof(TmsPacketReader));
+    tms_preload_finish(&preload, &reader);
+
+    next = strsep(&files, "&");
+    if (!ast_strlen_zero(next))
+      tms_preload_start(&preload, next);
+
+    ast_debug(1, "播放列表第 %d 个文件 %s，时间线位置 %ld 微秒\n", nb_files + 1, filename, playlist_clock.media_offset_us);
+    mp4_play_once(chan, filename, &stop, 0, &control, 0, 0, NULL, &reader, &playlist_clock);
+    tms_packet_reader_close(&reader);
+    nb_files++;
+
+    if (stop)
+    {
+      ast_debug(1, "停止播放列表 %s\n", data);
+      break;
+    }
+    filename = next;
+  }
+
+  /* 停止时下1个文件可能还在打开 */
+  tms_preload_finish(&preload, NULL);
+
+  tms_playback_end(playback, stop);
+
+  ast_module_user_remove(u);
+
+  ast_debug(1, "退出TMSPlaylist(%s)，播放 %d 个文件\n", data, nb_files);
+
+  return 0;
+}
+
+/**
+ * 读取缓存配置，返回媒体缓存的最大字节数，等于0时不使用媒体缓存
+ */
+static size_t tms_load_cache_config(void)
+{
+  size_t max_bytes = TMS_CACHE_DEFAULT_MAX_BYTES;
+  struct ast_flags config_flags = {0};
+  struct ast_config *cfg = ast_config_load(TMS_CONFIG_FILE, config_flags);
+  const char *val;
+
+  if (!cfg || cfg == CONFIG_STATUS_FILEINVALID)
+  {
+    ast_debug(1, "没有找到配置文件 %s，使用默认缓存配置\n", TMS_CONFIG_FILE);
+    return max_bytes;
+  }
+
+  if ((val = ast_variable_retrieve(cfg, "cache", "enabled")) && !ast_true(val))
+  {
+    max_bytes = 0;
+  }
+  else if ((val = ast_variable_retrieve(cfg, "cache", "max_size")))
+  {
+    int max_size_mb = atoi(val);
+    max_bytes = max_size_mb > 0 ? (size_t)max_size_mb * 1024 * 1024 : 0;
+  }
+
+  val = ast_variable_retrieve(cfg, "pcma_cache", "enabled");
+  tms_pcma_cache_config(!val || ast_true(val), ast_variable_retrieve(cfg, "pcma_cache", "dir"));
+
+  ast_config_destroy(cfg);
+
+  return max_bytes;
+}
+
 static int unload_module(void)
 {
   int res = ast_unregister_application(app_play);
+  res |= ast_unregister_application(app_playlist);
 
   ast_module_user_hangup_all();
 
+  tms_media_cache_destroy();
+
   return res;
 }
 
 static int load_module(void)
 {
+  tms_media_cache_init(tms_load_cache_config());
+
   int res = ast_register_application(app_play, mp4_exec, syn_play, des_play);
+  res |= ast_register_application(app_playlist, playlist_exec, syn_playlist, des_playlist);
 
   return res;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "TMS mp4 player applications");
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "TMS mp4 player applications",
+  .support_level = AST_MODULE_SUPPORT_EXTENDED,
+  .load = load_module,
+  .unload = unload_module,
+  .nonoptreq = "res_tms",
+);
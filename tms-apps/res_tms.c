@@ -0,0 +1,2156 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief TMS shared services -- pacing scheduler and per-channel media timeline used by the TMS players, CLI tools
+ *
+ * \ingroup resources
+ */
+
+/*** MODULEINFO
+	<support_level>extended</support_level>
+ ***/
+
+#include <asterisk.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "asterisk/astobj2.h"
+#include "asterisk/channel.h"
+#include "asterisk/cli.h"
+#include "asterisk/config.h"
+#include "asterisk/datastore.h"
+#include "asterisk/frame.h"
+#include "asterisk/http.h"
+#include "asterisk/linkedlists.h"
+#include "asterisk/lock.h"
+#include "asterisk/logger.h"
+#include "asterisk/manager.h"
+#include "asterisk/module.h"
+#include "asterisk/pbx.h"
+#include "asterisk/utils.h"
+
+#include "tms_avc.h"
+#include "tms_histogram.h"
+#include "tms_metrics.h"
+#include "tms_pacer.h"
+#include "tms_playback.h"
+#include "tms_timeline.h"
+
+#define TMS_CONFIG_FILE "tms.conf"
+
+#define TMS_PACER_MAX_THREADS 64           // 工作线程的最大数量
+#define TMS_PACER_TICK_US 1000             // 时间轮的刻度，单位微秒
+#define TMS_PACER_WHEEL_SLOTS 512          // 时间轮的槽数，超出范围的帧在转过1圈后发送
+#define TMS_PACER_DEFAULT_MAX_LEAD_US 200000 // 默认最多提前排队200毫秒的帧
+#define TMS_PACER_DEFAULT_MAX_QUEUED 256   // 默认每个会话最多排队的帧数
+
+#define TMS_PACER_STAGE_SAMPLES 64         // 通道线程缓存的阶段耗时个数，满了以后合并到会话
+
+#define TMS_PLAYBACK_DEFAULT_PROGRESS_INTERVAL_US 5000000 // 默认每5秒发送1次TMSPlaybackProgress
+
+/**
+ * 排队等待发送的帧
+ */
+typedef struct TmsPacerItem
+{
+  TmsPacerSession *session;
+  struct ast_frame *frame;
+  TmsPacerPool *pool; // 帧来自帧池时，发送后放回帧池
+  int64_t deadline_us;
+  AST_LIST_ENTRY(TmsPacerItem) list;
+} TmsPacerItem;
+
+AST_LIST_HEAD_NOLOCK(TmsPacerSlot, TmsPacerItem);
+
+/**
+ * 帧池中的帧，排队时直接使用其中的item，不需要另外分配和复制
+ */
+typedef struct TmsPacerPoolFrame
+{
+  TmsPacerItem item; // 必须在开头，空闲列表中的item可以直接转换
+  struct ast_frame frame;
+  uint8_t buf[AST_FRIENDLY_OFFSET + TMS_PACER_FRAME_PAYLOAD];
+} TmsPacerPoolFrame;
+
+#define TMS_PACER_POOL_FRAME(f) ((TmsPacerPoolFrame *)((char *)(f)-offsetof(TmsPacerPoolFrame, frame)))
+
+/**
+ * 帧池，ao2对象，对象锁保护空闲列表
+ *
+ * 空闲的帧不持有帧池的引用，取出的帧（包括排队中的帧）各持有1个引用，最后1个帧放回后帧池才释放。
+ */
+struct TmsPacerPool
+{
+  TmsPacerSession *session; // 不持有引用，只在通道线程中使用
+  enum ast_frame_type type;
+  struct ast_format *format;
+  char *src;
+  int timing;
+  int nb_frames; // 已经分配的帧数，只在通道线程中修改
+  struct TmsPacerSlot frames; // 空闲的帧
+  AST_LIST_ENTRY(TmsPacerPool) list;
+};
+
+/**
+ * 工作线程，每个线程有自己的时间轮和timerfd
+ */
+typedef struct TmsPacerWorker
+{
+  int index;
+  pthread_t thread;
+  int timerfd;
+  int armed; // timerfd是否已经启动
+  int stop;
+  ast_mutex_t lock;
+  int64_t cur_tick; // 下一个要处理的刻度
+  int nb_items;     // 时间轮中的帧数
+  struct TmsPacerSlot slots[TMS_PACER_WHEEL_SLOTS];
+} TmsPacerWorker;
+
+/**
+ * 发送会话，对应1次播放
+ */
+struct TmsPacerSession
+{
+  struct ast_channel *chan;
+  TmsPacerWorker *worker;
+  ast_mutex_t lock;
+  ast_cond_t cond;
+  int nb_queued; // 已经排队还没有发送的帧数
+  int cancelled; // 已经关闭，丢弃没有发送的帧
+  int failed;    // 发送失败，通道已经不可用
+  int writing;   // 调度线程正在写入通道，关闭会话时等待写完
+  unsigned int nb_frames;
+  uint64_t nb_bytes;   // 发送的载荷字节数
+  int64_t max_late_us; // 实际发送时间比发送时间晚的最大值
+  int64_t sum_late_us; // 用于计算平均延迟
+  TmsHistogram late_us_hist; // 实际发送时间比发送时间晚的分布（微秒），会话释放时累加到全局统计
+  int64_t first_sent_us; // 第1个帧写入通道的时间
+  TmsPlayback *playback; // 会话建立时通道上的播放，持有引用，会话关闭时累加统计，只在通道线程中使用
+  AST_LIST_HEAD_NOLOCK(, TmsPacerPool) pools; // 会话建立的帧池，会话关闭时释放
+  /* 以下用于CLI显示，修改和读取都需要持有lock */
+  char app[32];
+  char *filename;
+  int64_t start_us;    // 会话建立的时间
+  int64_t position_us; // 播放位置
+  TmsPacerRtcp audio_rtcp; // 对端报告的接收质量
+  TmsPacerRtcp video_rtcp;
+  int64_t stage_cpu_us[TMS_PACER_NB_STAGES]; // 每个处理阶段累计的CPU时间
+  TmsHistogram stage_ns[TMS_PACER_NB_STAGES]; // 每个处理阶段单次耗时（纳秒）的分布，会话释放时累加到全局统计
+  /* 以下只在通道线程中使用，不加锁，合并到上面的统计时才加锁 */
+  int stage_started;          // 已经调用tms_pacer_session_stage_begin
+  int64_t stage_mark_ns;      // 上次记录的时间
+  int64_t stage_paused_ns;    // 当前阶段中在tms_pacer_write里等待和写入通道的时间，不计入当前阶段
+  int64_t stage_cpu_mark_us;  // 上次合并时线程的CPU时间
+  int64_t stage_write_cpu_us; // 上次合并以来在通道线程中写入通道的CPU时间，已经计入TMS_PACER_STAGE_WRITE
+  int64_t stage_local_ns[TMS_PACER_NB_STAGES]; // 上次合并以来每个阶段经过的时间，用于分摊CPU时间
+  int nb_stage_samples;
+  struct
+  {
+    TmsPacerStage stage;
+    int64_t ns;
+  } stage_samples[TMS_PACER_STAGE_SAMPLES];
+  AST_LIST_ENTRY(TmsPacerSession) entry;
+};
+
+/* 没有关闭的会话，用于CLI显示，列表持有会话的引用 */
+static AST_LIST_HEAD_STATIC(tms_pacer_sessions, TmsPacerSession);
+
+/**
+ * 会话的累计统计
+ *
+ * 会话关闭时累加到全局统计，CLI和/tms/metrics显示时再加上没有关闭的会话。
+ */
+typedef struct TmsPacerStats
+{
+  uint64_t nb_sessions;
+  uint64_t nb_frames;
+  uint64_t nb_bytes;
+  int64_t stage_cpu_us[TMS_PACER_NB_STAGES];
+  TmsHistogram stage_ns[TMS_PACER_NB_STAGES];
+  TmsHistogram late_us;
+} TmsPacerStats;
+
+/* 已经关闭的会话的统计 */
+AST_MUTEX_DEFINE_STATIC(tms_pacer_stats_lock);
+static TmsPacerStats tms_pacer_stats;
+
+/**
+ * 1次播放应用的执行，ao2对象，保存在通道的datastore中
+ *
+ * datastore、播放应用和执行期间建立的发送会话各持有1个引用，tms_playback_start替换datastore后还没有关闭的会话仍然可以使用。
+ * 只在通道线程中访问，不需要加锁。
+ */
+struct TmsPlayback
+{
+  struct ast_channel *chan;
+  char app[32];
+  char *filename;
+  int64_t start_us;
+  int64_t first_sent_us;     // 第1个帧写入通道的时间
+  int64_t next_progress_us;  // 下次发送TMSPlaybackProgress的时间
+  unsigned int nb_sessions;  // 已经关闭的发送会话数，每播放1个文件建立1个会话
+  uint64_t nb_frames;        // 以下是已经关闭的会话的累计值
+  uint64_t nb_bytes;
+  int64_t max_late_us;
+  TmsHistogram late_us;
+};
+
+/* TMSPlaybackProgress中发送会话的字段，在会话的锁内复制，锁外发送事件 */
+typedef struct TmsPlaybackProgress
+{
+  int64_t position_us;
+  uint64_t nb_frames;
+  uint64_t nb_bytes;
+  int nb_queued;
+  int64_t max_late_us;
+} TmsPlaybackProgress;
+
+/* 发送TMSPlaybackProgress的间隔，等于0时不发送 */
+static int64_t tms_playback_progress_interval_us = TMS_PLAYBACK_DEFAULT_PROGRESS_INTERVAL_US;
+
+/* alaw转码缓存的命中次数 */
+static struct
+{
+  int hits;
+  int misses;
+} tms_pcma_cache_stats;
+
+static struct
+{
+  int enabled;
+  int nb_workers;
+  int64_t max_lead_us;
+  int max_queued;
+  TmsPacerWorker *workers;
+  int next_worker;
+} tms_pacer;
+
+int64_t tms_pacer_now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t tms_pacer_cpu_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* 统计处理阶段耗时用的时间，单位纳秒 */
+static int64_t tms_pacer_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * 把通道线程缓存的阶段耗时合并到会话的统计，调用时需要持有会话的锁，只在通道线程中调用
+ *
+ * CLOCK_THREAD_CPUTIME_ID不走vDSO，每次读取都是系统调用，所以只在合并时读1次，按经过的时间分摊到通道线程的各个阶段。
+ * 等待时不占用CPU，通道线程中写入通道的CPU时间已经单独计入TMS_PACER_STAGE_WRITE，都不参与分摊。
+ */
+static void tms_pacer_stage_flush(TmsPacerSession *session)
+{
+  int64_t now_us, cpu_us, total_ns = 0;
+  int i;
+
+  if (!session->stage_started)
+    return;
+
+  for (i = 0; i < session->nb_stage_samples; i++)
+    tms_histogram_add(&session->stage_ns[session->stage_samples[i].stage], session->stage_samples[i].ns);
+  session->nb_stage_samples = 0;
+
+  now_us = tms_pacer_cpu_us();
+  cpu_us = now_us - session->stage_cpu_mark_us - session->stage_write_cpu_us;
+  session->stage_cpu_mark_us = now_us;
+  session->stage_write_cpu_us = 0;
+
+  for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+  {
+    if (i != TMS_PACER_STAGE_WAIT && i != TMS_PACER_STAGE_WRITE)
+      total_ns += session->stage_local_ns[i];
+  }
+  for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+  {
+    if (i != TMS_PACER_STAGE_WAIT && i != TMS_PACER_STAGE_WRITE && total_ns > 0 && cpu_us > 0)
+      session->stage_cpu_us[i] += (int64_t)((double)cpu_us * session->stage_local_ns[i] / total_ns);
+    session->stage_local_ns[i] = 0;
+  }
+}
+
+/* 记录1次阶段耗时，只在通道线程中调用，缓冲区满了才加锁合并 */
+static void tms_pacer_stage_sample(TmsPacerSession *session, TmsPacerStage stage, int64_t ns)
+{
+  if (session->nb_stage_samples == TMS_PACER_STAGE_SAMPLES)
+  {
+    ast_mutex_lock(&session->lock);
+    tms_pacer_stage_flush(session);
+    ast_mutex_unlock(&session->lock);
+  }
+  session->stage_samples[session->nb_stage_samples].stage = stage;
+  session->stage_samples[session->nb_stage_samples].ns = ns;
+  session->nb_stage_samples++;
+  session->stage_local_ns[stage] += ns;
+}
+
+/* 记录在tms_pacer_write中等待的时间，之前的时间留在当前阶段，等待的时间不计入当前阶段 */
+static void tms_pacer_stage_wait(TmsPacerSession *session, int64_t start_ns)
+{
+  int64_t ns;
+
+  if (!session || !session->stage_started)
+    return;
+
+  ns = tms_pacer_now_ns() - start_ns;
+  tms_pacer_stage_sample(session, TMS_PACER_STAGE_WAIT, ns);
+  session->stage_paused_ns += ns;
+}
+
+/**
+ * 记录1个已经写入通道的帧，调用时需要持有会话的锁
+ *
+ * @param timed 帧指定了发送时间，late_us有效；尽快发送的帧不统计延迟分布
+ */
+static void tms_pacer_session_sent(TmsPacerSession *session, struct ast_frame *frame, int timed, int64_t late_us, int64_t write_cpu_us, int64_t write_ns)
+{
+  session->nb_frames++;
+  session->nb_bytes += frame->datalen;
+  session->sum_late_us += late_us;
+  if (late_us > session->max_late_us)
+    session->max_late_us = late_us;
+  if (timed)
+    tms_histogram_add(&session->late_us_hist, late_us);
+  if (!session->first_sent_us)
+    session->first_sent_us = tms_pacer_now_us();
+  session->stage_cpu_us[TMS_PACER_STAGE_WRITE] += write_cpu_us;
+  tms_histogram_add(&session->stage_ns[TMS_PACER_STAGE_WRITE], write_ns);
+}
+
+/* 启动或停止工作线程的timerfd，调用时需要持有工作线程的锁 */
+static void tms_pacer_worker_arm(TmsPacerWorker *worker, int on)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (on)
+  {
+    its.it_value.tv_nsec = TMS_PACER_TICK_US * 1000;
+    its.it_interval.tv_nsec = TMS_PACER_TICK_US * 1000;
+  }
+  if (timerfd_settime(worker->timerfd, 0, &its, NULL) < 0)
+  {
+    ast_log(LOG_ERROR, "发送调度线程 #%d 设置timerfd失败 %s\n", worker->index, strerror(errno));
+    return;
+  }
+  worker->armed = on;
+}
+
+/* 发送1个到期的帧，释放排队的资源 */
+static void tms_pacer_item_send(TmsPacerItem *item)
+{
+  TmsPacerSession *session = item->session;
+  TmsPacerPool *pool = item->pool;
+  struct ast_frame *frame = item->frame;
+  int failed = 0, sent = 0, writing;
+  int64_t late_us = 0, cpu_us = 0, write_ns = 0;
+
+  /* 在锁内检查并标记正在写入，会话关闭后不会再写入通道 */
+  ast_mutex_lock(&session->lock);
+  writing = session->writing = !session->cancelled && !session->failed;
+  ast_mutex_unlock(&session->lock);
+
+  if (writing)
+  {
+    if (item->deadline_us)
+      late_us = tms_pacer_now_us() - item->deadline_us;
+    cpu_us = tms_pacer_cpu_us();
+    write_ns = tms_pacer_now_ns();
+    if (ast_write(session->chan, frame) < 0)
+      failed = 1;
+    else
+      sent = 1;
+    write_ns = tms_pacer_now_ns() - write_ns;
+    cpu_us = tms_pacer_cpu_us() - cpu_us;
+  }
+
+  ast_mutex_lock(&session->lock);
+  session->writing = 0;
+  session->nb_queued--;
+  if (failed)
+    session->failed = 1;
+  if (sent)
+    tms_pacer_session_sent(session, frame, item->deadline_us != 0, late_us, cpu_us, write_ns);
+  ast_cond_broadcast(&session->cond);
+  ast_mutex_unlock(&session->lock);
+
+  ao2_ref(session, -1);
+
+  /* 放回帧池后item可能马上被通道线程重用，之后不能再访问 */
+  if (pool)
+  {
+    tms_pacer_pool_put(pool, frame);
+  }
+  else
+  {
+    ast_frfree(frame);
+    ast_free(item);
+  }
+}
+
+/* 工作线程，每个刻度取出到期的帧按顺序发送 */
+static void *tms_pacer_worker_run(void *data)
+{
+  TmsPacerWorker *worker = data;
+  struct TmsPacerSlot due;
+  TmsPacerItem *item;
+  uint64_t expirations;
+  int64_t now_tick;
+  int i, nb_ticks;
+
+  while (1)
+  {
+    if (read(worker->timerfd, &expirations, sizeof(expirations)) < 0 && errno != EINTR)
+    {
+      ast_log(LOG_ERROR, "发送调度线程 #%d 读取timerfd失败 %s\n", worker->index, strerror(errno));
+      break;
+    }
+
+    AST_LIST_HEAD_INIT_NOLOCK(&due);
+
+    ast_mutex_lock(&worker->lock);
+    if (worker->stop)
+    {
+      ast_mutex_unlock(&worker->lock);
+      break;
+    }
+    now_tick = tms_pacer_now_us() / TMS_PACER_TICK_US;
+    nb_ticks = now_tick - worker->cur_tick + 1;
+    if (nb_ticks > TMS_PACER_WHEEL_SLOTS)
+      nb_ticks = TMS_PACER_WHEEL_SLOTS;
+    for (i = 0; i < nb_ticks; i++)
+    {
+      struct TmsPacerSlot *slot = &worker->slots[(worker->cur_tick + i) % TMS_PACER_WHEEL_SLOTS];
+      AST_LIST_TRAVERSE_SAFE_BEGIN(slot, item, list)
+      {
+        /* 同一个槽中可能有转过1圈以后才到期的帧 */
+        if (item->deadline_us / TMS_PACER_TICK_US <= now_tick)
+        {
+          AST_LIST_REMOVE_CURRENT(list);
+          AST_LIST_INSERT_TAIL(&due, item, list);
+          worker->nb_items--;
+        }
+      }
+      AST_LIST_TRAVERSE_SAFE_END;
+    }
+    if (now_tick >= worker->cur_tick)
+      worker->cur_tick = now_tick + 1;
+    /* 没有排队的帧时停止timerfd，避免空转 */
+    if (worker->nb_items == 0 && worker->armed)
+      tms_pacer_worker_arm(worker, 0);
+    ast_mutex_unlock(&worker->lock);
+
+    /* 在锁外发送，不阻塞通道线程排队 */
+    while ((item = AST_LIST_REMOVE_HEAD(&due, list)))
+    {
+      tms_pacer_item_send(item);
+    }
+  }
+
+  return NULL;
+}
+
+/* 把会话的统计累加到stats，调用时需要持有会话的锁 */
+static void tms_pacer_stats_add(TmsPacerStats *stats, TmsPacerSession *session)
+{
+  int i;
+
+  stats->nb_sessions++;
+  stats->nb_frames += session->nb_frames;
+  stats->nb_bytes += session->nb_bytes;
+  for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+  {
+    stats->stage_cpu_us[i] += session->stage_cpu_us[i];
+    tms_histogram_merge(&stats->stage_ns[i], &session->stage_ns[i]);
+  }
+  tms_histogram_merge(&stats->late_us, &session->late_us_hist);
+}
+
+static const char *tms_playback_reasons[] = {"complete", "stop", "hangup", "timeout", "error"};
+
+static void tms_playback_destructor(void *obj)
+{
+  TmsPlayback *playback = obj;
+
+  ast_free(playback->filename);
+}
+
+/* 通道销毁时释放datastore持有的引用，正常情况下由tms_playback_end释放 */
+static void tms_playback_destroy(void *data)
+{
+  ao2_ref(data, -1);
+}
+
+static const struct ast_datastore_info tms_playback_info = {
+  .type = "tms_playback",
+  .destroy = tms_playback_destroy,
+};
+
+/* 通道上正在执行的播放，返回的对象持有引用 */
+static TmsPlayback *tms_playback_find(struct ast_channel *chan)
+{
+  struct ast_datastore *datastore;
+  TmsPlayback *playback = NULL;
+
+  ast_channel_lock(chan);
+  if ((datastore = ast_channel_datastore_find(chan, &tms_playback_info, NULL)))
+    playback = ao2_bump(datastore->data);
+  ast_channel_unlock(chan);
+
+  return playback;
+}
+
+TmsPlayback *tms_playback_start(struct ast_channel *chan, const char *app, const char *filename)
+{
+  struct ast_datastore *datastore, *prev;
+  TmsPlayback *playback;
+
+  if (!(playback = ao2_alloc_options(sizeof(TmsPlayback), tms_playback_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK)))
+    return NULL;
+  if (!(datastore = ast_datastore_alloc(&tms_playback_info, NULL)))
+  {
+    ao2_ref(playback, -1);
+    return NULL;
+  }
+
+  playback->chan = chan;
+  ast_copy_string(playback->app, S_OR(app, ""), sizeof(playback->app));
+  playback->filename = ast_strdup(S_OR(filename, ""));
+  playback->start_us = tms_pacer_now_us();
+  playback->next_progress_us = playback->start_us + tms_playback_progress_interval_us;
+  datastore->data = playback; // datastore持有创建时的引用
+
+  /* 同一个通道上的播放应用依次执行，上1个没有结束的播放已经不再使用；没有关闭的会话持有自己的引用，不受影响 */
+  ast_channel_lock(chan);
+  prev = ast_channel_datastore_find(chan, &tms_playback_info, NULL);
+  if (prev && !ast_channel_datastore_remove(chan, prev))
+    ast_datastore_free(prev);
+  ast_channel_datastore_add(chan, datastore);
+  ast_channel_unlock(chan);
+
+  ast_manager_event(chan, EVENT_FLAG_CALL, "TMSPlaybackStart",
+                    "Channel: %s\r\n"
+                    "Uniqueid: %s\r\n"
+                    "Application: %s\r\n"
+                    "File: %s\r\n",
+                    ast_channel_name(chan), ast_channel_uniqueid(chan), playback->app, playback->filename);
+
+  /* 播放应用持有1个引用，tms_playback_end释放 */
+  return ao2_bump(playback);
+}
+
+/* 关闭的会话累加到播放，调用时需要持有会话的锁 */
+static void tms_playback_add_session(TmsPlayback *playback, TmsPacerSession *session)
+{
+  playback->nb_sessions++;
+  playback->nb_frames += session->nb_frames;
+  playback->nb_bytes += session->nb_bytes;
+  if (session->max_late_us > playback->max_late_us)
+    playback->max_late_us = session->max_late_us;
+  tms_histogram_merge(&playback->late_us, &session->late_us_hist);
+  if (!playback->first_sent_us)
+    playback->first_sent_us = session->first_sent_us;
+}
+
+/* 是否到了发送TMSPlaybackProgress的时间，到了时更新下次发送的时间 */
+static int tms_playback_progress_due(TmsPlayback *playback, int64_t *now_us)
+{
+  if (!tms_playback_progress_interval_us || (*now_us = tms_pacer_now_us()) < playback->next_progress_us)
+    return 0;
+
+  playback->next_progress_us = *now_us + tms_playback_progress_interval_us;
+
+  return 1;
+}
+
+/* 发送TMSPlaybackProgress，包括正在发送的会话。不能持有会话的锁，AMI客户端慢时不阻塞调度线程 */
+static void tms_playback_progress(TmsPlayback *playback, const char *filename, const TmsPlaybackProgress *progress, int64_t now_us)
+{
+  ast_manager_event(playback->chan, EVENT_FLAG_CALL, "TMSPlaybackProgress",
+                    "Channel: %s\r\n"
+                    "Uniqueid: %s\r\n"
+                    "Application: %s\r\n"
+                    "File: %s\r\n"
+                    "PositionMs: %" PRId64 "\r\n"
+                    "ElapsedMs: %" PRId64 "\r\n"
+                    "Packets: %" PRIu64 "\r\n"
+                    "Bytes: %" PRIu64 "\r\n"
+                    "Queued: %d\r\n"
+                    "MaxLateUs: %" PRId64 "\r\n",
+                    ast_channel_name(playback->chan), ast_channel_uniqueid(playback->chan), playback->app, S_OR(filename, playback->filename),
+                    progress->position_us / 1000, (now_us - playback->start_us) / 1000,
+                    playback->nb_frames + progress->nb_frames, playback->nb_bytes + progress->nb_bytes, progress->nb_queued,
+                    progress->max_late_us > playback->max_late_us ? progress->max_late_us : playback->max_late_us);
+}
+
+void tms_playback_end(TmsPlayback *playback, TmsPlaybackReason reason)
+{
+  struct ast_channel *chan;
+  struct ast_datastore *datastore;
+  char dtmf[8] = "";
+  TmsHistogram *h;
+
+  if (!playback)
+    return;
+
+  chan = playback->chan;
+  h = &playback->late_us;
+
+  /* 从通道上删除datastore，之后建立的会话不再关联这个播放 */
+  ast_channel_lock(chan);
+  if (reason == TMS_PLAYBACK_STOP)
+    ast_copy_string(dtmf, S_OR(pbx_builtin_getvar_helper(chan, TMS_PLAYBACK_DTMF_VAR), ""), sizeof(dtmf));
+  if ((datastore = ast_channel_datastore_find(chan, &tms_playback_info, NULL)) &&
+      (datastore->data != playback || ast_channel_datastore_remove(chan, datastore)))
+    datastore = NULL;
+  ast_channel_unlock(chan);
+
+  if (datastore)
+    ast_datastore_free(datastore);
+  else
+    ast_log(LOG_WARNING, "通道 %s 上的播放已经被替换\n", ast_channel_name(chan));
+
+  ast_manager_event(chan, EVENT_FLAG_CALL, "TMSPlaybackEnd",
+                    "Channel: %s\r\n"
+                    "Uniqueid: %s\r\n"
+                    "Application: %s\r\n"
+                    "File: %s\r\n"
+                    "Reason: %s\r\n"
+                    "DTMF: %s\r\n"
+                    "DurationMs: %" PRId64 "\r\n"
+                    "TimeToFirstPacketMs: %" PRId64 "\r\n"
+                    "Files: %u\r\n"
+                    "Packets: %" PRIu64 "\r\n"
+                    "Bytes: %" PRIu64 "\r\n"
+                    "MaxLateUs: %" PRId64 "\r\n"
+                    "LateP50Us: %" PRIu64 "\r\n"
+                    "LateP99Us: %" PRIu64 "\r\n"
+                    "LateP999Us: %" PRIu64 "\r\n",
+                    ast_channel_name(chan), ast_channel_uniqueid(chan), playback->app, playback->filename,
+                    tms_playback_reasons[reason], dtmf, (tms_pacer_now_us() - playback->start_us) / 1000,
+                    playback->first_sent_us ? (playback->first_sent_us - playback->start_us) / 1000 : -1,
+                    playback->nb_sessions, playback->nb_frames, playback->nb_bytes, playback->max_late_us,
+                    tms_histogram_percentile(h, 50), tms_histogram_percentile(h, 99), tms_histogram_percentile(h, 99.9));
+
+  /* 释放播放应用持有的引用，没有关闭的会话还持有引用时在会话关闭后释放 */
+  ao2_ref(playback, -1);
+}
+
+static void tms_pacer_session_destructor(void *obj)
+{
+  TmsPacerSession *session = obj;
+
+  ast_channel_unref(session->chan);
+  ao2_cleanup(session->playback);
+  ast_free(session->filename);
+  ast_cond_destroy(&session->cond);
+  ast_mutex_destroy(&session->lock);
+}
+
+TmsPacerSession *tms_pacer_session_create(struct ast_channel *chan)
+{
+  TmsPacerSession *session;
+
+  session = ao2_alloc_options(sizeof(*session), tms_pacer_session_destructor, AO2_ALLOC_OPT_LOCK_NOLOCK);
+  if (!session)
+    return NULL;
+
+  ast_mutex_init(&session->lock);
+  ast_cond_init(&session->cond, NULL);
+  session->chan = ast_channel_ref(chan);
+  session->start_us = tms_pacer_now_us();
+  session->playback = tms_playback_find(chan);
+
+  AST_LIST_LOCK(&tms_pacer_sessions);
+  AST_LIST_INSERT_TAIL(&tms_pacer_sessions, ao2_bump(session), entry);
+  AST_LIST_UNLOCK(&tms_pacer_sessions);
+
+  /* 没有启用调度器时，会话只用于统计，帧在通道线程中发送 */
+  if (!tms_pacer.enabled)
+  {
+    ast_debug(1, "通道 %s 建立发送会话，在通道线程中发送\n", ast_channel_name(chan));
+    return session;
+  }
+
+  session->worker = &tms_pacer.workers[(unsigned int)ast_atomic_fetchadd_int(&tms_pacer.next_worker, 1) % tms_pacer.nb_workers];
+
+  ast_debug(1, "通道 %s 建立发送会话，使用调度线程 #%d\n", ast_channel_name(chan), session->worker->index);
+
+  return session;
+}
+
+/* 在当前线程中等待到指定的时间，使用绝对时间，等待期间的调度延迟不会累积 */
+static void tms_pacer_sleep_until(int64_t deadline_us)
+{
+  struct timespec ts = {.tv_sec = deadline_us / 1000000, .tv_nsec = (deadline_us % 1000000) * 1000};
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/* 在当前线程中等待的相对时间，转换为ast_cond_timedwait需要的绝对时间 */
+static struct timespec tms_pacer_timeout(int64_t wait_us)
+{
+  struct timeval tv = ast_tvadd(ast_tvnow(), ast_samp2tv(wait_us, 1000000));
+  struct timespec ts = {.tv_sec = tv.tv_sec, .tv_nsec = tv.tv_usec * 1000};
+
+  return ts;
+}
+
+/* 在通道线程中等待到发送时间后发送 */
+static int tms_pacer_write_inline(TmsPacerSession *session, struct ast_channel *chan, struct ast_frame *f, int64_t deadline_us)
+{
+  int64_t late_us, cpu_us, write_ns, wait_ns = tms_pacer_now_ns();
+
+  if (deadline_us)
+    tms_pacer_sleep_until(deadline_us);
+  if (!session)
+    return ast_write(chan, f);
+  tms_pacer_stage_wait(session, wait_ns);
+
+  late_us = deadline_us ? tms_pacer_now_us() - deadline_us : 0;
+  cpu_us = tms_pacer_cpu_us();
+  write_ns = tms_pacer_now_ns();
+  if (ast_write(chan, f) < 0)
+    return -1;
+  write_ns = tms_pacer_now_ns() - write_ns;
+  cpu_us = tms_pacer_cpu_us() - cpu_us;
+  /* 写入通道已经计入TMS_PACER_STAGE_WRITE，不再计入当前阶段 */
+  if (session->stage_started)
+  {
+    session->stage_paused_ns += write_ns;
+    session->stage_write_cpu_us += cpu_us;
+  }
+
+  /* CLI会读取统计数据，需要加锁 */
+  ast_mutex_lock(&session->lock);
+  tms_pacer_session_sent(session, f, deadline_us != 0, late_us, cpu_us, write_ns);
+  ast_mutex_unlock(&session->lock);
+  return 0;
+}
+
+/* 背压，排队的帧太多或者太靠前时等待工作线程发送，返回后占用1个排队名额 */
+static int tms_pacer_reserve(TmsPacerSession *session, int64_t deadline_us)
+{
+  int64_t wait_us;
+
+  ast_mutex_lock(&session->lock);
+  while (!session->failed && session->nb_queued > 0)
+  {
+    wait_us = deadline_us - tms_pacer.max_lead_us - tms_pacer_now_us();
+    if (session->nb_queued < tms_pacer.max_queued && wait_us <= 0)
+      break;
+
+    struct timespec ts = tms_pacer_timeout(wait_us > 0 ? wait_us : TMS_PACER_TICK_US);
+    ast_cond_timedwait(&session->cond, &session->lock, &ts);
+  }
+  if (session->failed)
+  {
+    ast_mutex_unlock(&session->lock);
+    return -1;
+  }
+  session->nb_queued++;
+  ast_mutex_unlock(&session->lock);
+
+  return 0;
+}
+
+/* 放入工作线程的时间轮 */
+static void tms_pacer_enqueue(TmsPacerWorker *worker, TmsPacerItem *item)
+{
+  int64_t tick;
+
+  ast_mutex_lock(&worker->lock);
+  if (!worker->armed)
+  {
+    /* 时间轮空闲了一段时间，从当前刻度开始 */
+    if (worker->nb_items == 0)
+      worker->cur_tick = tms_pacer_now_us() / TMS_PACER_TICK_US;
+    tms_pacer_worker_arm(worker, 1);
+  }
+  tick = item->deadline_us / TMS_PACER_TICK_US;
+  if (tick < worker->cur_tick)
+    tick = worker->cur_tick; // 已经过期的帧在下一个刻度发送
+  AST_LIST_INSERT_TAIL(&worker->slots[tick % TMS_PACER_WHEEL_SLOTS], item, list);
+  worker->nb_items++;
+  ast_mutex_unlock(&worker->lock);
+}
+
+int tms_pacer_write(TmsPacerSession *session, struct ast_channel *chan, struct ast_frame *f, int64_t deadline_us)
+{
+  TmsPacerItem *item;
+  int64_t wait_ns;
+
+  /* 没有启用调度器，在通道线程中等待 */
+  if (!session || !session->worker)
+    return tms_pacer_write_inline(session, chan, f, deadline_us);
+
+  wait_ns = tms_pacer_now_ns();
+  if (tms_pacer_reserve(session, deadline_us) < 0)
+    return -1;
+  tms_pacer_stage_wait(session, wait_ns);
+
+  if (!(item = ast_calloc(1, sizeof(*item))) || !(item->frame = ast_frdup(f)))
+  {
+    ast_free(item);
+    ast_mutex_lock(&session->lock);
+    session->nb_queued--;
+    ast_mutex_unlock(&session->lock);
+    return -1;
+  }
+  item->session = ao2_bump(session);
+  item->deadline_us = deadline_us;
+
+  tms_pacer_enqueue(session->worker, item);
+
+  return 0;
+}
+
+static void tms_pacer_pool_destructor(void *obj)
+{
+  TmsPacerPool *pool = obj;
+  TmsPacerItem *item;
+
+  while ((item = AST_LIST_REMOVE_HEAD(&pool->frames, list)))
+    ast_free(item);
+  ao2_cleanup(pool->format);
+  ast_free(pool->src);
+}
+
+TmsPacerPool *tms_pacer_pool_create(TmsPacerSession *session, enum ast_frame_type type, struct ast_format *format, const char *src, int timing)
+{
+  TmsPacerPool *pool;
+
+  if (!session)
+    return NULL;
+
+  pool = ao2_alloc(sizeof(*pool), tms_pacer_pool_destructor);
+  if (!pool)
+    return NULL;
+
+  pool->session = session;
+  pool->type = type;
+  pool->format = ao2_bump(format);
+  pool->src = src ? ast_strdup(src) : NULL;
+  pool->timing = timing;
+
+  AST_LIST_INSERT_TAIL(&session->pools, pool, list);
+
+  return pool;
+}
+
+struct ast_frame *tms_pacer_pool_get(TmsPacerPool *pool)
+{
+  TmsPacerPoolFrame *pf;
+
+  if (!pool)
+    return NULL;
+
+  ao2_lock(pool);
+  pf = (TmsPacerPoolFrame *)AST_LIST_REMOVE_HEAD(&pool->frames, list);
+  ao2_unlock(pool);
+
+  if (!pf)
+  {
+    if (!(pf = ast_calloc(1, sizeof(*pf))))
+      return NULL;
+
+    /* 帧头只在分配时设置1次 */
+    pf->item.frame = &pf->frame;
+    pf->item.pool = pool;
+    pf->frame.frametype = pool->type;
+    pf->frame.subclass.format = pool->format;
+    pf->frame.src = pool->src;
+    pf->frame.mallocd = 0;
+    pf->frame.offset = AST_FRIENDLY_OFFSET;
+    pf->frame.data.ptr = pf->buf + AST_FRIENDLY_OFFSET;
+    if (pool->timing)
+      ast_set_flag(&pf->frame, AST_FRFLAG_HAS_TIMING_INFO);
+
+    pool->nb_frames++;
+  }
+
+  ao2_ref(pool, +1);
+
+  return &pf->frame;
+}
+
+void tms_pacer_pool_put(TmsPacerPool *pool, struct ast_frame *f)
+{
+  TmsPacerPoolFrame *pf = TMS_PACER_POOL_FRAME(f);
+
+  ao2_lock(pool);
+  AST_LIST_INSERT_HEAD(&pool->frames, &pf->item, list);
+  ao2_unlock(pool);
+
+  ao2_ref(pool, -1);
+}
+
+int tms_pacer_pool_write(TmsPacerPool *pool, struct ast_frame *f, int64_t deadline_us)
+{
+  TmsPacerPoolFrame *pf = TMS_PACER_POOL_FRAME(f);
+  TmsPacerSession *session = pool->session;
+  int64_t wait_ns;
+  int ret;
+
+  if (!session->worker)
+  {
+    ret = tms_pacer_write_inline(session, session->chan, f, deadline_us);
+    tms_pacer_pool_put(pool, f);
+    return ret;
+  }
+
+  wait_ns = tms_pacer_now_ns();
+  if (tms_pacer_reserve(session, deadline_us) < 0)
+  {
+    tms_pacer_pool_put(pool, f);
+    return -1;
+  }
+  tms_pacer_stage_wait(session, wait_ns);
+
+  pf->item.session = ao2_bump(session);
+  pf->item.deadline_us = deadline_us;
+
+  tms_pacer_enqueue(session->worker, &pf->item);
+
+  return 0;
+}
+
+void tms_pacer_session_close(TmsPacerSession *session, int drain)
+{
+  TmsPacerPool *pool;
+
+  if (!session)
+    return;
+
+  ast_mutex_lock(&session->lock);
+  while (drain && session->nb_queued > 0 && !session->failed)
+  {
+    struct timespec ts = tms_pacer_timeout(tms_pacer.max_lead_us);
+    ast_cond_timedwait(&session->cond, &session->lock, &ts);
+  }
+  session->cancelled = 1;
+  /* 调度线程可能正在写入通道，等写完后再返回，之后通道线程可以安全地使用和释放通道 */
+  while (session->writing)
+    ast_cond_wait(&session->cond, &session->lock);
+  tms_pacer_stage_flush(session);
+  /* 统计累加到播放，TMSPlaybackEnd报告 */
+  if (session->playback)
+  {
+    tms_playback_add_session(session->playback, session);
+    ao2_ref(session->playback, -1);
+    session->playback = NULL;
+  }
+  ast_mutex_unlock(&session->lock);
+
+  ast_debug(1, "通道 %s 关闭发送会话，共发送 %u 帧，最大延迟 %ld 微秒\n", ast_channel_name(session->chan), session->nb_frames, session->max_late_us);
+
+  /* 在列表的锁内累加到全局统计，汇总统计时不会漏算或者重复计算。没有等待发送完的帧不再统计 */
+  AST_LIST_LOCK(&tms_pacer_sessions);
+  if (AST_LIST_REMOVE(&tms_pacer_sessions, session, entry))
+  {
+    ast_mutex_lock(&session->lock);
+    ast_mutex_lock(&tms_pacer_stats_lock);
+    tms_pacer_stats_add(&tms_pacer_stats, session);
+    ast_mutex_unlock(&tms_pacer_stats_lock);
+    ast_mutex_unlock(&session->lock);
+    ao2_ref(session, -1);
+  }
+  AST_LIST_UNLOCK(&tms_pacer_sessions);
+
+  /* 排队中的帧持有帧池的引用，发送或丢弃后帧池才释放 */
+  while ((pool = AST_LIST_REMOVE_HEAD(&session->pools, list)))
+  {
+    ast_debug(2, "通道 %s 释放帧池，共分配 %d 帧\n", ast_channel_name(session->chan), pool->nb_frames);
+    ao2_ref(pool, -1);
+  }
+
+  ao2_ref(session, -1);
+}
+
+int64_t tms_pacer_session_max_late_us(TmsPacerSession *session)
+{
+  int64_t max_late_us;
+
+  if (!session)
+    return 0;
+
+  ast_mutex_lock(&session->lock);
+  max_late_us = session->max_late_us;
+  ast_mutex_unlock(&session->lock);
+
+  return max_late_us;
+}
+
+void tms_pacer_session_set_info(TmsPacerSession *session, const char *app, const char *filename)
+{
+  if (!session)
+    return;
+
+  ast_mutex_lock(&session->lock);
+  ast_copy_string(session->app, S_OR(app, ""), sizeof(session->app));
+  ast_free(session->filename);
+  session->filename = ast_strdup(filename);
+  ast_mutex_unlock(&session->lock);
+}
+
+void tms_pacer_session_set_position(TmsPacerSession *session, int64_t position_us)
+{
+  TmsPlaybackProgress progress;
+  int64_t now_us = 0;
+  int due;
+
+  if (!session)
+    return;
+
+  /* 播放只在通道线程中访问，不需要会话的锁 */
+  due = session->playback && tms_playback_progress_due(session->playback, &now_us);
+
+  ast_mutex_lock(&session->lock);
+  session->position_us = position_us;
+  if (due)
+  {
+    progress.position_us = session->position_us;
+    progress.nb_frames = session->nb_frames;
+    progress.nb_bytes = session->nb_bytes;
+    progress.nb_queued = session->nb_queued;
+    progress.max_late_us = session->max_late_us;
+  }
+  ast_mutex_unlock(&session->lock);
+
+  /* 在锁外发送AMI事件，调度线程每个帧都要获取会话的锁。filename只在通道线程中修改 */
+  if (due)
+    tms_playback_progress(session->playback, session->filename, &progress, now_us);
+}
+
+void tms_pacer_session_set_rtcp(TmsPacerSession *session, const TmsPacerRtcp *audio, const TmsPacerRtcp *video)
+{
+  if (!session)
+    return;
+
+  ast_mutex_lock(&session->lock);
+  session->audio_rtcp = *audio;
+  session->video_rtcp = *video;
+  ast_mutex_unlock(&session->lock);
+}
+
+void tms_pacer_session_stage_begin(TmsPacerSession *session)
+{
+  if (!session)
+    return;
+
+  /* 第1次调用时记录CPU时间，之后只在合并时读取 */
+  if (!session->stage_started)
+  {
+    session->stage_started = 1;
+    session->stage_cpu_mark_us = tms_pacer_cpu_us();
+  }
+  session->stage_mark_ns = tms_pacer_now_ns();
+  session->stage_paused_ns = 0;
+}
+
+void tms_pacer_session_stage(TmsPacerSession *session, TmsPacerStage stage)
+{
+  int64_t now_ns;
+
+  if (!session || !session->stage_started)
+    return;
+
+  now_ns = tms_pacer_now_ns();
+  tms_pacer_stage_sample(session, stage, now_ns - session->stage_mark_ns - session->stage_paused_ns);
+  session->stage_mark_ns = now_ns;
+  session->stage_paused_ns = 0;
+}
+
+/* 停止工作线程，释放没有发送的帧 */
+static void tms_pacer_stop(void)
+{
+  TmsPacerItem *item;
+  int i, j;
+
+  if (!tms_pacer.workers)
+    return;
+
+  for (i = 0; i < tms_pacer.nb_workers; i++)
+  {
+    TmsPacerWorker *worker = &tms_pacer.workers[i];
+
+    if (worker->thread != AST_PTHREADT_NULL)
+    {
+      ast_mutex_lock(&worker->lock);
+      worker->stop = 1;
+      tms_pacer_worker_arm(worker, 1);
+      ast_mutex_unlock(&worker->lock);
+      pthread_join(worker->thread, NULL);
+    }
+    for (j = 0; j < TMS_PACER_WHEEL_SLOTS; j++)
+    {
+      while ((item = AST_LIST_REMOVE_HEAD(&worker->slots[j], list)))
+      {
+        ast_mutex_lock(&item->session->lock);
+        item->session->cancelled = 1;
+        ast_mutex_unlock(&item->session->lock);
+        tms_pacer_item_send(item);
+      }
+    }
+    if (worker->timerfd >= 0)
+      close(worker->timerfd);
+    ast_mutex_destroy(&worker->lock);
+  }
+
+  ast_free(tms_pacer.workers);
+  tms_pacer.workers = NULL;
+}
+
+/* 启动工作线程 */
+static int tms_pacer_start(void)
+{
+  int i;
+
+  tms_pacer.workers = ast_calloc(tms_pacer.nb_workers, sizeof(TmsPacerWorker));
+  if (!tms_pacer.workers)
+    return -1;
+
+  for (i = 0; i < tms_pacer.nb_workers; i++)
+  {
+    TmsPacerWorker *worker = &tms_pacer.workers[i];
+
+    worker->index = i;
+    worker->thread = AST_PTHREADT_NULL;
+    worker->timerfd = -1;
+    ast_mutex_init(&worker->lock);
+  }
+
+  for (i = 0; i < tms_pacer.nb_workers; i++)
+  {
+    TmsPacerWorker *worker = &tms_pacer.workers[i];
+
+    if ((worker->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+    {
+      ast_log(LOG_ERROR, "发送调度线程 #%d 建立timerfd失败 %s\n", i, strerror(errno));
+      return -1;
+    }
+    if (ast_pthread_create_background(&worker->thread, NULL, tms_pacer_worker_run, worker))
+    {
+      ast_log(LOG_ERROR, "启动发送调度线程 #%d 失败\n", i);
+      worker->thread = AST_PTHREADT_NULL;
+      return -1;
+    }
+  }
+
+  ast_verb(2, "启动 %d 个发送调度线程\n", tms_pacer.nb_workers);
+
+  return 0;
+}
+
+/* 读取发送调度配置 */
+static void tms_load_pacer_config(void)
+{
+  struct ast_flags config_flags = {0};
+  struct ast_config *cfg;
+  const char *val;
+  long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  tms_pacer.enabled = 1;
+  tms_pacer.nb_workers = nb_cpus > 0 ? nb_cpus : 1;
+  tms_pacer.max_lead_us = TMS_PACER_DEFAULT_MAX_LEAD_US;
+  tms_pacer.max_queued = TMS_PACER_DEFAULT_MAX_QUEUED;
+
+  cfg = ast_config_load(TMS_CONFIG_FILE, config_flags);
+  if (!cfg || cfg == CONFIG_STATUS_FILEINVALID)
+  {
+    ast_debug(1, "没有找到配置文件 %s，使用默认发送调度配置\n", TMS_CONFIG_FILE);
+  }
+  else
+  {
+    if ((val = ast_variable_retrieve(cfg, "pacer", "enabled")))
+      tms_pacer.enabled = ast_true(val);
+    if ((val = ast_variable_retrieve(cfg, "pacer", "threads")) && atoi(val) > 0)
+      tms_pacer.nb_workers = atoi(val);
+    if ((val = ast_variable_retrieve(cfg, "pacer", "max_lead")) && atoi(val) > 0)
+      tms_pacer.max_lead_us = atoi(val) * 1000;
+    if ((val = ast_variable_retrieve(cfg, "pacer", "max_queued")) && atoi(val) > 0)
+      tms_pacer.max_queued = atoi(val);
+    if ((val = ast_variable_retrieve(cfg, "events", "progress_interval")) && atof(val) >= 0)
+      tms_playback_progress_interval_us = atof(val) * 1000000;
+    ast_config_destroy(cfg);
+  }
+
+  if (tms_pacer.nb_workers > TMS_PACER_MAX_THREADS)
+    tms_pacer.nb_workers = TMS_PACER_MAX_THREADS;
+}
+
+/* 通道销毁时释放时间线 */
+static void tms_timeline_destroy(void *data)
+{
+  TmsChannelTimeline *timeline = data;
+
+  if (timeline->rtcp_fd >= 0)
+    close(timeline->rtcp_fd);
+
+  ast_free(timeline);
+}
+
+static const struct ast_datastore_info tms_timeline_info = {
+  .type = "tms_timeline",
+  .destroy = tms_timeline_destroy,
+};
+
+TmsChannelTimeline *tms_timeline_get(struct ast_channel *chan)
+{
+  struct ast_datastore *datastore;
+  TmsChannelTimeline *timeline = NULL;
+
+  ast_channel_lock(chan);
+  if ((datastore = ast_channel_datastore_find(chan, &tms_timeline_info, NULL)))
+  {
+    timeline = datastore->data;
+  }
+  else if ((datastore = ast_datastore_alloc(&tms_timeline_info, NULL)))
+  {
+    if ((timeline = ast_calloc(1, sizeof(TmsChannelTimeline))))
+    {
+      timeline->audio.clock_rate = 8000;
+      timeline->video.clock_rate = 90000;
+      timeline->rtcp_fd = -1;
+      datastore->data = timeline;
+      ast_channel_datastore_add(chan, datastore);
+    }
+    else
+    {
+      ast_datastore_free(datastore);
+    }
+  }
+  ast_channel_unlock(chan);
+
+  if (!timeline)
+  {
+    ast_log(LOG_WARNING, "通道 %s 建立媒体时间线失败\n", ast_channel_name(chan));
+    return NULL;
+  }
+
+  timeline->nb_plays++;
+  ast_debug(1, "通道 %s 第 %u 次播放，音频时间戳 %u，视频时间戳 %u\n", ast_channel_name(chan), timeline->nb_plays, timeline->audio.last_rtp_ts, timeline->video.last_rtp_ts);
+
+  return timeline;
+}
+
+TmsTimelineClock *tms_timeline_clock(TmsChannelTimeline *timeline, enum ast_frame_type type)
+{
+  if (!timeline)
+    return NULL;
+
+  return type == AST_FRAME_VIDEO ? &timeline->video : &timeline->audio;
+}
+
+uint32_t tms_timeline_start(TmsChannelTimeline *timeline, enum ast_frame_type type, int64_t start_us)
+{
+  TmsTimelineClock *clock = tms_timeline_clock(timeline, type);
+  int clock_rate = type == AST_FRAME_VIDEO ? 90000 : 8000;
+  struct timeval now;
+
+  if (clock && clock->started)
+    return clock->last_rtp_ts + (uint32_t)((start_us - clock->last_deadline_us) * clock->clock_rate / 1000000);
+
+  /* 第1次发送，RTP时间戳由当前时间生成。秒和微秒分开换算，用无符号数，乘以时钟频率后不会溢出，高位截断正好是RTP时间戳的回绕 */
+  now = ast_tvnow();
+
+  return (uint32_t)((uint64_t)now.tv_sec * clock_rate + (uint64_t)now.tv_usec * clock_rate / 1000000);
+}
+
+void tms_timeline_end(TmsChannelTimeline *timeline, enum ast_frame_type type, uint32_t rtp_ts, int64_t deadline_us, unsigned int packet_count, unsigned int octet_count)
+{
+  TmsTimelineClock *clock = tms_timeline_clock(timeline, type);
+
+  if (!clock || packet_count == 0)
+    return;
+
+  clock->started = 1;
+  clock->last_rtp_ts = rtp_ts;
+  clock->last_deadline_us = deadline_us ? deadline_us : tms_pacer_now_us();
+  clock->packet_count += packet_count;
+  clock->octet_count += octet_count;
+}
+
+/**
+ * 生成模拟的h264 I帧，size字节，分为nb_slices个slice
+ *
+ * slice之间用startcode分隔，slice数据是随机字节，按照防竞争规则插入03，不会出现额外的startcode。
+ */
+static uint8_t *tms_bench_h264_frame(int size, int nb_slices)
+{
+  uint8_t *buf;
+  int i, zeros = 0, slice_size = size / nb_slices;
+  unsigned int seed = 1;
+
+  if (!(buf = ast_malloc(size)))
+    return NULL;
+
+  for (i = 0; i < size; i++)
+  {
+    if (i % slice_size == 0 && i + 5 < size)
+    {
+      /* 00 00 00 01 + nal_header */
+      memcpy(buf + i, "\x00\x00\x00\x01\x65", 5);
+      i += 4;
+      zeros = 0;
+      continue;
+    }
+    buf[i] = zeros == 2 ? 3 : (rand_r(&seed) & 0xff);
+    zeros = buf[i] ? 0 : zeros + 1;
+  }
+
+  return buf;
+}
+
+/* 用指定实现扫描整个帧，返回每秒处理的字节数（GB/s） */
+static double tms_bench_startcode_run(TmsAvcFindStartcode find, const uint8_t *buf, int size, int iterations, int *nb_found)
+{
+  const uint8_t *p, *end = buf + size;
+  int64_t start_us, elapse_us;
+  int i;
+
+  *nb_found = 0;
+  start_us = tms_pacer_now_us();
+  for (i = 0; i < iterations; i++)
+  {
+    for (p = find(buf, end); p < end; p = find(p + 3, end))
+      (*nb_found)++;
+  }
+  elapse_us = tms_pacer_now_us() - start_us;
+
+  *nb_found /= iterations;
+
+  return elapse_us > 0 ? (double)size * iterations / elapse_us / 1000.0 : 0;
+}
+
+static char *tms_cli_bench_startcode(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+  static const struct
+  {
+    const char *name;
+    int size;
+  } frames[] = {{"720p", 120 * 1024}, {"1080p", 300 * 1024}};
+  struct
+  {
+    const char *name;
+    TmsAvcFindStartcode find;
+  } impls[3];
+  int nb_impls = 0, iterations = 200, i, j, nb_found;
+
+  switch (cmd)
+  {
+  case CLI_INIT:
+    e->command = "tms bench startcode";
+    e->usage =
+        "Usage: tms bench startcode [iterations]\n"
+        "       测试h264 startcode查找的速度，用模拟的720p和1080p I帧分别测试每种实现，输出GB/s。\n";
+    return NULL;
+  case CLI_GENERATE:
+    return NULL;
+  }
+
+  if (a->argc > 4)
+    return CLI_SHOWUSAGE;
+  if (a->argc == 4 && (iterations = atoi(a->argv[3])) <= 0)
+    return CLI_SHOWUSAGE;
+
+  impls[nb_impls].name = "c";
+  impls[nb_impls++].find = tms_avc_find_startcode_c;
+#ifdef TMS_AVC_X86
+  if (__builtin_cpu_supports("sse2"))
+  {
+    impls[nb_impls].name = "sse2";
+    impls[nb_impls++].find = tms_avc_find_startcode_sse2;
+  }
+  if (__builtin_cpu_supports("avx2"))
+  {
+    impls[nb_impls].name = "avx2";
+    impls[nb_impls++].find = tms_avc_find_startcode_avx2;
+  }
+#endif
+
+  ast_cli(a->fd, "当前使用的实现：%s，每项测试 %d 次\n", tms_avc_find_startcode_impl(), iterations);
+  ast_cli(a->fd, "%-8s %-8s %10s %8s\n", "帧", "实现", "GB/s", "slices");
+  for (i = 0; i < ARRAY_LEN(frames); i++)
+  {
+    uint8_t *buf = tms_bench_h264_frame(frames[i].size, 8);
+    if (!buf)
+      return CLI_FAILURE;
+
+    for (j = 0; j < nb_impls; j++)
+    {
+      double gbps = tms_bench_startcode_run(impls[j].find, buf, frames[i].size, iterations, &nb_found);
+      ast_cli(a->fd, "%-8s %-8s %10.2f %8d\n", frames[i].name, impls[j].name, gbps, nb_found);
+    }
+
+    ast_free(buf);
+  }
+
+  return CLI_SUCCESS;
+}
+
+static const char *tms_pacer_stage_names[TMS_PACER_NB_STAGES] = {"read", "bsf", "decode", "resample", "encode", "packetize", "wait", "write"};
+
+/**
+ * CLI显示的1个会话的副本
+ *
+ * 在会话的锁内复制，释放列表和会话的锁以后再输出，ast_cli写慢的远程控制台时不会阻塞播放。
+ */
+typedef struct TmsCliPlayer
+{
+  char chan[AST_CHANNEL_NAME];
+  char app[32];
+  char *filename;
+  int64_t start_us;
+  int64_t position_us;
+  unsigned int nb_frames;
+  uint64_t nb_bytes;
+  int nb_queued;
+  int64_t max_late_us;
+  int64_t sum_late_us;
+  uint64_t late_p50_us;
+  uint64_t late_p99_us;
+  uint64_t late_p999_us;
+  int worker; // 调度线程的序号，在通道线程中发送时是-1
+  int failed;
+  int cancelled;
+  TmsPacerRtcp audio_rtcp;
+  TmsPacerRtcp video_rtcp;
+  int64_t stage_cpu_us[TMS_PACER_NB_STAGES];
+} TmsCliPlayer;
+
+/* 复制会话中CLI显示的字段，调用时需要持有会话的锁 */
+static void tms_cli_player_copy(TmsCliPlayer *player, TmsPacerSession *session)
+{
+  ast_copy_string(player->chan, ast_channel_name(session->chan), sizeof(player->chan));
+  ast_copy_string(player->app, session->app, sizeof(player->app));
+  player->filename = ast_strdup(S_OR(session->filename, ""));
+  player->start_us = session->start_us;
+  player->position_us = session->position_us;
+  player->nb_frames = session->nb_frames;
+  player->nb_bytes = session->nb_bytes;
+  player->nb_queued = session->nb_queued;
+  player->max_late_us = session->max_late_us;
+  player->sum_late_us = session->sum_late_us;
+  player->late_p50_us = tms_histogram_percentile(&session->late_us_hist, 50);
+  player->late_p99_us = tms_histogram_percentile(&session->late_us_hist, 99);
+  player->late_p999_us = tms_histogram_percentile(&session->late_us_hist, 99.9);
+  player->worker = session->worker ? session->worker->index : -1;
+  player->failed = session->failed;
+  player->cancelled = session->cancelled;
+  player->audio_rtcp = session->audio_rtcp;
+  player->video_rtcp = session->video_rtcp;
+  memcpy(player->stage_cpu_us, session->stage_cpu_us, sizeof(player->stage_cpu_us));
+}
+
+/**
+ * 复制正在播放的会话，channel不为NULL时只复制这个通道上的会话
+ *
+ * @return 复制的会话数，player_list用tms_cli_players_free释放；内存不足时返回-1
+ */
+static int tms_cli_players_copy(const char *channel, TmsCliPlayer **player_list)
+{
+  TmsPacerSession *session;
+  TmsCliPlayer *players;
+  int nb_players = 0, nb_sessions = 0;
+
+  AST_LIST_LOCK(&tms_pacer_sessions);
+  AST_LIST_TRAVERSE(&tms_pacer_sessions, session, entry)
+    nb_sessions++;
+  if (!(players = ast_calloc(nb_sessions ? nb_sessions : 1, sizeof(TmsCliPlayer))))
+  {
+    AST_LIST_UNLOCK(&tms_pacer_sessions);
+    return -1;
+  }
+  AST_LIST_TRAVERSE(&tms_pacer_sessions, session, entry)
+  {
+    if (channel && strcasecmp(channel, ast_channel_name(session->chan)))
+      continue;
+    ast_mutex_lock(&session->lock);
+    tms_cli_player_copy(&players[nb_players++], session);
+    ast_mutex_unlock(&session->lock);
+  }
+  AST_LIST_UNLOCK(&tms_pacer_sessions);
+
+  *player_list = players;
+
+  return nb_players;
+}
+
+static void tms_cli_players_free(TmsCliPlayer *players, int nb_players)
+{
+  int i;
+
+  for (i = 0; i < nb_players; i++)
+    ast_free(players[i].filename);
+  ast_free(players);
+}
+
+/* 音频和视频流中较差的接收质量，显示在tms show players的1行中，没有接收报告时显示- */
+static void tms_cli_format_rtcp(const TmsPacerRtcp *audio, const TmsPacerRtcp *video, char *loss, size_t loss_len, char *jitter, size_t jitter_len, char *rtt, size_t rtt_len)
+{
+  int fraction_lost = -1, jitter_ms = -1, rtt_ms = -1;
+
+  if (audio->nb_reports)
+  {
+    fraction_lost = audio->fraction_lost;
+    jitter_ms = audio->jitter_ms;
+    rtt_ms = audio->rtt_ms;
+  }
+  if (video->nb_reports)
+  {
+    fraction_lost = video->fraction_lost > fraction_lost ? video->fraction_lost : fraction_lost;
+    jitter_ms = video->jitter_ms > jitter_ms ? video->jitter_ms : jitter_ms;
+    rtt_ms = video->rtt_ms > rtt_ms ? video->rtt_ms : rtt_ms;
+  }
+
+  if (fraction_lost < 0)
+    ast_copy_string(loss, "-", loss_len);
+  else
+    snprintf(loss, loss_len, "%.1f%%", fraction_lost * 100.0 / 256);
+  if (jitter_ms < 0)
+    ast_copy_string(jitter, "-", jitter_len);
+  else
+    snprintf(jitter, jitter_len, "%dms", jitter_ms);
+  if (rtt_ms < 0)
+    ast_copy_string(rtt, "-", rtt_len);
+  else
+    snprintf(rtt, rtt_len, "%dms", rtt_ms);
+}
+
+/* 1个媒体流的接收质量，显示在tms show player中 */
+static void tms_cli_show_rtcp(int fd, const char *media, const TmsPacerRtcp *rtcp)
+{
+  if (!rtcp->nb_reports)
+  {
+    ast_cli(fd, "  %-6s 没有接收报告，NACK %u 个，关键帧请求 %u 个\n", media, rtcp->nb_nacks, rtcp->nb_keyframe_requests);
+    return;
+  }
+
+  ast_cli(fd, "  %-6s 报告 %u 个，丢包率 %.1f%%，累计丢包 %d，抖动 %d 毫秒（最大 %d），往返时延 %d 毫秒，NACK %u 个，关键帧请求 %u 个\n", media,
+          rtcp->nb_reports, rtcp->fraction_lost * 100.0 / 256, rtcp->cumulative_lost, rtcp->jitter_ms, rtcp->max_jitter_ms, rtcp->rtt_ms,
+          rtcp->nb_nacks, rtcp->nb_keyframe_requests);
+}
+
+/* 补全正在播放的通道名 */
+static char *tms_cli_complete_player(const char *word, int state)
+{
+  TmsPacerSession *session;
+  char *ret = NULL;
+  int which = 0, len = strlen(word);
+
+  AST_LIST_LOCK(&tms_pacer_sessions);
+  AST_LIST_TRAVERSE(&tms_pacer_sessions, session, entry)
+  {
+    if (!strncasecmp(word, ast_channel_name(session->chan), len) && ++which > state)
+    {
+      ret = ast_strdup(ast_channel_name(session->chan));
+      break;
+    }
+  }
+  AST_LIST_UNLOCK(&tms_pacer_sessions);
+
+  return ret;
+}
+
+static char *tms_cli_show_players(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+  TmsCliPlayer *players;
+  int nb_players, i;
+
+  switch (cmd)
+  {
+  case CLI_INIT:
+    e->command = "tms show players";
+    e->usage =
+        "Usage: tms show players\n"
+        "       显示正在播放的会话：通道、应用、播放位置、发送的帧数和字节数、最大发送延迟、\n"
+        "       对端RTCP接收报告中的丢包率、抖动和往返时延（音频和视频中较差的，没有报告时显示-）和文件。\n";
+    return NULL;
+  case CLI_GENERATE:
+    return NULL;
+  }
+
+  if (a->argc != 3)
+    return CLI_SHOWUSAGE;
+
+  if ((nb_players = tms_cli_players_copy(NULL, &players)) < 0)
+    return CLI_FAILURE;
+
+#define FORMAT "%-32.32s %-12.12s %10s %8s %12s %10s %7s %7s %7s %s\n"
+  ast_cli(a->fd, FORMAT, "Channel", "App", "Position", "Frames", "Bytes", "MaxLate", "Loss", "Jitter", "RTT", "File");
+  for (i = 0; i < nb_players; i++)
+  {
+    TmsCliPlayer *player = &players[i];
+    char position[16], frames[16], bytes[24], late[16], loss[16], jitter[16], rtt[16];
+
+    snprintf(position, sizeof(position), "%.1fs", player->position_us / 1000000.0);
+    snprintf(frames, sizeof(frames), "%u", player->nb_frames);
+    snprintf(bytes, sizeof(bytes), "%" PRIu64, player->nb_bytes);
+    snprintf(late, sizeof(late), "%.1fms", player->max_late_us / 1000.0);
+    tms_cli_format_rtcp(&player->audio_rtcp, &player->video_rtcp, loss, sizeof(loss), jitter, sizeof(jitter), rtt, sizeof(rtt));
+    ast_cli(a->fd, FORMAT, player->chan, player->app, position, frames, bytes, late, loss, jitter, rtt, S_OR(player->filename, ""));
+  }
+#undef FORMAT
+
+  ast_cli(a->fd, "%d 个播放会话\n", nb_players);
+  tms_cli_players_free(players, nb_players);
+
+  return CLI_SUCCESS;
+}
+
+static char *tms_cli_show_player(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+  TmsCliPlayer *players;
+  int nb_players, i, j;
+  int64_t now_us = tms_pacer_now_us();
+
+  switch (cmd)
+  {
+  case CLI_INIT:
+    e->command = "tms show player";
+    e->usage =
+        "Usage: tms show player <channel>\n"
+        "       显示通道上正在播放的会话的详细信息，包括发送延迟和每个处理阶段的CPU时间。\n";
+    return NULL;
+  case CLI_GENERATE:
+    return a->pos == 3 ? tms_cli_complete_player(a->word, a->n) : NULL;
+  }
+
+  if (a->argc != 4)
+    return CLI_SHOWUSAGE;
+
+  if ((nb_players = tms_cli_players_copy(a->argv[3], &players)) < 0)
+    return CLI_FAILURE;
+
+  for (i = 0; i < nb_players; i++)
+  {
+    TmsCliPlayer *player = &players[i];
+
+    ast_cli(a->fd, "通道：       %s\n", player->chan);
+    ast_cli(a->fd, "应用：       %s\n", player->app);
+    ast_cli(a->fd, "文件：       %s\n", S_OR(player->filename, ""));
+    ast_cli(a->fd, "运行时长：   %.3f 秒\n", (now_us - player->start_us) / 1000000.0);
+    ast_cli(a->fd, "播放位置：   %.3f 秒\n", player->position_us / 1000000.0);
+    ast_cli(a->fd, "发送：       %u 帧，%" PRIu64 " 字节\n", player->nb_frames, player->nb_bytes);
+    ast_cli(a->fd, "排队：       %d 帧\n", player->nb_queued);
+    ast_cli(a->fd, "发送延迟：   平均 %.3f 毫秒，最大 %.3f 毫秒\n", player->nb_frames ? player->sum_late_us / 1000.0 / player->nb_frames : 0.0, player->max_late_us / 1000.0);
+    ast_cli(a->fd, "延迟分布：   P50 %.3f 毫秒，P99 %.3f 毫秒，P99.9 %.3f 毫秒\n", player->late_p50_us / 1000.0,
+            player->late_p99_us / 1000.0, player->late_p999_us / 1000.0);
+    if (player->worker >= 0)
+      ast_cli(a->fd, "发送线程：   调度线程 #%d\n", player->worker);
+    else
+      ast_cli(a->fd, "发送线程：   通道线程\n");
+    ast_cli(a->fd, "状态：       %s\n", player->failed ? "发送失败" : player->cancelled ? "已关闭" : "正常");
+    ast_cli(a->fd, "RTCP接收报告（对端使用对称RTCP时才能收到）：\n");
+    tms_cli_show_rtcp(a->fd, "audio", &player->audio_rtcp);
+    tms_cli_show_rtcp(a->fd, "video", &player->video_rtcp);
+    ast_cli(a->fd, "CPU时间：\n");
+    for (j = 0; j < TMS_PACER_NB_STAGES; j++)
+      ast_cli(a->fd, "  %-12s %10.3f 毫秒\n", tms_pacer_stage_names[j], player->stage_cpu_us[j] / 1000.0);
+  }
+
+  if (!nb_players)
+    ast_cli(a->fd, "通道 %s 上没有正在播放的会话\n", a->argv[3]);
+  tms_cli_players_free(players, nb_players);
+
+  return CLI_SUCCESS;
+}
+
+/**
+ * 汇总统计：已经关闭的会话加上没有关闭的会话
+ *
+ * 会话关闭时在列表的锁内累加到全局统计，这里持有列表的锁读取，每个会话只计算1次。
+ */
+static void tms_pacer_stats_collect(TmsPacerStats *stats)
+{
+  TmsPacerSession *session;
+
+  AST_LIST_LOCK(&tms_pacer_sessions);
+  ast_mutex_lock(&tms_pacer_stats_lock);
+  *stats = tms_pacer_stats;
+  ast_mutex_unlock(&tms_pacer_stats_lock);
+
+  AST_LIST_TRAVERSE(&tms_pacer_sessions, session, entry)
+  {
+    ast_mutex_lock(&session->lock);
+    tms_pacer_stats_add(stats, session);
+    ast_mutex_unlock(&session->lock);
+  }
+  AST_LIST_UNLOCK(&tms_pacer_sessions);
+}
+
+/* 补全处理阶段的名字 */
+static char *tms_cli_complete_stage(const char *word, int state)
+{
+  int i, which = 0, len = strlen(word);
+
+  for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+  {
+    if (!strncasecmp(word, tms_pacer_stage_names[i], len) && ++which > state)
+      return ast_strdup(tms_pacer_stage_names[i]);
+  }
+
+  return NULL;
+}
+
+static char *tms_cli_show_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+  TmsPacerStats *stats;
+  TmsHistogram *stages;
+  uint64_t count = 0;
+  int i, stage = -1;
+
+  switch (cmd)
+  {
+  case CLI_INIT:
+    e->command = "tms show latency";
+    e->usage =
+        "Usage: tms show latency [stage]\n"
+        "       显示播放的每个处理阶段单次耗时的统计，包括所有播放过的会话，单位微秒。\n"
+        "       指定阶段时显示按2的幂分桶的直方图。阶段：read、bsf、decode、resample、encode、packetize、wait、write。\n"
+        "       wait是在发送调度器中等待（背压）的时间，不计入packetize。\n";
+    return NULL;
+  case CLI_GENERATE:
+    return a->pos == 3 ? tms_cli_complete_stage(a->word, a->n) : NULL;
+  }
+
+  if (a->argc != 3 && a->argc != 4)
+    return CLI_SHOWUSAGE;
+
+  if (a->argc == 4)
+  {
+    for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+    {
+      if (!strcasecmp(a->argv[3], tms_pacer_stage_names[i]))
+        stage = i;
+    }
+    if (stage < 0)
+      return CLI_SHOWUSAGE;
+  }
+
+  /* 统计包含多个直方图，不放在栈上 */
+  if (!(stats = ast_malloc(sizeof(TmsPacerStats))))
+    return CLI_FAILURE;
+  tms_pacer_stats_collect(stats);
+  stages = stats->stage_ns;
+
+  if (stage < 0)
+  {
+#define FORMAT "%-10s %12s %10s %10s %10s %10s %12s\n"
+#define FORMAT2 "%-10s %12" PRIu64 " %10.1f %10.1f %10.1f %10.1f %12.3f\n"
+    ast_cli(a->fd, FORMAT, "Stage", "Count", "Avg", "P50", "P99", "Max", "Total(ms)");
+    for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+    {
+      TmsHistogram *h = &stages[i];
+      ast_cli(a->fd, FORMAT2, tms_pacer_stage_names[i], h->count, h->count ? h->sum / 1000.0 / h->count : 0.0,
+              tms_histogram_percentile(h, 50) / 1000.0, tms_histogram_percentile(h, 99) / 1000.0, h->max / 1000.0, h->sum / 1000000.0);
+    }
+#undef FORMAT
+#undef FORMAT2
+    ast_free(stats);
+    return CLI_SUCCESS;
+  }
+
+  /* 直方图每个2的幂区间有TMS_HISTOGRAM_SUB_COUNT个桶，显示时按2的幂合并 */
+  ast_cli(a->fd, "阶段 %s，共 %" PRIu64 " 次，最大 %.1f 微秒\n", tms_pacer_stage_names[stage], stages[stage].count, stages[stage].max / 1000.0);
+  for (i = 0; i < TMS_HISTOGRAM_NB_BUCKETS; i++)
+  {
+    uint64_t upper = tms_histogram_bucket_upper(i);
+    count += stages[stage].buckets[i];
+    if (!count || ((upper & (upper - 1)) && i < TMS_HISTOGRAM_NB_BUCKETS - 1))
+      continue;
+    ast_cli(a->fd, "  < %12.3f 微秒 %12" PRIu64 " %6.2f%%\n", upper / 1000.0, count, count * 100.0 / stages[stage].count);
+    count = 0;
+  }
+
+  ast_free(stats);
+  return CLI_SUCCESS;
+}
+
+static char *tms_cli_show_jitter(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+  TmsPacerSession *session;
+  TmsHistogram *total;
+  struct
+  {
+    char chan[AST_CHANNEL_NAME];
+    uint64_t count, p50, p99, p999, max;
+  } *rows = NULL;
+  int nb_rows = 0, nb_sessions = 0, i;
+
+  switch (cmd)
+  {
+  case CLI_INIT:
+    e->command = "tms show jitter";
+    e->usage =
+        "Usage: tms show jitter\n"
+        "       显示RTP包实际写入通道的时间比指定的发送时间晚的分布，单位毫秒。\n"
+        "       Total包括所有播放过的会话，之后是正在播放的会话。延迟持续变大说明服务器过载。\n";
+    return NULL;
+  case CLI_GENERATE:
+    return NULL;
+  }
+
+  if (a->argc != 3)
+    return CLI_SHOWUSAGE;
+
+  if (!(total = ast_malloc(sizeof(TmsHistogram))))
+    return CLI_FAILURE;
+
+  /* 在锁内复制每个会话的百分位数并累加到总计，释放锁以后再输出 */
+  AST_LIST_LOCK(&tms_pacer_sessions);
+  AST_LIST_TRAVERSE(&tms_pacer_sessions, session, entry)
+    nb_sessions++;
+  if (nb_sessions && !(rows = ast_calloc(nb_sessions, sizeof(*rows))))
+  {
+    AST_LIST_UNLOCK(&tms_pacer_sessions);
+    ast_free(total);
+    return CLI_FAILURE;
+  }
+  ast_mutex_lock(&tms_pacer_stats_lock);
+  *total = tms_pacer_stats.late_us;
+  ast_mutex_unlock(&tms_pacer_stats_lock);
+  AST_LIST_TRAVERSE(&tms_pacer_sessions, session, entry)
+  {
+    TmsHistogram *h = &session->late_us_hist;
+
+    ast_mutex_lock(&session->lock);
+    ast_copy_string(rows[nb_rows].chan, ast_channel_name(session->chan), sizeof(rows[nb_rows].chan));
+    rows[nb_rows].count = h->count;
+    rows[nb_rows].p50 = tms_histogram_percentile(h, 50);
+    rows[nb_rows].p99 = tms_histogram_percentile(h, 99);
+    rows[nb_rows].p999 = tms_histogram_percentile(h, 99.9);
+    rows[nb_rows].max = h->max;
+    tms_histogram_merge(total, h);
+    ast_mutex_unlock(&session->lock);
+    nb_rows++;
+  }
+  AST_LIST_UNLOCK(&tms_pacer_sessions);
+
+#define FORMAT "%-32.32s %12s %10s %10s %10s %10s\n"
+#define FORMAT2 "%-32.32s %12" PRIu64 " %10.3f %10.3f %10.3f %10.3f\n"
+  ast_cli(a->fd, FORMAT, "Channel", "Frames", "P50", "P99", "P99.9", "Max");
+  for (i = 0; i < nb_rows; i++)
+    ast_cli(a->fd, FORMAT2, rows[i].chan, rows[i].count, rows[i].p50 / 1000.0, rows[i].p99 / 1000.0, rows[i].p999 / 1000.0, rows[i].max / 1000.0);
+  ast_cli(a->fd, FORMAT2, "Total", total->count, tms_histogram_percentile(total, 50) / 1000.0,
+          tms_histogram_percentile(total, 99) / 1000.0, tms_histogram_percentile(total, 99.9) / 1000.0, total->max / 1000.0);
+#undef FORMAT
+#undef FORMAT2
+
+  ast_free(rows);
+  ast_free(total);
+
+  return CLI_SUCCESS;
+}
+
+static char *tms_cli_reset_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+  TmsPacerSession *session;
+  int i;
+
+  switch (cmd)
+  {
+  case CLI_INIT:
+    e->command = "tms reset latency";
+    e->usage =
+        "Usage: tms reset latency\n"
+        "       清空处理阶段耗时和发送延迟分布的统计，包括正在播放的会话。\n";
+    return NULL;
+  case CLI_GENERATE:
+    return NULL;
+  }
+
+  if (a->argc != 3)
+    return CLI_SHOWUSAGE;
+
+  /* 只清空分布，/tms/metrics中的计数器继续累加 */
+  AST_LIST_LOCK(&tms_pacer_sessions);
+  ast_mutex_lock(&tms_pacer_stats_lock);
+  for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+    tms_histogram_reset(&tms_pacer_stats.stage_ns[i]);
+  tms_histogram_reset(&tms_pacer_stats.late_us);
+  ast_mutex_unlock(&tms_pacer_stats_lock);
+
+  AST_LIST_TRAVERSE(&tms_pacer_sessions, session, entry)
+  {
+    ast_mutex_lock(&session->lock);
+    for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+      tms_histogram_reset(&session->stage_ns[i]);
+    tms_histogram_reset(&session->late_us_hist);
+    ast_mutex_unlock(&session->lock);
+  }
+  AST_LIST_UNLOCK(&tms_pacer_sessions);
+
+  ast_cli(a->fd, "已经清空处理阶段耗时和发送延迟的统计\n");
+
+  return CLI_SUCCESS;
+}
+
+void tms_metrics_pcma_cache(int hit)
+{
+  ast_atomic_fetchadd_int(hit ? &tms_pcma_cache_stats.hits : &tms_pcma_cache_stats.misses, 1);
+}
+
+/* 进程打开的文件描述符数，失败时返回-1 */
+static int tms_metrics_open_fds(void)
+{
+  DIR *dir;
+  struct dirent *ent;
+  int nb_fds = 0;
+
+  if (!(dir = opendir("/proc/self/fd")))
+    return -1;
+
+  while ((ent = readdir(dir)))
+  {
+    if (ent->d_name[0] != '.')
+      nb_fds++;
+  }
+  closedir(dir);
+
+  /* 不包括读取目录用的描述符 */
+  return nb_fds - 1;
+}
+
+/**
+ * 输出Prometheus格式的直方图
+ *
+ * 桶的上限取2^from到2^to，乘以scale换算成秒。tms_histogram的桶边界包含2的幂，累计值是准确的。
+ */
+static void tms_metrics_histogram(struct ast_str **out, const char *name, const char *label, const TmsHistogram *h, int from, int to, double scale)
+{
+  uint64_t count = 0;
+  int i = 0, k;
+
+  for (k = from; k <= to; k++)
+  {
+    uint64_t le = (uint64_t)1 << k;
+    while (i < TMS_HISTOGRAM_NB_BUCKETS - 1 && tms_histogram_bucket_upper(i) <= le)
+      count += h->buckets[i++];
+    ast_str_append(out, 0, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, label, *label ? "," : "", le * scale, count);
+  }
+  ast_str_append(out, 0, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, label, *label ? "," : "", h->count);
+  ast_str_append(out, 0, "%s_sum{%s} %g\n", name, label, h->sum * scale);
+  ast_str_append(out, 0, "%s_count{%s} %" PRIu64 "\n", name, label, h->count);
+}
+
+#define TMS_METRICS_MAX_APPS 16
+
+/* 按Prometheus文本格式输出所有指标 */
+static void tms_metrics_format(struct ast_str **out)
+{
+  TmsPacerSession *session;
+  TmsPacerStats *stats;
+  struct
+  {
+    char app[32];
+    int nb_sessions;
+  } apps[TMS_METRICS_MAX_APPS];
+  int nb_apps = 0, nb_queued = 0, nb_fds, i;
+  struct rlimit rl;
+  char label[64];
+
+  /* 统计包含多个直方图，不放在栈上 */
+  if (!(stats = ast_malloc(sizeof(TmsPacerStats))))
+    return;
+
+  /* 和tms_pacer_stats_collect相同，同时按应用统计正在播放的会话 */
+  AST_LIST_LOCK(&tms_pacer_sessions);
+  ast_mutex_lock(&tms_pacer_stats_lock);
+  *stats = tms_pacer_stats;
+  ast_mutex_unlock(&tms_pacer_stats_lock);
+  AST_LIST_TRAVERSE(&tms_pacer_sessions, session, entry)
+  {
+    const char *app;
+
+    ast_mutex_lock(&session->lock);
+    tms_pacer_stats_add(stats, session);
+    nb_queued += session->nb_queued;
+    app = S_OR(session->app, "unknown");
+    for (i = 0; i < nb_apps && strcmp(apps[i].app, app); i++)
+      ;
+    if (i == nb_apps && nb_apps < TMS_METRICS_MAX_APPS)
+    {
+      ast_copy_string(apps[i].app, app, sizeof(apps[i].app));
+      apps[i].nb_sessions = 0;
+      nb_apps++;
+    }
+    if (i < nb_apps)
+      apps[i].nb_sessions++;
+    ast_mutex_unlock(&session->lock);
+  }
+  AST_LIST_UNLOCK(&tms_pacer_sessions);
+
+  ast_str_append(out, 0, "# HELP tms_active_sessions 正在播放的会话数\n# TYPE tms_active_sessions gauge\n");
+  for (i = 0; i < nb_apps; i++)
+    ast_str_append(out, 0, "tms_active_sessions{app=\"%s\"} %d\n", apps[i].app, apps[i].nb_sessions);
+
+  ast_str_append(out, 0, "# HELP tms_sessions_total 建立的播放会话数\n# TYPE tms_sessions_total counter\n");
+  ast_str_append(out, 0, "tms_sessions_total %" PRIu64 "\n", stats->nb_sessions);
+  ast_str_append(out, 0, "# HELP tms_frames_sent_total 写入通道的RTP帧数\n# TYPE tms_frames_sent_total counter\n");
+  ast_str_append(out, 0, "tms_frames_sent_total %" PRIu64 "\n", stats->nb_frames);
+  ast_str_append(out, 0, "# HELP tms_bytes_sent_total 写入通道的载荷字节数\n# TYPE tms_bytes_sent_total counter\n");
+  ast_str_append(out, 0, "tms_bytes_sent_total %" PRIu64 "\n", stats->nb_bytes);
+  ast_str_append(out, 0, "# HELP tms_queued_frames 在发送调度器中排队的帧数\n# TYPE tms_queued_frames gauge\n");
+  ast_str_append(out, 0, "tms_queued_frames %d\n", nb_queued);
+
+  ast_str_append(out, 0, "# HELP tms_pcma_cache_hits_total alaw转码缓存有效，不需要转码的次数\n# TYPE tms_pcma_cache_hits_total counter\n");
+  ast_str_append(out, 0, "tms_pcma_cache_hits_total %u\n", (unsigned int)tms_pcma_cache_stats.hits);
+  ast_str_append(out, 0, "# HELP tms_pcma_cache_misses_total alaw转码缓存无效，需要转码的次数\n# TYPE tms_pcma_cache_misses_total counter\n");
+  ast_str_append(out, 0, "tms_pcma_cache_misses_total %u\n", (unsigned int)tms_pcma_cache_stats.misses);
+
+  ast_str_append(out, 0, "# HELP tms_stage_cpu_seconds_total 每个处理阶段消耗的CPU时间\n# TYPE tms_stage_cpu_seconds_total counter\n");
+  for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+    ast_str_append(out, 0, "tms_stage_cpu_seconds_total{stage=\"%s\"} %.6f\n", tms_pacer_stage_names[i], stats->stage_cpu_us[i] / 1000000.0);
+
+  ast_str_append(out, 0, "# HELP tms_stage_duration_seconds 每个处理阶段单次的耗时\n# TYPE tms_stage_duration_seconds histogram\n");
+  for (i = 0; i < TMS_PACER_NB_STAGES; i++)
+  {
+    snprintf(label, sizeof(label), "stage=\"%s\"", tms_pacer_stage_names[i]);
+    tms_metrics_histogram(out, "tms_stage_duration_seconds", label, &stats->stage_ns[i], 10, 30, 1e-9);
+  }
+
+  ast_str_append(out, 0, "# HELP tms_send_lateness_seconds RTP帧实际写入通道的时间比发送时间晚的时长\n# TYPE tms_send_lateness_seconds histogram\n");
+  tms_metrics_histogram(out, "tms_send_lateness_seconds", "", &stats->late_us, 6, 24, 1e-6);
+
+  if ((nb_fds = tms_metrics_open_fds()) >= 0)
+  {
+    ast_str_append(out, 0, "# HELP process_open_fds 打开的文件描述符数\n# TYPE process_open_fds gauge\n");
+    ast_str_append(out, 0, "process_open_fds %d\n", nb_fds);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+  {
+    ast_str_append(out, 0, "# HELP process_max_fds 文件描述符数的上限\n# TYPE process_max_fds gauge\n");
+    ast_str_append(out, 0, "process_max_fds %llu\n", (unsigned long long)rl.rlim_cur);
+  }
+
+  ast_free(stats);
+}
+
+static int tms_metrics_http_callback(struct ast_tcptls_session_instance *ser, const struct ast_http_uri *urih, const char *uri, enum ast_http_method method, struct ast_variable *get_params, struct ast_variable *headers)
+{
+  struct ast_str *out, *http_header;
+
+  if (method != AST_HTTP_GET && method != AST_HTTP_HEAD)
+  {
+    ast_http_error(ser, 405, "Method Not Allowed", "Unsupported method");
+    return 0;
+  }
+
+  out = ast_str_create(8192);
+  http_header = ast_str_create(80);
+  if (!out || !http_header)
+  {
+    ast_free(out);
+    ast_free(http_header);
+    ast_http_error(ser, 500, "Server Error", "Out of memory");
+    return 0;
+  }
+
+  tms_metrics_format(&out);
+  ast_str_set(&http_header, 0, "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n");
+
+  /* ast_http_send释放http_header和out */
+  ast_http_send(ser, method, 200, "OK", http_header, out, 0, 0);
+
+  return 0;
+}
+
+/* 地址是http.conf中的prefix加上tms/metrics，默认为/tms/metrics */
+static struct ast_http_uri tms_metrics_uri = {
+  .description = "TMS Prometheus Metrics",
+  .uri = "tms/metrics",
+  .callback = tms_metrics_http_callback,
+  .has_subtree = 0,
+  .data = NULL,
+  .key = __FILE__,
+};
+
+static struct ast_cli_entry tms_cli[] = {
+  AST_CLI_DEFINE(tms_cli_bench_startcode, "测试h264 startcode查找的速度"),
+  AST_CLI_DEFINE(tms_cli_show_players, "显示正在播放的会话"),
+  AST_CLI_DEFINE(tms_cli_show_player, "显示1个播放会话的详细信息"),
+  AST_CLI_DEFINE(tms_cli_show_latency, "显示处理阶段耗时的统计"),
+  AST_CLI_DEFINE(tms_cli_show_jitter, "显示发送延迟的分布"),
+  AST_CLI_DEFINE(tms_cli_reset_latency, "清空处理阶段耗时和发送延迟的统计"),
+};
+
+static int unload_module(void)
+{
+  ast_http_uri_unlink(&tms_metrics_uri);
+  ast_cli_unregister_multiple(tms_cli, ARRAY_LEN(tms_cli));
+
+  tms_pacer.enabled = 0;
+  tms_pacer_stop();
+
+  return 0;
+}
+
+static int load_module(void)
+{
+  tms_load_pacer_config();
+
+  if (tms_pacer.enabled && tms_pacer_start() < 0)
+  {
+    tms_pacer.enabled = 0;
+    tms_pacer_stop();
+    return AST_MODULE_LOAD_DECLINE;
+  }
+
+  ast_cli_register_multiple(tms_cli, ARRAY_LEN(tms_cli));
+  ast_http_uri_link(&tms_metrics_uri);
+
+  return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_GLOBAL_SYMBOLS | AST_MODFLAG_LOAD_ORDER, "TMS shared services",
+  .support_level = AST_MODULE_SUPPORT_EXTENDED,
+  .load = load_module,
+  .unload = unload_module,
+  .load_pri = AST_MODPRI_APP_DEPEND,
+);
@@ -0,0 +1,426 @@
+#ifndef TMS_AVC_H
+#define TMS_AVC_H
+
+/**
+ * 在h264 annexb码流中查找startcode（00 00 01）
+ *
+ * 每个视频包的每个字节都要检查，并发的视频通道多时是热点。
+ * x86上运行时检测CPU，优先使用AVX2，其次SSE2，每次比较32/16个字节；其他情况使用逐字（4字节）检查的通用版本。
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asterisk/channel.h"
+#include "asterisk/format_cache.h"
+#include "asterisk/format_cap.h"
+#include "asterisk/pbx.h"
+#include "asterisk/strings.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TMS_AVC_X86 1
+#endif
+
+#define TMS_AVC_MAX_PARAM_SETS 8 // 最多记录的sps和pps数量
+#define TMS_AVC_MAX_PARAM_SET_SIZE 512 // 缓存的每个sps或pps的最大字节数
+
+#define TMS_AVC_NAL_IDR 5
+#define TMS_AVC_NAL_SPS 7
+#define TMS_AVC_NAL_PPS 8
+
+#define TMS_AVC_PACKETIZATION_MODE_VAR "TMS_H264_PACKETIZATION_MODE" // 指定packetization-mode的通道变量
+#define TMS_AVC_PARAM_SETS_VAR "TMS_H264_PARAM_SETS"                 // 是否在每个IDR前发送sps和pps的通道变量
+
+typedef const uint8_t *(*TmsAvcFindStartcode)(const uint8_t *p, const uint8_t *end);
+
+/**
+ * mp4中h264流的avcC格式参数
+ *
+ * 媒体包中的nal前面是nal_length_size个字节的长度（大端），没有startcode；sps和pps保存在extradata中。
+ * param_sets指向extradata中的数据，extradata释放前有效。
+ */
+typedef struct TmsAvcConfig
+{
+  int nal_length_size; // 等于0时不是avcC格式
+  int nb_param_sets;   // 先sps后pps
+  const uint8_t *param_sets[TMS_AVC_MAX_PARAM_SETS];
+  int param_set_sizes[TMS_AVC_MAX_PARAM_SETS];
+} TmsAvcConfig;
+
+/**
+ * 发送过的sps和pps
+ *
+ * 码流中的参数集复制到缓存中，按nal类型和id替换旧的参数集。IDR前面没有参数集时用缓存的参数集补上，
+ * 对端（例如手机上的linphone）丢失开始的参数集后，在下1个IDR就能恢复，不需要缩短文件的gop。
+ */
+typedef struct TmsAvcParamCache
+{
+  int nb_param_sets;
+  uint8_t types[TMS_AVC_MAX_PARAM_SETS];
+  int ids[TMS_AVC_MAX_PARAM_SETS];
+  int sizes[TMS_AVC_MAX_PARAM_SETS];
+  uint8_t data[TMS_AVC_MAX_PARAM_SETS][TMS_AVC_MAX_PARAM_SET_SIZE];
+} TmsAvcParamCache;
+
+const uint8_t *tms_avc_find_startcode_c(const uint8_t *p, const uint8_t *end);
+
+#ifdef TMS_AVC_X86
+const uint8_t *tms_avc_find_startcode_sse2(const uint8_t *p, const uint8_t *end);
+
+const uint8_t *tms_avc_find_startcode_avx2(const uint8_t *p, const uint8_t *end);
+#endif
+
+const char *tms_avc_find_startcode_impl(void);
+
+const uint8_t *tms_avc_find_startcode(const uint8_t *p, const uint8_t *end);
+
+int tms_avc_parse_extradata(const uint8_t *extradata, int size, TmsAvcConfig *avc);
+
+int tms_avc_nal_length(const uint8_t *p, int nal_length_size);
+
+int tms_avc_packetization_mode(struct ast_channel *chan);
+
+int tms_avc_param_sets_mode(struct ast_channel *chan);
+
+void tms_avc_param_cache_update(TmsAvcParamCache *cache, const uint8_t *nal, int size);
+
+void tms_avc_param_cache_load(TmsAvcParamCache *cache, const TmsAvcConfig *avc);
+
+/* 通用版本，返回第1个startcode的位置，没有时返回end。不检查从最后3个字节开始的startcode */
+const uint8_t *tms_avc_find_startcode_c(const uint8_t *p, const uint8_t *end)
+{
+  const uint8_t *a = p + 4 - ((intptr_t)p & 3);
+
+  for (end -= 3; p < a && p < end; p++)
+  {
+    if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+      return p;
+  }
+
+  for (end -= 3; p < end; p += 4)
+  {
+    uint32_t x = *(const uint32_t *)p;
+    //      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
+    //      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
+    if ((x - 0x01010101) & (~x) & 0x80808080)
+    { // generic
+      if (p[1] == 0)
+      {
+        if (p[0] == 0 && p[2] == 1)
+          return p;
+        if (p[2] == 0 && p[3] == 1)
+          return p + 1;
+      }
+      if (p[3] == 0)
+      {
+        if (p[2] == 0 && p[4] == 1)
+          return p + 2;
+        if (p[4] == 0 && p[5] == 1)
+          return p + 3;
+      }
+    }
+  }
+
+  for (end += 3; p < end; p++)
+  {
+    if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+      return p;
+  }
+
+  return end + 3;
+}
+
+#ifdef TMS_AVC_X86
+/**
+ * SSE2版本
+ *
+ * 分别从p、p+1、p+2读取16个字节，3个位置依次等于0、0、1的字节就是startcode的起点。
+ * 经过防竞争处理的码流中连续的2个0很少，先只比较前2个位置。
+ * 和通用版本一致，不返回在最后3个字节上的startcode（后面没有nal），剩余不足19个字节时交给通用版本。
+ */
+__attribute__((target("sse2"))) const uint8_t *tms_avc_find_startcode_sse2(const uint8_t *p, const uint8_t *end)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+
+  for (; end - p >= 19; p += 16)
+  {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i m = _mm_and_si128(_mm_cmpeq_epi8(v0, zero), _mm_cmpeq_epi8(v1, zero));
+    if (!_mm_movemask_epi8(m))
+      continue;
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 2));
+    int mask = _mm_movemask_epi8(_mm_and_si128(m, _mm_cmpeq_epi8(v2, one)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+
+  return tms_avc_find_startcode_c(p, end);
+}
+
+/* AVX2版本，每次比较32个字节 */
+__attribute__((target("avx2"))) const uint8_t *tms_avc_find_startcode_avx2(const uint8_t *p, const uint8_t *end)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+
+  for (; end - p >= 35; p += 32)
+  {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(v0, zero), _mm256_cmpeq_epi8(v1, zero));
+    if (!_mm256_movemask_epi8(m))
+      continue;
+    __m256i v2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(m, _mm256_cmpeq_epi8(v2, one)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+
+  return tms_avc_find_startcode_sse2(p, end);
+}
+#endif
+
+static TmsAvcFindStartcode tms_avc_find_startcode_fn = NULL;
+static const char *tms_avc_find_startcode_name = NULL;
+
+/* 根据CPU选择实现，多个线程同时初始化的结果相同 */
+static void tms_avc_find_startcode_init(void)
+{
+#ifdef TMS_AVC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    tms_avc_find_startcode_name = "avx2";
+    tms_avc_find_startcode_fn = tms_avc_find_startcode_avx2;
+    return;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    tms_avc_find_startcode_name = "sse2";
+    tms_avc_find_startcode_fn = tms_avc_find_startcode_sse2;
+    return;
+  }
+#endif
+  tms_avc_find_startcode_name = "c";
+  tms_avc_find_startcode_fn = tms_avc_find_startcode_c;
+}
+
+/* 当前使用的实现名称 */
+const char *tms_avc_find_startcode_impl(void)
+{
+  if (!tms_avc_find_startcode_name)
+    tms_avc_find_startcode_init();
+
+  return tms_avc_find_startcode_name;
+}
+
+/* 查找startcode，4字节的startcode（00 00 00 01）返回第1个0的位置 */
+const uint8_t *tms_avc_find_startcode(const uint8_t *p, const uint8_t *end)
+{
+  const uint8_t *out;
+
+  if (!tms_avc_find_startcode_fn)
+    tms_avc_find_startcode_init();
+
+  out = tms_avc_find_startcode_fn(p, end);
+  if (p < out && out < end && !out[-1])
+    out--;
+  return out;
+}
+
+/* 读取avcC中的1组参数集（sps或pps），返回下一组的位置，失败时返回NULL */
+static const uint8_t *tms_avc_parse_param_sets(const uint8_t *p, const uint8_t *end, int count, TmsAvcConfig *avc)
+{
+  int i, size;
+
+  for (i = 0; i < count; i++)
+  {
+    if (end - p < 2)
+      return NULL;
+    size = (p[0] << 8) | p[1];
+    p += 2;
+    if (size == 0 || end - p < size)
+      return NULL;
+    if (avc->nb_param_sets < TMS_AVC_MAX_PARAM_SETS)
+    {
+      avc->param_sets[avc->nb_param_sets] = p;
+      avc->param_set_sizes[avc->nb_param_sets] = size;
+      avc->nb_param_sets++;
+    }
+    p += size;
+  }
+
+  return p;
+}
+
+/**
+ * 解析avcC格式的extradata
+ *
+ * @return 0 成功；-1 不是avcC格式（例如annexb格式的extradata），需要用其他方式处理
+ */
+int tms_avc_parse_extradata(const uint8_t *extradata, int size, TmsAvcConfig *avc)
+{
+  const uint8_t *p = extradata, *end = extradata + size;
+
+  memset(avc, 0, sizeof(TmsAvcConfig));
+
+  /* configurationVersion等于1，至少包含到numOfSequenceParameterSets */
+  if (!extradata || size < 7 || extradata[0] != 1)
+    return -1;
+
+  p = tms_avc_parse_param_sets(p + 6, end, extradata[5] & 0x1f, avc);
+  if (!p || p >= end)
+    return -1;
+  p = tms_avc_parse_param_sets(p + 1, end, p[0], avc);
+  if (!p)
+    return -1;
+
+  avc->nal_length_size = (extradata[4] & 0x03) + 1;
+
+  return 0;
+}
+
+/* 读取nal前面的长度 */
+int tms_avc_nal_length(const uint8_t *p, int nal_length_size)
+{
+  int i, len = 0;
+
+  for (i = 0; i < nal_length_size; i++)
+    len = (len << 8) | p[i];
+
+  return len;
+}
+
+/**
+ * 获得通道使用的h264 packetization-mode
+ *
+ * 优先使用通道变量TMS_H264_PACKETIZATION_MODE，否则使用通道协商的h264格式的fmtp，都没有时使用1。
+ * 等于0时每个RTP包只包含1个nal；等于1时小的nal聚合为STAP-A，大的nal拆分为FU-A。
+ */
+int tms_avc_packetization_mode(struct ast_channel *chan)
+{
+  struct ast_format *fmt;
+  struct ast_str *fmtp = ast_str_alloca(256);
+  const char *val;
+  int mode = 1;
+
+  ast_channel_lock(chan);
+  if (!ast_strlen_zero(val = pbx_builtin_getvar_helper(chan, TMS_AVC_PACKETIZATION_MODE_VAR)))
+  {
+    mode = atoi(val) ? 1 : 0;
+    ast_debug(1, "通道 %s 指定packetization-mode %s\n", ast_channel_name(chan), val);
+  }
+  else if ((fmt = ast_format_cap_get_compatible_format(ast_channel_nativeformats(chan), ast_format_h264)))
+  {
+    ast_format_generate_sdp_fmtp(fmt, 0, &fmtp);
+    if ((val = strstr(ast_str_buffer(fmtp), "packetization-mode=")))
+      mode = atoi(val + strlen("packetization-mode=")) ? 1 : 0;
+    ast_debug(1, "通道 %s 协商的h264格式参数 %s\n", ast_channel_name(chan), ast_str_buffer(fmtp));
+    ao2_ref(fmt, -1);
+  }
+  ast_channel_unlock(chan);
+
+  return mode;
+}
+
+/* 读取整数通道变量，没有设置时返回def，超出范围时取边界值 */
+static int tms_avc_get_int_var(struct ast_channel *chan, const char *name, int def, int min, int max)
+{
+  const char *val;
+  int n = def;
+
+  ast_channel_lock(chan);
+  if (!ast_strlen_zero(val = pbx_builtin_getvar_helper(chan, name)))
+  {
+    n = atoi(val);
+    ast_debug(1, "通道 %s 指定 %s=%s\n", ast_channel_name(chan), name, val);
+  }
+  ast_channel_unlock(chan);
+
+  return n < min ? min : n > max ? max : n;
+}
+
+/**
+ * 是否在每个IDR前发送sps和pps
+ *
+ * 通道变量TMS_H264_PARAM_SETS等于0时只发送码流中原有的参数集（avcC格式的文件在第1个IDR前发送extradata中的参数集），
+ * 否则在每个前面没有参数集的IDR前发送缓存的参数集，默认是1。
+ */
+int tms_avc_param_sets_mode(struct ast_channel *chan)
+{
+  return tms_avc_get_int_var(chan, TMS_AVC_PARAM_SETS_VAR, 1, 0, 1);
+}
+
+/* 读取ue(v)，出错时返回-1。参数集开头的几个字节中没有防竞争字节，不需要处理 */
+static int tms_avc_read_ue(const uint8_t *p, int size, int bit)
+{
+  int zeros = 0, value = 0, i;
+
+  while (bit < size * 8 && !(p[bit >> 3] & (0x80 >> (bit & 7))))
+  {
+    zeros++;
+    bit++;
+  }
+  if (zeros > 31 || bit + zeros >= size * 8)
+    return -1;
+  bit++;
+  for (i = 0; i < zeros; i++, bit++)
+    value = (value << 1) | !!(p[bit >> 3] & (0x80 >> (bit & 7)));
+
+  return (1 << zeros) - 1 + value;
+}
+
+/* 参数集的id，sps在profile_idc、constraint_flags和level_idc之后，pps在开头 */
+static int tms_avc_param_set_id(const uint8_t *nal, int size)
+{
+  if ((nal[0] & 0x1f) == TMS_AVC_NAL_SPS)
+    return size > 4 ? tms_avc_read_ue(nal + 4, size - 4, 0) : -1;
+
+  return size > 1 ? tms_avc_read_ue(nal + 1, size - 1, 0) : -1;
+}
+
+/* 缓存1个sps或pps，替换类型和id相同的参数集 */
+void tms_avc_param_cache_update(TmsAvcParamCache *cache, const uint8_t *nal, int size)
+{
+  int type = nal[0] & 0x1f;
+  int id = tms_avc_param_set_id(nal, size);
+  int i;
+
+  if (id < 0 || size > TMS_AVC_MAX_PARAM_SET_SIZE)
+  {
+    ast_debug(1, "不缓存参数集 type = %d id = %d size = %d\n", type, id, size);
+    return;
+  }
+
+  for (i = 0; i < cache->nb_param_sets; i++)
+  {
+    if (cache->types[i] == type && cache->ids[i] == id)
+      break;
+  }
+  if (i == cache->nb_param_sets)
+  {
+    if (cache->nb_param_sets >= TMS_AVC_MAX_PARAM_SETS)
+      return;
+    cache->nb_param_sets++;
+  }
+
+  cache->types[i] = type;
+  cache->ids[i] = id;
+  cache->sizes[i] = size;
+  memcpy(cache->data[i], nal, size);
+}
+
+/* 用avcC的extradata中的参数集初始化缓存 */
+void tms_avc_param_cache_load(TmsAvcParamCache *cache, const TmsAvcConfig *avc)
+{
+  int i;
+
+  for (i = 0; i < avc->nb_param_sets; i++)
+    tms_avc_param_cache_update(cache, avc->param_sets[i], avc->param_set_sizes[i]);
+}
+
+#endif
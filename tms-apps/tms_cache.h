@@ -0,0 +1,697 @@
+#ifndef TMS_CACHE_H
+#define TMS_CACHE_H
+
+#include <sys/stat.h>
+
+#include "asterisk/astobj2.h"
+#include "asterisk/linkedlists.h"
+#include "asterisk/lock.h"
+
+#define TMS_CACHE_DEFAULT_MAX_BYTES (64 * 1024 * 1024) // 缓存默认内存上限
+
+/**
+ * 缓存的媒体流参数
+ */
+typedef struct TmsCacheStream
+{
+  AVCodecParameters *codecpar;
+  AVRational time_base;
+  AVRational avg_frame_rate;
+  int64_t duration;
+} TmsCacheStream;
+
+/**
+ * 关键帧索引中的1项
+ */
+typedef struct TmsCacheKeyframe
+{
+  int64_t time_us; // 关键帧的pts，单位微秒
+  int packet;      // 关键帧在packets中的位置
+  int start;       // 跳转后开始读取的位置，其他媒体流中不早于关键帧的包都在这个位置之后
+} TmsCacheKeyframe;
+
+/**
+ * 缓存的媒体文件，包含解析后的包索引，编解码参数和包数据
+ *
+ * 对象通过ao2引用计数管理，缓存列表持有1个引用，每个播放者持有1个引用。
+ */
+typedef struct TmsMediaCacheEntry
+{
+  char *path;
+  time_t mtime;
+  off_t size;
+  int loading; // 正在加载，其它调用者需要等待
+  int failed;  // 加载失败
+  int cached;  // 是否在缓存列表中
+  int64_t duration;
+  int nb_streams;
+  TmsCacheStream *streams;
+  AVPacket *packets; // 按读取顺序保存的媒体包
+  int nb_packets;
+  int max_packets;
+  int index_stream;             // 建立关键帧索引的媒体流，有视频时是视频流
+  TmsCacheKeyframe *keyframes;  // 按时间排序的关键帧索引，加载时建立，跳转时二分查找
+  int nb_keyframes;
+  size_t nb_bytes; // 占用的内存
+  AST_LIST_ENTRY(TmsMediaCacheEntry) list;
+} TmsMediaCacheEntry;
+
+/**
+ * 从缓存或文件中读取媒体包
+ *
+ * 跳转后丢弃关键帧之前的包：索引媒体流在关键帧之前的包，其他媒体流中时间早于关键帧的包。
+ */
+typedef struct TmsPacketReader
+{
+  TmsMediaCacheEntry *entry; // 不为空时从缓存读取
+  int next;                  // 下一个要读取的包
+  AVFormatContext *ictx;     // 文件超出缓存上限时直接读取文件
+  int index_stream;          // 按这个媒体流的关键帧跳转
+  int64_t position_us;       // 索引媒体流最近读取的包的时间，单位微秒
+  int eof;                   // 跳转到了文件结尾
+  int seek_packet;           // 从缓存读取时，索引媒体流在这个位置之前的包丢弃
+  int seek_wait_key;         // 直接读取文件时，在索引媒体流的关键帧之前的包都丢弃
+  int64_t seek_time_us;      // 其他媒体流中早于这个时间的包丢弃
+} TmsPacketReader;
+
+/**
+ * 进程内共享的媒体缓存，按最近使用排序，头部是最近使用的文件
+ */
+static struct
+{
+  ast_mutex_t lock;
+  ast_cond_t cond;
+  AST_LIST_HEAD_NOLOCK(, TmsMediaCacheEntry) entries;
+  size_t nb_bytes;
+  size_t max_bytes;
+  unsigned int nb_hits;
+  unsigned int nb_misses;
+  unsigned int nb_evictions;
+} tms_cache;
+
+int tms_media_cache_init(size_t max_bytes);
+
+void tms_media_cache_destroy(void);
+
+int tms_media_cache_get(const char *path, TmsMediaCacheEntry **out);
+
+void tms_media_cache_release(TmsMediaCacheEntry *entry);
+
+int tms_packet_reader_open(TmsPacketReader *reader, const char *filename);
+
+void tms_packet_reader_init(TmsPacketReader *reader);
+
+int tms_packet_reader_read(TmsPacketReader *reader, AVPacket *pkt);
+
+int tms_packet_reader_seek(TmsPacketReader *reader, int64_t target_us, int forward, int64_t *out_time_us);
+
+void tms_packet_reader_close(TmsPacketReader *reader);
+
+/* 释放缓存对象 */
+static void tms_media_cache_entry_destructor(void *obj)
+{
+  TmsMediaCacheEntry *entry = obj;
+  int i;
+
+  for (i = 0; i < entry->nb_packets; i++)
+  {
+    av_packet_unref(&entry->packets[i]);
+  }
+  av_freep(&entry->packets);
+  ast_free(entry->keyframes);
+
+  if (entry->streams)
+  {
+    for (i = 0; i < entry->nb_streams; i++)
+    {
+      avcodec_parameters_free(&entry->streams[i].codecpar);
+    }
+    ast_free(entry->streams);
+  }
+
+  ast_free(entry->path);
+}
+
+/* 初始化缓存 */
+int tms_media_cache_init(size_t max_bytes)
+{
+  ast_mutex_init(&tms_cache.lock);
+  ast_cond_init(&tms_cache.cond, NULL);
+  AST_LIST_HEAD_INIT_NOLOCK(&tms_cache.entries);
+  tms_cache.nb_bytes = 0;
+  tms_cache.max_bytes = max_bytes;
+
+  ast_debug(1, "媒体缓存上限 %zu 字节\n", max_bytes);
+
+  return 0;
+}
+
+/* 清空缓存，正在使用的对象在最后一个引用释放时销毁 */
+void tms_media_cache_destroy(void)
+{
+  TmsMediaCacheEntry *entry;
+
+  ast_mutex_lock(&tms_cache.lock);
+  while ((entry = AST_LIST_REMOVE_HEAD(&tms_cache.entries, list)))
+  {
+    entry->cached = 0;
+    ao2_ref(entry, -1);
+  }
+  tms_cache.nb_bytes = 0;
+  ast_mutex_unlock(&tms_cache.lock);
+
+  ast_cond_destroy(&tms_cache.cond);
+  ast_mutex_destroy(&tms_cache.lock);
+}
+
+/* 按照内存上限淘汰最久未使用的文件，调用时需要持有锁 */
+static void tms_media_cache_evict(TmsMediaCacheEntry *keep)
+{
+  TmsMediaCacheEntry *entry, *victim;
+
+  while (tms_cache.nb_bytes > tms_cache.max_bytes)
+  {
+    victim = NULL;
+    AST_LIST_TRAVERSE(&tms_cache.entries, entry, list)
+    {
+      if (entry != keep && !entry->loading)
+        victim = entry;
+    }
+    if (!victim)
+      break;
+
+    AST_LIST_REMOVE(&tms_cache.entries, victim, list);
+    victim->cached = 0;
+    tms_cache.nb_bytes -= victim->nb_bytes;
+    tms_cache.nb_evictions++;
+
+    ast_debug(1, "淘汰缓存文件 %s，释放 %zu 字节\n", victim->path, victim->nb_bytes);
+
+    ao2_ref(victim, -1);
+  }
+}
+
+/* 从缓存列表中删除，调用时需要持有锁 */
+static void tms_media_cache_unlink(TmsMediaCacheEntry *entry)
+{
+  if (!entry->cached)
+    return;
+
+  AST_LIST_REMOVE(&tms_cache.entries, entry, list);
+  entry->cached = 0;
+  tms_cache.nb_bytes -= entry->nb_bytes;
+  ao2_ref(entry, -1);
+}
+
+/* 包的时间，单位微秒，没有pts时用dts */
+static int64_t tms_cache_packet_time_us(const AVPacket *pkt, AVRational time_base)
+{
+  int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+  return ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : av_rescale_q(ts, time_base, AV_TIME_BASE_Q);
+}
+
+static int tms_cache_keyframe_cmp(const void *a, const void *b)
+{
+  int64_t ta = ((const TmsCacheKeyframe *)a)->time_us, tb = ((const TmsCacheKeyframe *)b)->time_us;
+
+  return ta < tb ? -1 : ta > tb;
+}
+
+/**
+ * 建立关键帧索引
+ *
+ * 有视频流时索引视频流的关键帧，否则索引第1个媒体流（音频包都是关键帧）。
+ * 其他媒体流的包按时间单调递增，每个媒体流用1个游标遍历1次，得到每个关键帧跳转后开始读取的位置。
+ */
+static int tms_media_cache_build_index(TmsMediaCacheEntry *entry)
+{
+  int i, j, k;
+  int *cursors = NULL;
+  int64_t t;
+
+  entry->index_stream = 0;
+  for (i = 0; i < entry->nb_streams; i++)
+  {
+    if (entry->streams[i].codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      entry->index_stream = i;
+      break;
+    }
+  }
+
+  for (i = 0, k = 0; i < entry->nb_packets; i++)
+  {
+    AVPacket *pkt = &entry->packets[i];
+    if (pkt->stream_index == entry->index_stream && (pkt->flags & AV_PKT_FLAG_KEY))
+      k++;
+  }
+  if (!k)
+    return 0;
+  if (!(entry->keyframes = ast_calloc(k, sizeof(TmsCacheKeyframe))) ||
+      !(cursors = ast_calloc(entry->nb_streams, sizeof(int))))
+    return -1;
+
+  for (i = 0; i < entry->nb_packets; i++)
+  {
+    AVPacket *pkt = &entry->packets[i];
+    if (pkt->stream_index != entry->index_stream || !(pkt->flags & AV_PKT_FLAG_KEY))
+      continue;
+    if ((t = tms_cache_packet_time_us(pkt, entry->streams[pkt->stream_index].time_base)) == AV_NOPTS_VALUE)
+      continue;
+    entry->keyframes[entry->nb_keyframes].time_us = t;
+    entry->keyframes[entry->nb_keyframes].packet = i;
+    entry->keyframes[entry->nb_keyframes].start = i;
+    entry->nb_keyframes++;
+  }
+  qsort(entry->keyframes, entry->nb_keyframes, sizeof(TmsCacheKeyframe), tms_cache_keyframe_cmp);
+
+  for (i = 0; i < entry->nb_packets; i++)
+  {
+    AVPacket *pkt = &entry->packets[i];
+    if (pkt->stream_index == entry->index_stream)
+      continue;
+    if ((t = tms_cache_packet_time_us(pkt, entry->streams[pkt->stream_index].time_base)) == AV_NOPTS_VALUE)
+      continue;
+    for (j = cursors[pkt->stream_index]; j < entry->nb_keyframes && t >= entry->keyframes[j].time_us; j++)
+    {
+      if (i < entry->keyframes[j].start)
+        entry->keyframes[j].start = i;
+    }
+    cursors[pkt->stream_index] = j;
+  }
+  ast_free(cursors);
+
+  ast_debug(1, "媒体文件 %s 的媒体流 #%d 有 %d 个关键帧\n", entry->path, entry->index_stream, entry->nb_keyframes);
+
+  return 0;
+}
+
+/* 打开文件，读取媒体流参数和全部媒体包 */
+static int tms_media_cache_load(TmsMediaCacheEntry *entry)
+{
+  int ret = 0, i;
+  AVFormatContext *ictx = NULL;
+  AVPacket *pkt = NULL;
+
+  if ((ret = avformat_open_input(&ictx, entry->path, NULL, NULL)) < 0)
+  {
+    ast_log(LOG_WARNING, "无法打开媒体文件 %s\n", entry->path);
+    return -1;
+  }
+  if ((ret = avformat_find_stream_info(ictx, NULL)) < 0)
+  {
+    ast_log(LOG_WARNING, "无法获取媒体文件信息 %s\n", entry->path);
+    goto end;
+  }
+
+  entry->duration = ictx->duration;
+  entry->nb_streams = ictx->nb_streams;
+  entry->streams = ast_calloc(ictx->nb_streams, sizeof(TmsCacheStream));
+  if (!entry->streams)
+  {
+    ret = -1;
+    goto end;
+  }
+  for (i = 0; i < entry->nb_streams; i++)
+  {
+    AVStream *st = ictx->streams[i];
+    TmsCacheStream *cs = &entry->streams[i];
+
+    cs->codecpar = avcodec_parameters_alloc();
+    if (!cs->codecpar || avcodec_parameters_copy(cs->codecpar, st->codecpar) < 0)
+    {
+      ret = -1;
+      goto end;
+    }
+    cs->time_base = st->time_base;
+    cs->avg_frame_rate = st->avg_frame_rate;
+    cs->duration = st->duration;
+  }
+
+  pkt = av_packet_alloc();
+  while ((ret = av_read_frame(ictx, pkt)) >= 0)
+  {
+    /* 保证包数据有引用计数，播放时可以直接引用，不需要复制 */
+    if ((ret = av_packet_make_refcounted(pkt)) < 0)
+    {
+      goto end;
+    }
+    if (entry->nb_packets == entry->max_packets)
+    {
+      int max_packets = entry->max_packets ? entry->max_packets * 2 : 256;
+      AVPacket *packets = av_realloc_array(entry->packets, max_packets, sizeof(AVPacket));
+      if (!packets)
+      {
+        ret = AVERROR(ENOMEM);
+        goto end;
+      }
+      entry->packets = packets;
+      entry->max_packets = max_packets;
+    }
+    av_packet_move_ref(&entry->packets[entry->nb_packets++], pkt);
+  }
+  if (ret != AVERROR_EOF)
+  {
+    ast_log(LOG_WARNING, "读取媒体包 #%d 失败 %s\n", entry->nb_packets + 1, av_err2str(ret));
+    goto end;
+  }
+  if ((ret = tms_media_cache_build_index(entry)) < 0)
+  {
+    goto end;
+  }
+  /* 缓存占用的内存 */
+  entry->nb_bytes = sizeof(TmsMediaCacheEntry) + entry->nb_streams * sizeof(TmsCacheStream) + entry->max_packets * sizeof(AVPacket) + entry->nb_keyframes * sizeof(TmsCacheKeyframe);
+  for (i = 0; i < entry->nb_streams; i++)
+  {
+    entry->nb_bytes += entry->streams[i].codecpar->extradata_size;
+  }
+  for (i = 0; i < entry->nb_packets; i++)
+  {
+    entry->nb_bytes += entry->packets[i].size;
+  }
+  ret = 0;
+
+  ast_debug(1, "完成媒体文件缓存 %s，共 %d 个包，占用 %zu 字节\n", entry->path, entry->nb_packets, entry->nb_bytes);
+
+end:
+  if (pkt)
+    av_packet_free(&pkt);
+
+  avformat_close_input(&ictx);
+
+  return ret < 0 ? -1 : 0;
+}
+
+/**
+ * 获得缓存的媒体文件
+ *
+ * 用路径，修改时间和文件大小作为键值。多个调用者同时请求未缓存的文件时，只有1个调用者打开文件，其它调用者等待加载完成。
+ *
+ * @return 0 获得缓存对象，使用后需要调用tms_media_cache_release；1 文件超出缓存上限，需要直接读取文件；-1 失败
+ */
+int tms_media_cache_get(const char *path, TmsMediaCacheEntry **out)
+{
+  struct stat st;
+  TmsMediaCacheEntry *entry;
+
+  *out = NULL;
+
+  if (stat(path, &st) < 0)
+  {
+    ast_log(LOG_WARNING, "无法获得媒体文件状态 %s %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (!tms_cache.max_bytes || st.st_size > tms_cache.max_bytes)
+  {
+    return 1;
+  }
+
+  ast_mutex_lock(&tms_cache.lock);
+  while (1)
+  {
+    AST_LIST_TRAVERSE(&tms_cache.entries, entry, list)
+    {
+      if (!strcmp(entry->path, path))
+        break;
+    }
+    if (!entry)
+      break;
+    /* 文件已经修改过，原来的缓存无效 */
+    if (entry->mtime != st.st_mtime || entry->size != st.st_size)
+    {
+      if (entry->loading)
+      {
+        ast_cond_wait(&tms_cache.cond, &tms_cache.lock);
+        continue;
+      }
+      tms_media_cache_unlink(entry);
+      entry = NULL;
+      break;
+    }
+    if (entry->loading)
+    {
+      ast_cond_wait(&tms_cache.cond, &tms_cache.lock);
+      continue;
+    }
+    /* 命中，移到列表头部 */
+    AST_LIST_REMOVE(&tms_cache.entries, entry, list);
+    AST_LIST_INSERT_HEAD(&tms_cache.entries, entry, list);
+    tms_cache.nb_hits++;
+    *out = ao2_bump(entry);
+    ast_mutex_unlock(&tms_cache.lock);
+    return 0;
+  }
+
+  /* 未命中，加入占位对象后在锁外加载 */
+  tms_cache.nb_misses++;
+  entry = ao2_alloc(sizeof(*entry), tms_media_cache_entry_destructor);
+  if (!entry || !(entry->path = ast_strdup(path)))
+  {
+    ao2_cleanup(entry);
+    ast_mutex_unlock(&tms_cache.lock);
+    return -1;
+  }
+  entry->mtime = st.st_mtime;
+  entry->size = st.st_size;
+  entry->loading = 1;
+  entry->cached = 1;
+  AST_LIST_INSERT_HEAD(&tms_cache.entries, entry, list);
+  ao2_ref(entry, +1); // 缓存列表持有的引用
+  ast_mutex_unlock(&tms_cache.lock);
+
+  int ret = tms_media_cache_load(entry);
+
+  ast_mutex_lock(&tms_cache.lock);
+  entry->loading = 0;
+  if (ret < 0)
+  {
+    entry->failed = 1;
+    tms_media_cache_unlink(entry);
+  }
+  else if (entry->cached)
+  {
+    tms_cache.nb_bytes += entry->nb_bytes;
+    tms_media_cache_evict(entry);
+  }
+  ast_cond_broadcast(&tms_cache.cond);
+  ast_mutex_unlock(&tms_cache.lock);
+
+  if (ret < 0)
+  {
+    ao2_ref(entry, -1);
+    return -1;
+  }
+
+  *out = entry;
+
+  return 0;
+}
+
+/* 释放对缓存对象的引用 */
+void tms_media_cache_release(TmsMediaCacheEntry *entry)
+{
+  ao2_cleanup(entry);
+}
+
+/**
+ * 打开媒体文件，优先从缓存中读取，文件超出缓存上限时直接读取文件
+ *
+ * 可以在其他线程中调用，例如播放列表在播放当前文件时打开下1个文件。
+ *
+ * @return 0 成功；-1 失败，已经打开的资源由tms_packet_reader_close释放
+ */
+int tms_packet_reader_open(TmsPacketReader *reader, const char *filename)
+{
+  int ret;
+
+  if ((ret = tms_media_cache_get(filename, &reader->entry)) < 0)
+  {
+    return -1;
+  }
+  else if (ret > 0)
+  {
+    if ((ret = avformat_open_input(&reader->ictx, filename, NULL, NULL)) < 0)
+    {
+      ast_log(LOG_WARNING, "无法打开媒体文件 %s\n", filename);
+      return -1;
+    }
+    if ((ret = avformat_find_stream_info(reader->ictx, NULL)) < 0)
+    {
+      ast_log(LOG_WARNING, "无法获取媒体文件信息 %s\n", filename);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* 打开缓存或文件后调用，选择建立索引的媒体流 */
+void tms_packet_reader_init(TmsPacketReader *reader)
+{
+  int index;
+
+  if (reader->entry)
+  {
+    reader->index_stream = reader->entry->index_stream;
+  }
+  else
+  {
+    index = av_find_best_stream(reader->ictx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    reader->index_stream = index < 0 ? 0 : index;
+  }
+  reader->position_us = 0;
+  reader->eof = 0;
+  reader->seek_packet = 0;
+  reader->seek_wait_key = 0;
+  reader->seek_time_us = INT64_MIN;
+}
+
+/* 跳转后是否丢弃这个包 */
+static int tms_packet_reader_skip(TmsPacketReader *reader, const AVPacket *pkt, int64_t t)
+{
+  if (pkt->stream_index == reader->index_stream)
+  {
+    if (reader->entry)
+      return reader->next - 1 < reader->seek_packet;
+    if (reader->seek_wait_key)
+    {
+      if (!(pkt->flags & AV_PKT_FLAG_KEY))
+        return 1;
+      reader->seek_wait_key = 0;
+      reader->seek_time_us = t;
+    }
+    return 0;
+  }
+
+  return reader->seek_wait_key || (t != AV_NOPTS_VALUE && t < reader->seek_time_us);
+}
+
+/* 读取下一个媒体包，从缓存中读取时只增加包数据的引用 */
+int tms_packet_reader_read(TmsPacketReader *reader, AVPacket *pkt)
+{
+  AVRational time_base;
+  int64_t t;
+  int ret;
+
+  while (1)
+  {
+    if (reader->eof)
+      return AVERROR_EOF;
+
+    if (reader->entry)
+    {
+      if (reader->next >= reader->entry->nb_packets)
+        return AVERROR_EOF;
+      if ((ret = av_packet_ref(pkt, &reader->entry->packets[reader->next++])) < 0)
+        return ret;
+      time_base = reader->entry->streams[pkt->stream_index].time_base;
+    }
+    else
+    {
+      if ((ret = av_read_frame(reader->ictx, pkt)) < 0)
+        return ret;
+      time_base = reader->ictx->streams[pkt->stream_index]->time_base;
+    }
+
+    t = tms_cache_packet_time_us(pkt, time_base);
+    if (!tms_packet_reader_skip(reader, pkt, t))
+      break;
+    av_packet_unref(pkt);
+  }
+
+  if (pkt->stream_index == reader->index_stream && t != AV_NOPTS_VALUE)
+    reader->position_us = t;
+
+  return 0;
+}
+
+/**
+ * 跳转到目标位置附近的关键帧
+ *
+ * 从缓存读取时在关键帧索引中二分查找，直接读取文件时使用demuxer在打开文件时建立的索引（mp4的stss），都不需要逐包读取。
+ *
+ * @param forward 不为0时跳转到目标位置及之后的第1个关键帧，否则跳转到目标位置及之前的最后1个关键帧（没有时跳转到第1个关键帧）
+ * @param out_time_us 关键帧的时间，直接读取文件时是目标位置
+ * @return 0 成功；1 目标位置之后没有关键帧，之后读取返回AVERROR_EOF；-1 失败，读取位置不变
+ */
+int tms_packet_reader_seek(TmsPacketReader *reader, int64_t target_us, int forward, int64_t *out_time_us)
+{
+  TmsMediaCacheEntry *entry = reader->entry;
+  int lo, hi, mid;
+
+  if (entry)
+  {
+    if (!entry->nb_keyframes)
+      return -1;
+
+    /* 第1个时间大于target_us的关键帧 */
+    for (lo = 0, hi = entry->nb_keyframes; lo < hi;)
+    {
+      mid = (lo + hi) / 2;
+      if (entry->keyframes[mid].time_us <= target_us)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (forward)
+    {
+      if (lo > 0 && entry->keyframes[lo - 1].time_us == target_us)
+        lo--;
+      if (lo == entry->nb_keyframes)
+      {
+        reader->eof = 1;
+        return 1;
+      }
+    }
+    else
+    {
+      lo = lo > 0 ? lo - 1 : 0;
+    }
+
+    reader->next = entry->keyframes[lo].start;
+    reader->seek_packet = entry->keyframes[lo].packet;
+    reader->seek_time_us = entry->keyframes[lo].time_us;
+    *out_time_us = entry->keyframes[lo].time_us;
+  }
+  else
+  {
+    AVStream *st = reader->ictx->streams[reader->index_stream];
+    int64_t ts = av_rescale_q(target_us, AV_TIME_BASE_Q, st->time_base);
+    int ret;
+
+    if ((ret = av_seek_frame(reader->ictx, reader->index_stream, ts, forward ? 0 : AVSEEK_FLAG_BACKWARD)) < 0)
+    {
+      if (!forward)
+      {
+        ast_log(LOG_WARNING, "媒体文件跳转到 %" PRId64 " 微秒失败 %s\n", target_us, av_err2str(ret));
+        return -1;
+      }
+      reader->eof = 1;
+      return 1;
+    }
+    reader->seek_wait_key = 1;
+    reader->seek_time_us = INT64_MIN;
+    *out_time_us = target_us;
+  }
+
+  reader->position_us = *out_time_us;
+
+  return 0;
+}
+
+/* 释放读取器占用的资源 */
+void tms_packet_reader_close(TmsPacketReader *reader)
+{
+  if (reader->entry)
+  {
+    tms_media_cache_release(reader->entry);
+    reader->entry = NULL;
+  }
+  if (reader->ictx)
+  {
+    avformat_close_input(&reader->ictx);
+  }
+}
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef TMS_CONTROL_H
+#define TMS_CONTROL_H
+
+/**
+ * 播放控制
+ *
+ * 播放应用每发送1个包调用1次tms_control_poll，不等待，读取通道中已经到达的帧：检测挂机、处理控制播放的按键和关键帧请求。
+ * 发送由调度器按发送时间完成，通道线程最多提前排队的时长有限，挂机后在1个包的间隔内就能发现并停止解码、转码和发送。
+ */
+
+#include "asterisk/channel.h"
+#include "asterisk/frame.h"
+#include "asterisk/pbx.h"
+
+#include <libavutil/time.h>
+
+#include "tms_playback.h"
+
+#define TMS_CONTROL_DTMF_VAR TMS_PLAYBACK_DTMF_VAR // 记录停止播放的按键的通道变量
+
+typedef enum TmsControlEvent
+{
+  TMS_CONTROL_NONE = 0,
+  TMS_CONTROL_HANGUP,  // 通道已经挂机
+  TMS_CONTROL_STOP,    // 按了停止键
+  TMS_CONTROL_PAUSE,   // 按了暂停键
+  TMS_CONTROL_RESUME,  // 按了恢复键
+  TMS_CONTROL_FORWARD, // 按了快进键
+  TMS_CONTROL_REWIND,  // 按了快退键
+} TmsControlEvent;
+
+typedef struct TmsControl
+{
+  struct ast_channel *chan;
+  /* 控制播放的按键，可以为NULL */
+  const char *stopdtmfs;
+  const char *pausedtmfs;
+  const char *resumedtmfs;
+  const char *ffdtmfs;
+  const char *rwdtmfs;
+  int keyframe_requested;        // 收到VIDUPDATE，调用者处理后清除
+  unsigned int nb_keyframe_requests;
+} TmsControl;
+
+void tms_control_init(TmsControl *ctl, struct ast_channel *chan, const char *stopdtmfs);
+
+TmsControlEvent tms_control_poll(TmsControl *ctl);
+
+TmsControlEvent tms_control_wait_resume(TmsControl *ctl, int64_t *pause_duration_us);
+
+TmsPlaybackReason tms_control_reason(TmsControlEvent event);
+
+/* 初始化，只指定停止键，其他按键需要时直接设置 */
+void tms_control_init(TmsControl *ctl, struct ast_channel *chan, const char *stopdtmfs)
+{
+  memset(ctl, 0, sizeof(TmsControl));
+  ctl->chan = chan;
+  ctl->stopdtmfs = stopdtmfs;
+}
+
+/* 按键对应的事件 */
+static TmsControlEvent tms_control_dtmf_event(TmsControl *ctl, char key, int paused)
+{
+  if (paused)
+    return !ast_strlen_zero(ctl->resumedtmfs) && strchr(ctl->resumedtmfs, key) ? TMS_CONTROL_RESUME : TMS_CONTROL_NONE;
+
+  if (!ast_strlen_zero(ctl->stopdtmfs) && strchr(ctl->stopdtmfs, key))
+  {
+    char buf[2] = {key, '\0'};
+    pbx_builtin_setvar_helper(ctl->chan, TMS_CONTROL_DTMF_VAR, buf);
+    return TMS_CONTROL_STOP;
+  }
+  if (!ast_strlen_zero(ctl->pausedtmfs) && strchr(ctl->pausedtmfs, key))
+    return TMS_CONTROL_PAUSE;
+  if (!ast_strlen_zero(ctl->ffdtmfs) && strchr(ctl->ffdtmfs, key))
+    return TMS_CONTROL_FORWARD;
+  if (!ast_strlen_zero(ctl->rwdtmfs) && strchr(ctl->rwdtmfs, key))
+    return TMS_CONTROL_REWIND;
+
+  return TMS_CONTROL_NONE;
+}
+
+/**
+ * 读取通道中的帧，返回第1个需要处理的事件
+ *
+ * @param ms 等于0时只读取已经到达的帧；等于-1时一直等到有事件
+ */
+static TmsControlEvent tms_control_read(TmsControl *ctl, int ms, int paused)
+{
+  struct ast_channel *chan = ctl->chan;
+  struct ast_frame *f;
+  TmsControlEvent event = TMS_CONTROL_NONE;
+
+  if (ast_check_hangup_locked(chan))
+  {
+    ast_debug(1, "Hangup detected\n");
+    return TMS_CONTROL_HANGUP;
+  }
+
+  /* 挂机时ast_waitfor_n也返回通道，ast_read返回NULL */
+  while (event == TMS_CONTROL_NONE && ast_waitfor_n(&chan, 1, &ms))
+  {
+    if (!(f = ast_read(chan)))
+    {
+      ast_debug(1, "Null frame == hangup() detected\n");
+      return TMS_CONTROL_HANGUP;
+    }
+    if (f->frametype == AST_FRAME_DTMF)
+    {
+      ast_debug(2, "收到DTMF(%c)，检查是否需要播放控制\n", (char)f->subclass.integer);
+      event = tms_control_dtmf_event(ctl, (char)f->subclass.integer, paused);
+    }
+    /* 对端请求关键帧（SIP INFO或者RTCP FIR） */
+    else if (f->frametype == AST_FRAME_CONTROL && f->subclass.integer == AST_CONTROL_VIDUPDATE)
+    {
+      ast_debug(2, "收到VIDUPDATE，需要重发关键帧\n");
+      ctl->keyframe_requested = 1;
+      ctl->nb_keyframe_requests++;
+    }
+    ast_frfree(f);
+  }
+
+  return event;
+}
+
+/**
+ * 读取通道中已经到达的帧，不等待
+ *
+ * 按停止键时设置通道变量TMSDTMFKEY。1次只返回1个按键事件，后面的按键留到下次调用。
+ *
+ * @return 需要处理的事件，TMS_CONTROL_HANGUP时应该立即停止播放并释放资源
+ */
+TmsControlEvent tms_control_poll(TmsControl *ctl)
+{
+  return tms_control_read(ctl, 0, 0);
+}
+
+/**
+ * 暂停时等待恢复键，暂停的时长累加到pause_duration_us
+ *
+ * @return TMS_CONTROL_RESUME 恢复播放；TMS_CONTROL_HANGUP 已经挂机
+ */
+TmsControlEvent tms_control_wait_resume(TmsControl *ctl, int64_t *pause_duration_us)
+{
+  int64_t start = av_gettime_relative();
+  TmsControlEvent event;
+
+  while ((event = tms_control_read(ctl, -1, 1)) == TMS_CONTROL_NONE)
+    ;
+
+  *pause_duration_us += (av_gettime_relative() - start);
+
+  return event;
+}
+
+/* 停止播放的事件对应的结束原因，其他事件按发送失败处理 */
+TmsPlaybackReason tms_control_reason(TmsControlEvent event)
+{
+  switch (event)
+  {
+  case TMS_CONTROL_HANGUP:
+    return TMS_PLAYBACK_HANGUP;
+  case TMS_CONTROL_STOP:
+    return TMS_PLAYBACK_STOP;
+  default:
+    return TMS_PLAYBACK_ERROR;
+  }
+}
+
+#endif
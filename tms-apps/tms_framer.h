@@ -0,0 +1,155 @@
+#ifndef TMS_FRAMER_H
+#define TMS_FRAMER_H
+
+/**
+ * 音频分包
+ *
+ * 编码器输出的alaw数据长度和RTP包的长度（ptime对应的采样数）不一致，需要按固定长度重新分包。
+ * 输入数据中完整的包直接从输入缓冲区发送，不复制；只有不足1个包的剩余数据复制到暂存区，和下次输入的数据拼成1个包。
+ * 数据长度单独记录，不依赖数据内容（alaw采样可能是0x00）。
+ * 输入和发送在同一个线程中完成，不需要加锁。
+ */
+
+#include "asterisk/channel.h"
+#include "asterisk/format_cache.h"
+#include "asterisk/format_cap.h"
+#include "asterisk/pbx.h"
+
+#define TMS_FRAMER_MAX_FRAME_SIZE 1024 // 每个包的最大字节数
+
+#define TMS_FRAMER_DEFAULT_PTIME 20 // 默认打包时长，单位毫秒
+#define TMS_FRAMER_MIN_PTIME 10
+#define TMS_FRAMER_MAX_PTIME 120
+#define TMS_FRAMER_PTIME_VAR "TMS_PTIME" // 指定打包时长的通道变量
+
+/* 发送1个包，返回小于0时停止分包 */
+typedef int (*TmsFramerOutput)(void *opaque, const uint8_t *data, int len);
+
+typedef struct TmsFramer
+{
+  uint8_t carry[TMS_FRAMER_MAX_FRAME_SIZE]; // 上次输入剩余的不足1个包的数据
+  int carry_len;
+  int frame_size; // 每个包的字节数
+  TmsFramerOutput output;
+  void *opaque;
+  int nb_frames; // 已经输出的包数
+} TmsFramer;
+
+void tms_framer_init(TmsFramer *framer, int frame_size, TmsFramerOutput output, void *opaque);
+
+int tms_framer_push(TmsFramer *framer, const uint8_t *data, int len);
+
+int tms_framer_flush(TmsFramer *framer);
+
+int tms_framer_get_ptime(struct ast_channel *chan);
+
+/**
+ * 获得通道的音频打包时长，单位毫秒
+ *
+ * 优先使用通道变量TMS_PTIME（在拨号计划中按呼叫指定），否则使用通道协商的alaw打包时长（SDP中的ptime），都没有时使用20毫秒。
+ */
+int tms_framer_get_ptime(struct ast_channel *chan)
+{
+  const char *val;
+  int ptime = 0;
+
+  ast_channel_lock(chan);
+  if (!ast_strlen_zero(val = pbx_builtin_getvar_helper(chan, TMS_FRAMER_PTIME_VAR)))
+  {
+    ptime = atoi(val);
+    ast_debug(1, "通道 %s 指定打包时长 %s\n", ast_channel_name(chan), val);
+  }
+  else
+  {
+    ptime = ast_format_cap_get_format_framing(ast_channel_nativeformats(chan), ast_format_alaw);
+    ast_debug(1, "通道 %s 协商的打包时长 %d\n", ast_channel_name(chan), ptime);
+  }
+  ast_channel_unlock(chan);
+
+  if (ptime < TMS_FRAMER_MIN_PTIME || ptime > TMS_FRAMER_MAX_PTIME)
+    ptime = TMS_FRAMER_DEFAULT_PTIME;
+
+  return ptime;
+}
+
+/* 初始化，frame_size超出范围时使用最大值 */
+void tms_framer_init(TmsFramer *framer, int frame_size, TmsFramerOutput output, void *opaque)
+{
+  if (frame_size <= 0 || frame_size > TMS_FRAMER_MAX_FRAME_SIZE)
+    frame_size = TMS_FRAMER_MAX_FRAME_SIZE;
+
+  framer->carry_len = 0;
+  framer->frame_size = frame_size;
+  framer->output = output;
+  framer->opaque = opaque;
+  framer->nb_frames = 0;
+}
+
+/* 输出1个包 */
+static int tms_framer_output(TmsFramer *framer, const uint8_t *data, int len)
+{
+  framer->nb_frames++;
+
+  return framer->output(framer->opaque, data, len);
+}
+
+/**
+ * 输入数据，输出所有完整的包，剩余数据保留到下次输入
+ *
+ * @return 0 成功；小于0 输出失败
+ */
+int tms_framer_push(TmsFramer *framer, const uint8_t *data, int len)
+{
+  int ret, n;
+
+  /* 先补齐上次剩余的数据 */
+  if (framer->carry_len > 0)
+  {
+    n = framer->frame_size - framer->carry_len;
+    if (n > len)
+      n = len;
+    memcpy(framer->carry + framer->carry_len, data, n);
+    framer->carry_len += n;
+    data += n;
+    len -= n;
+
+    if (framer->carry_len < framer->frame_size)
+      return 0;
+
+    framer->carry_len = 0;
+    if ((ret = tms_framer_output(framer, framer->carry, framer->frame_size)) < 0)
+      return ret;
+  }
+
+  /* 完整的包直接从输入数据发送 */
+  while (len >= framer->frame_size)
+  {
+    if ((ret = tms_framer_output(framer, data, framer->frame_size)) < 0)
+      return ret;
+    data += framer->frame_size;
+    len -= framer->frame_size;
+  }
+
+  if (len > 0)
+  {
+    memcpy(framer->carry, data, len);
+    framer->carry_len = len;
+  }
+
+  return 0;
+}
+
+/* 输出剩余的不足1个包的数据 */
+int tms_framer_flush(TmsFramer *framer)
+{
+  int len = framer->carry_len;
+
+  if (len == 0)
+    return 0;
+
+  framer->carry_len = 0;
+
+  return tms_framer_output(framer, framer->carry, len);
+}
+
+#endif
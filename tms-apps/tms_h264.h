@@ -5,7 +5,9 @@
 #ifndef TMS_H264_H
 #define TMS_H264_H
 
+#include "tms_avc.h"
 #include "tms_rtp.h"
+#include "tms_video_history.h"
 
 #define FF_RTP_FLAG_H264_MODE0 8
 
@@ -48,59 +50,65 @@ typedef struct TmsVideoRtpContext
   int buffered_nals;
 
   int flags;
+
+  int64_t deadline_us; // 当前帧的发送时间
+
+  TmsVideoHistory history; // 对端请求关键帧时重发
+
+  TmsAvcParamCache param_cache; // 发送过的sps和pps
+  int inject_param_sets;        // 在每个没有参数集的IDR前发送缓存的参数集
+  int nb_param_sets_sent;       // 发送参数集的次数
 } TmsVideoRtpContext;
 
 void ff_rtp_send_h264(TmsVideoRtpContext *s, const uint8_t *buf1, int size, TmsPlayerContext *player);
 
+void tms_rtp_send_h264_avcc(TmsVideoRtpContext *s, const uint8_t *buf, int size, const TmsAvcConfig *avc, TmsPlayerContext *player);
+
 void tms_dump_audio_frame(AVFrame *frame, TmsPlayerContext *player);
 
-static void tms_rtp_send_video(TmsVideoRtpContext *s, const uint8_t *buf1, int len, int m, TmsPlayerContext *player)
+int tms_video_history_resend(TmsVideoRtpContext *s, TmsPlayerContext *player);
+
+/* 发送已经写好载荷的视频帧，帧来自帧池 */
+static void tms_rtp_write_video(TmsVideoRtpContext *s, struct ast_frame *f, int len, int m, TmsPlayerContext *player)
 {
   ast_debug(1, "进入ff_rtp_send_data len=%d M=%d\n", len, m);
 
-  uint8_t *data;
-
-  uint8_t buffer[PKT_SIZE];
-  struct ast_frame *f = (struct ast_frame *)buffer;
   s->timestamp = s->cur_timestamp;
 
-  /* Unset */
-  memset(f, 0, PKT_SIZE);
-
-  AST_FRAME_SET_BUFFER(f, f, PKT_OFFSET, PKT_PAYLOAD);
-
-  /* Set type */
-  f->frametype = AST_FRAME_VIDEO;
-  /* Set number of samples */
+  /**
+   * 帧池中的帧已经设置好类型、格式和时间戳标志
+   * asterisk中h264格式的采样率是1000，RTP模块按ts * 采样率 / 1000得到RTP时间戳，也就是ts本身，
+   * 所以ts直接按RTP中90000的时钟设置
+   */
   f->samples = 1;
-  // f->delivery.tv_usec = 0;
-  // f->delivery.tv_sec = 0;
-  // 告知asterisk使用指定的时间戳
-  ast_set_flag(f, AST_FRFLAG_HAS_TIMING_INFO);
   f->ts = s->timestamp;
-  /* Don't free the frame outside */
-  f->mallocd = 0;
-  //f->subclass.format = s->format;
-  f->subclass.format = ast_format_h264;
   f->subclass.frame_ending = m;
-  f->offset = AST_FRIENDLY_OFFSET;
-
-  /* Get data pointer */
-  data = AST_FRAME_GET_BUFFER(f);
-
   f->datalen = len;
 
-  memcpy(data, buf1, len);
+  if (s->history.recording)
+    tms_video_history_add(&s->history, AST_FRAME_GET_BUFFER(f), len, m);
 
-  /* Write frame */
-  ast_write(player->chan, f);
+  tms_rtcp_stream_update(&player->video_rtcp, s->timestamp, len, s->deadline_us);
 
-  ast_frfree(f);
+  /* 由调度器在发送时间写入通道 */
+  tms_pacer_pool_write(player->video_pool, f, s->deadline_us);
 
   player->nb_video_rtps++;
 
   ast_debug(2, "[chan %p] 完成第 %d 个视频RTP帧发送\n", player->chan, player->nb_video_rtps);
 }
+
+static void tms_rtp_send_video(TmsVideoRtpContext *s, const uint8_t *buf1, int len, int m, TmsPlayerContext *player)
+{
+  struct ast_frame *f = tms_pacer_pool_get(player->video_pool);
+
+  if (!f)
+    return;
+
+  memcpy(AST_FRAME_GET_BUFFER(f), buf1, len);
+
+  tms_rtp_write_video(s, f, len, m, player);
+}
 /* 将多个nal缓存起来一起发送 */
 static void flush_nal_buffered(TmsVideoRtpContext *s, int last, TmsPlayerContext *player)
 {
@@ -130,10 +138,10 @@ static void h264_nal_send(TmsVideoRtpContext *s, const uint8_t *buf, int size, i
   {
     int buffered_size = s->buf_ptr - s->buf;
     int header_size;
-    int skip_aggregate = 1;
+    int skip_aggregate;
 
     header_size = 1;
-    //skip_aggregate = s->flags & FF_RTP_FLAG_H264_MODE0;
+    skip_aggregate = s->flags & FF_RTP_FLAG_H264_MODE0;
 
     // Flush buffered NAL units if the current unit doesn't fit
     if (buffered_size + 2 + size > s->max_payload_size)
@@ -152,6 +160,11 @@ static void h264_nal_send(TmsVideoRtpContext *s, const uint8_t *buf, int size, i
       {
         *s->buf_ptr++ = 24;
       }
+      // STAP-A的NRI取聚合的nal中的最大值
+      if ((buf[0] & 0x60) > (s->buf[0] & 0x60))
+      {
+        s->buf[0] = (s->buf[0] & ~0x60) | (buf[0] & 0x60);
+      }
       AV_WB16(s->buf_ptr, size);
       s->buf_ptr += 2;
       memcpy(s->buf_ptr, buf, size);
@@ -170,103 +183,108 @@ static void h264_nal_send(TmsVideoRtpContext *s, const uint8_t *buf, int size, i
     flush_nal_buffered(s, 0, player);
     if (s->flags & FF_RTP_FLAG_H264_MODE0)
     {
-      ast_debug(1, "NAL size %d > %d, try -slice-max-size %d\n", size, s->max_payload_size, s->max_payload_size);
+      ast_log(LOG_WARNING, "packetization-mode=0时nal长度 %d 超过 %d，丢弃\n", size, s->max_payload_size);
       return;
     }
     ast_debug(1, "NAL size %d > %d\n", size, s->max_payload_size);
 
     uint8_t type = buf[0] & 0x1F;
     uint8_t nri = buf[0] & 0x60;
-
-    s->buf[0] = 28; /* FU Indicator; Type = 28 ---> FU-A */
-    s->buf[0] |= nri;
-    s->buf[1] = type;
-    s->buf[1] |= 1 << 7;
+    uint8_t fu[2];
+    struct ast_frame *f;
+    uint8_t *data;
+
+    fu[0] = 28; /* FU Indicator; Type = 28 ---> FU-A */
+    fu[0] |= nri;
+    fu[1] = type;
+    fu[1] |= 1 << 7;
     buf += 1;
     size -= 1;
 
     flag_byte = 1;
     header_size = 2;
 
+    /* 分片直接写入帧池中的帧，不经过s->buf */
     while (size + header_size > s->max_payload_size)
     {
-      memcpy(&s->buf[header_size], buf, s->max_payload_size - header_size);
-      tms_rtp_send_video(s, s->buf, s->max_payload_size, 0, player);
+      if (!(f = tms_pacer_pool_get(player->video_pool)))
+        return;
+      data = AST_FRAME_GET_BUFFER(f);
+      memcpy(data, fu, header_size);
+      memcpy(&data[header_size], buf, s->max_payload_size - header_size);
+      tms_rtp_write_video(s, f, s->max_payload_size, 0, player);
       buf += s->max_payload_size - header_size;
       size -= s->max_payload_size - header_size;
-      s->buf[flag_byte] &= ~(1 << 7);
+      fu[flag_byte] &= ~(1 << 7);
     }
-    s->buf[flag_byte] |= 1 << 6;
-    memcpy(&s->buf[header_size], buf, size);
-    tms_rtp_send_video(s, s->buf, size + header_size, last, player);
+    fu[flag_byte] |= 1 << 6;
+    if (!(f = tms_pacer_pool_get(player->video_pool)))
+      return;
+    data = AST_FRAME_GET_BUFFER(f);
+    memcpy(data, fu, header_size);
+    memcpy(&data[header_size], buf, size);
+    tms_rtp_write_video(s, f, size + header_size, last, player);
   }
 }
 
-static const uint8_t *ff_avc_find_startcode_internal(const uint8_t *p, const uint8_t *end)
+/**
+ * 记录或者补发参数集，每个nal发送前调用
+ *
+ * 第1个IDR前面总是补发；之后只有inject_param_sets不为0时补发。
+ *
+ * @param param_sets_sent 当前视频包中是否已经发送了参数集
+ */
+static void tms_rtp_check_param_sets(TmsVideoRtpContext *s, const uint8_t *nal, int size, int *param_sets_sent, TmsPlayerContext *player)
 {
-  const uint8_t *a = p + 4 - ((intptr_t)p & 3);
+  TmsAvcParamCache *cache = &s->param_cache;
+  int nalu_type = nal[0] & 0x1F;
+  int i;
 
-  for (end -= 3; p < a && p < end; p++)
+  if (nalu_type == TMS_AVC_NAL_SPS || nalu_type == TMS_AVC_NAL_PPS)
   {
-    if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-      return p;
+    tms_avc_param_cache_update(cache, nal, size);
+    if (!*param_sets_sent)
+      s->nb_param_sets_sent++;
+    *param_sets_sent = 1;
+    return;
   }
+  if (nalu_type != TMS_AVC_NAL_IDR || *param_sets_sent || !cache->nb_param_sets)
+    return;
+  if (!s->inject_param_sets && s->nb_param_sets_sent)
+    return;
 
-  for (end -= 3; p < end; p += 4)
+  /* 先sps后pps */
+  for (i = 0; i < cache->nb_param_sets; i++)
   {
-    uint32_t x = *(const uint32_t *)p;
-    //      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
-    //      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
-    if ((x - 0x01010101) & (~x) & 0x80808080)
-    { // generic
-      if (p[1] == 0)
-      {
-        if (p[0] == 0 && p[2] == 1)
-          return p;
-        if (p[2] == 0 && p[3] == 1)
-          return p + 1;
-      }
-      if (p[3] == 0)
-      {
-        if (p[2] == 0 && p[4] == 1)
-          return p + 2;
-        if (p[4] == 0 && p[5] == 1)
-          return p + 3;
-      }
-    }
+    if (cache->types[i] == TMS_AVC_NAL_SPS)
+      h264_nal_send(s, cache->data[i], cache->sizes[i], 0, player);
   }
-
-  for (end += 3; p < end; p++)
+  for (i = 0; i < cache->nb_param_sets; i++)
   {
-    if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-      return p;
+    if (cache->types[i] == TMS_AVC_NAL_PPS)
+      h264_nal_send(s, cache->data[i], cache->sizes[i], 0, player);
   }
-
-  return end + 3;
-}
-
-static const uint8_t *ff_avc_find_startcode(const uint8_t *p, const uint8_t *end)
-{
-  const uint8_t *out = ff_avc_find_startcode_internal(p, end);
-  if (p < out && out < end && !out[-1])
-    out--;
-  return out;
+  s->nb_param_sets_sent++;
+  *param_sets_sent = 1;
 }
 
 void ff_rtp_send_h264(TmsVideoRtpContext *s, const uint8_t *buf1, int size, TmsPlayerContext *player)
 {
   const uint8_t *r, *end = buf1 + size;
+  int param_sets_sent = 0;
 
   s->buf_ptr = s->buf;
 
-  r = ff_avc_find_startcode(buf1, end);
+  r = tms_avc_find_startcode(buf1, end);
   while (r < end)
   {
     const uint8_t *r1;
 
     while (!*(r++))
       ;
-    r1 = ff_avc_find_startcode(r, end);
+    r1 = tms_avc_find_startcode(r, end);
+    if (r1 > r)
+      tms_rtp_check_param_sets(s, r, r1 - r, &param_sets_sent, player);
     h264_nal_send(s, r, r1 - r, r1 == end, player);
     ast_debug(1, "ff_rtp_send_h264.h264_nal_send r = %p r1 = %p end = %p\n", r, r1, end);
     r = r1;
@@ -275,6 +293,82 @@ void ff_rtp_send_h264(TmsVideoRtpContext *s, const uint8_t *buf1, int size, TmsP
   flush_nal_buffered(s, 1, player);
 }
 
+/**
+ * 发送avcC格式的视频包
+ *
+ * 按照长度前缀在原缓冲区中逐个取出nal发送，不需要转换为annexb格式，也不需要查找startcode。
+ * 包中有IDR帧但是没有sps和pps时，在第1个IDR的nal前面发送缓存的sps和pps（开始时是extradata中的参数集）。
+ */
+void tms_rtp_send_h264_avcc(TmsVideoRtpContext *s, const uint8_t *buf, int size, const TmsAvcConfig *avc, TmsPlayerContext *player)
+{
+  const uint8_t *p = buf, *end = buf + size;
+  int len, param_sets_sent = 0;
+
+  s->buf_ptr = s->buf;
+
+  while (end - p > avc->nal_length_size)
+  {
+    len = tms_avc_nal_length(p, avc->nal_length_size);
+    p += avc->nal_length_size;
+    if (len <= 0 || len > end - p)
+    {
+      ast_log(LOG_WARNING, "视频包中nal长度错误 %d，剩余 %ld 字节\n", len, (long)(end - p));
+      break;
+    }
+
+    tms_rtp_check_param_sets(s, p, len, &param_sets_sent, player);
+    h264_nal_send(s, p, len, end - (p + len) <= avc->nal_length_size, player);
+    p += len;
+  }
+
+  flush_nal_buffered(s, 1, player);
+}
+
+/**
+ * 发送记录的关键帧
+ *
+ * RTP时间戳比最近发送的帧大1（RTP时钟是90000，即1/90000秒），和前后的帧都不重复；发送时间等于当前帧，
+ * 排在已经排队的帧后面。
+ */
+static void tms_video_history_send(TmsVideoRtpContext *s, TmsPlayerContext *player)
+{
+  TmsVideoHistory *history = &s->history;
+  uint32_t cur_timestamp = s->cur_timestamp;
+  struct ast_frame *f;
+  int i;
+
+  ast_debug(1, "[chan %p] 重发关键帧，共 %d 个包 %d 字节\n", player->chan, history->nb_packets, history->size);
+
+  s->cur_timestamp = s->timestamp + 1;
+  for (i = 0; i < history->nb_packets; i++)
+  {
+    if (!(f = tms_pacer_pool_get(player->video_pool)))
+      break;
+    memcpy(AST_FRAME_GET_BUFFER(f), history->buf + history->offsets[i], history->lens[i]);
+    tms_rtp_write_video(s, f, history->lens[i], history->markers[i], player);
+  }
+  s->cur_timestamp = cur_timestamp;
+}
+
+/**
+ * 对端请求关键帧时重发最近的关键帧
+ *
+ * 之后的非关键帧参考的是原来关键帧后面的图像，发送给对端会花屏，所以丢弃到文件中的下1个关键帧，
+ * 对端停在重发的画面上。
+ *
+ * @return 1 已经重发；0 没有完整的关键帧或者间隔太短
+ */
+int tms_video_history_resend(TmsVideoRtpContext *s, TmsPlayerContext *player)
+{
+  if (!tms_video_history_due(&s->history))
+    return 0;
+
+  tms_video_history_send(s, player);
+  s->history.dropping = 1;
+
+  return 1;
+}
+
 /* 输出音频帧调试信息 */
 void tms_dump_audio_frame(AVFrame *frame, TmsPlayerContext *player)
 {
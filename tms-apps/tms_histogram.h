@@ -0,0 +1,138 @@
+#ifndef TMS_HISTOGRAM_H
+#define TMS_HISTOGRAM_H
+
+/**
+ * 按2的幂分段的直方图（类似HdrHistogram），用于统计耗时、延迟等非负数值
+ *
+ * 小于TMS_HISTOGRAM_SUB_COUNT的值每个值1个桶；更大的值每个2的幂区间再平均分成TMS_HISTOGRAM_SUB_COUNT个桶，
+ * 相对误差不超过1/TMS_HISTOGRAM_SUB_COUNT（32个桶时约3%）。最后1个桶统计超出范围的值。
+ * 每个直方图约9KB，作为局部变量时注意栈的大小。
+ * 添加1个值只需要1次clz和几次移位、加法，不分配内存，可以一直开启。直方图本身不加锁，由调用者保证互斥。
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define TMS_HISTOGRAM_SUB_BITS 5
+#define TMS_HISTOGRAM_SUB_COUNT (1 << TMS_HISTOGRAM_SUB_BITS)                                 // 每个2的幂区间的桶数
+#define TMS_HISTOGRAM_NB_BUCKETS ((42 - TMS_HISTOGRAM_SUB_BITS) * TMS_HISTOGRAM_SUB_COUNT) // 最大2^41，单位是纳秒时约36分钟
+
+typedef struct TmsHistogram
+{
+  uint64_t buckets[TMS_HISTOGRAM_NB_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+} TmsHistogram;
+
+void tms_histogram_reset(TmsHistogram *h);
+
+int tms_histogram_bucket(uint64_t value);
+
+uint64_t tms_histogram_bucket_lower(int bucket);
+
+uint64_t tms_histogram_bucket_upper(int bucket);
+
+void tms_histogram_add(TmsHistogram *h, int64_t value);
+
+void tms_histogram_merge(TmsHistogram *dst, const TmsHistogram *src);
+
+uint64_t tms_histogram_percentile(const TmsHistogram *h, double percent);
+
+void tms_histogram_reset(TmsHistogram *h)
+{
+  memset(h, 0, sizeof(TmsHistogram));
+}
+
+/* 值所在的桶 */
+int tms_histogram_bucket(uint64_t value)
+{
+  int shift, bucket;
+
+  if (value < TMS_HISTOGRAM_SUB_COUNT)
+    return (int)value;
+
+  /* 最高位决定区间，最高位后面的SUB_BITS位决定区间中的桶 */
+  shift = 63 - __builtin_clzll(value) - TMS_HISTOGRAM_SUB_BITS;
+  bucket = (shift + 1) * TMS_HISTOGRAM_SUB_COUNT + (int)((value >> shift) & (TMS_HISTOGRAM_SUB_COUNT - 1));
+
+  return bucket < TMS_HISTOGRAM_NB_BUCKETS ? bucket : TMS_HISTOGRAM_NB_BUCKETS - 1;
+}
+
+/* 桶的下限（包含） */
+uint64_t tms_histogram_bucket_lower(int bucket)
+{
+  int shift;
+
+  if (bucket < TMS_HISTOGRAM_SUB_COUNT)
+    return (uint64_t)bucket;
+
+  shift = bucket / TMS_HISTOGRAM_SUB_COUNT - 1;
+
+  return (uint64_t)(TMS_HISTOGRAM_SUB_COUNT + bucket % TMS_HISTOGRAM_SUB_COUNT) << shift;
+}
+
+/* 桶的上限（不包含） */
+uint64_t tms_histogram_bucket_upper(int bucket)
+{
+  return tms_histogram_bucket_lower(bucket + 1);
+}
+
+/* 添加1个值，小于0的值按0统计 */
+void tms_histogram_add(TmsHistogram *h, int64_t value)
+{
+  uint64_t v = value > 0 ? (uint64_t)value : 0;
+
+  h->buckets[tms_histogram_bucket(v)]++;
+  h->count++;
+  h->sum += v;
+  if (v > h->max)
+    h->max = v;
+}
+
+/* 把src累加到dst */
+void tms_histogram_merge(TmsHistogram *dst, const TmsHistogram *src)
+{
+  int i;
+
+  for (i = 0; i < TMS_HISTOGRAM_NB_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+/**
+ * 百分位数的估计值
+ *
+ * 返回百分位所在桶的上限，不超过最大值，相对误差不超过1/TMS_HISTOGRAM_SUB_COUNT。
+ *
+ * @param percent 百分位，例如99.9
+ */
+uint64_t tms_histogram_percentile(const TmsHistogram *h, double percent)
+{
+  uint64_t rank, seen = 0;
+  int i;
+
+  if (h->count == 0)
+    return 0;
+
+  rank = (uint64_t)(h->count * percent / 100.0);
+  if (rank >= h->count)
+    rank = h->count - 1;
+
+  for (i = 0; i < TMS_HISTOGRAM_NB_BUCKETS; i++)
+  {
+    seen += h->buckets[i];
+    if (seen > rank)
+    {
+      uint64_t upper = tms_histogram_bucket_upper(i);
+      return upper < h->max ? upper : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef TMS_METRICS_H
+#define TMS_METRICS_H
+
+/**
+ * 运行指标，由res_tms模块实现
+ *
+ * res_tms在asterisk的http服务上注册/tms/metrics，按Prometheus文本格式输出播放会话、发送、处理阶段耗时、
+ * 发送延迟、转码缓存和文件描述符等指标。发送和耗时的统计来自发送调度会话（tms_pacer.h），
+ * 这里是其他模块需要报告的指标。
+ */
+
+/* 记录1次alaw转码缓存查找，hit不为0表示缓存有效，不需要转码 */
+void tms_metrics_pcma_cache(int hit);
+
+#endif
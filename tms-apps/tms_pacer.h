@@ -0,0 +1,145 @@
+#ifndef TMS_PACER_H
+#define TMS_PACER_H
+
+/**
+ * 发送调度器，由res_tms模块实现
+ *
+ * 所有播放应用共用少量工作线程，每个线程用timerfd驱动1个时间轮，在帧的发送时间到达时调用ast_write。
+ * 播放应用的通道线程只负责准备帧并指定发送时间，排队的帧超过上限时阻塞等待（背压）。
+ * 发送时间使用CLOCK_MONOTONIC，单位是微秒，和av_gettime_relative()的时间基准一致。
+ */
+
+#include "asterisk/channel.h"
+#include "asterisk/frame.h"
+
+#define TMS_PACER_FRAME_PAYLOAD 1460 // 帧池中每个帧的最大载荷字节数
+
+typedef struct TmsPacerSession TmsPacerSession;
+
+typedef struct TmsPacerPool TmsPacerPool;
+
+/**
+ * 播放的处理阶段，分别统计CPU时间和单次耗时的分布
+ */
+typedef enum TmsPacerStage
+{
+  TMS_PACER_STAGE_READ = 0,  // 读取文件、解封装（av_read_frame）
+  TMS_PACER_STAGE_BSF,       // h264 bsf
+  TMS_PACER_STAGE_DECODE,    // 解码（avcodec_receive_frame）
+  TMS_PACER_STAGE_RESAMPLE,  // 重采样（swr_convert）
+  TMS_PACER_STAGE_ENCODE,    // alaw编码
+  TMS_PACER_STAGE_PACKETIZE, // RTP打包（split_packet_size等）、交给调度器，不包括等待
+  TMS_PACER_STAGE_WAIT,      // 在tms_pacer_write中等待：排队的帧太多或者太靠前（背压），没有启用调度器时等到发送时间
+  TMS_PACER_STAGE_WRITE,     // ast_write，由调度器统计
+  TMS_PACER_NB_STAGES
+} TmsPacerStage;
+
+/**
+ * 对端接收报告（RTCP RR、XR）中1个媒体流的接收质量，在CLI命令tms show players和tms show player中显示
+ */
+typedef struct TmsPacerRtcp
+{
+  unsigned int nb_reports; // 收到的接收报告数量，等于0时下面的字段无效
+  int fraction_lost;       // 最近1次报告的丢包率，单位1/256
+  int cumulative_lost;     // 累计丢包数
+  int jitter_ms;           // 最近1次报告的到达间隔抖动
+  int max_jitter_ms;
+  int rtt_ms;              // 往返时延，-1表示未知
+  unsigned int nb_nacks;
+  unsigned int nb_keyframe_requests;
+} TmsPacerRtcp;
+
+/* 当前时间，单位微秒 */
+int64_t tms_pacer_now_us(void);
+
+/* 当前线程的CPU时间，单位微秒 */
+int64_t tms_pacer_cpu_us(void);
+
+/**
+ * 建立发送会话
+ *
+ * 调度器没有启用时，会话只记录统计数据，帧在通道线程中发送。
+ *
+ * @return 会话对象；失败时返回NULL。帧池属于会话，没有会话就不能建立帧池，应用应该结束播放
+ */
+TmsPacerSession *tms_pacer_session_create(struct ast_channel *chan);
+
+/**
+ * 在指定时间发送帧
+ *
+ * 没有启用调度器时在当前线程中用clock_nanosleep(TIMER_ABSTIME)等待到发送时间后发送；
+ * 否则复制帧后放入调度器，调用者可以立即复用帧的缓冲区。
+ * deadline_us是绝对时间，应该由播放开始时间和媒体位置计算，不要累加每帧的间隔。为0时尽快发送。
+ *
+ * @return 0 成功；-1 失败（通道已经挂机等），调用者应该停止播放
+ */
+int tms_pacer_write(TmsPacerSession *session, struct ast_channel *chan, struct ast_frame *f, int64_t deadline_us);
+
+/**
+ * 关闭发送会话
+ *
+ * @param drain 不为0时等待已经排队的帧全部发送；否则丢弃没有发送的帧
+ */
+void tms_pacer_session_close(TmsPacerSession *session, int drain);
+
+/* 帧的实际发送时间比指定的发送时间晚的最大值，单位微秒 */
+int64_t tms_pacer_session_max_late_us(TmsPacerSession *session);
+
+/**
+ * 设置会话播放的应用和文件，在CLI命令tms show players中显示
+ *
+ * 会话建立后登记在res_tms中，关闭时删除。
+ */
+void tms_pacer_session_set_info(TmsPacerSession *session, const char *app, const char *filename);
+
+/* 设置当前的播放位置，单位微秒 */
+void tms_pacer_session_set_position(TmsPacerSession *session, int64_t position_us);
+
+/**
+ * 更新对端报告的音频和视频流的接收质量，收到RTCP包后调用
+ *
+ * 接收报告只能从使用对称RTCP的对端收到（RR发回SR的来源地址），否则CLI显示没有报告。
+ */
+void tms_pacer_session_set_rtcp(TmsPacerSession *session, const TmsPacerRtcp *audio, const TmsPacerRtcp *video);
+
+/**
+ * 开始统计处理阶段的耗时，记录当前时间
+ *
+ * 之后每次调用tms_pacer_session_stage把从上次记录到现在经过的时间计入指定阶段，连续的阶段只需要读1次CLOCK_MONOTONIC。
+ * 期间在tms_pacer_write中等待的时间计入TMS_PACER_STAGE_WAIT，不计入当前阶段。
+ * 耗时先记录在只有通道线程使用的缓冲区中，不加锁；缓冲区满了（64个）和会话关闭时才加锁
+ * 合并到会话的直方图，会话释放时再合并到res_tms的全局统计，用CLI命令tms show latency查看，tms reset latency清空。
+ * 播放中CLI看到的统计最多落后1个缓冲区。线程的CPU时间也只在合并时读1次，按经过的时间分摊到通道线程的各个阶段。
+ * 只在通道线程中调用。
+ */
+void tms_pacer_session_stage_begin(TmsPacerSession *session);
+
+void tms_pacer_session_stage(TmsPacerSession *session, TmsPacerStage stage);
+
+/**
+ * 建立帧池
+ *
+ * 帧池中的帧在分配时设置好类型、格式、src和缓冲区，之后重复使用。每次发送只需要把载荷写入f->data.ptr，
+ * 设置datalen、samples、ts等随包变化的字段，不需要清空和复制整个帧；启用调度器时排队也不需要复制。
+ * 帧池属于会话，会话关闭时释放。
+ *
+ * @param src 帧的src，可以为NULL
+ * @param timing 不为0时帧带有AST_FRFLAG_HAS_TIMING_INFO，asterisk使用帧中的ts
+ * @return 帧池；session为NULL或者失败时返回NULL
+ */
+TmsPacerPool *tms_pacer_pool_create(TmsPacerSession *session, enum ast_frame_type type, struct ast_format *format, const char *src, int timing);
+
+/* 从帧池中取1个帧，载荷最多TMS_PACER_FRAME_PAYLOAD字节。失败时返回NULL */
+struct ast_frame *tms_pacer_pool_get(TmsPacerPool *pool);
+
+/* 把没有发送的帧放回帧池 */
+void tms_pacer_pool_put(TmsPacerPool *pool, struct ast_frame *f);
+
+/**
+ * 在指定时间发送帧池中的帧，和tms_pacer_write相同
+ *
+ * 帧交给调度器，发送后自动放回帧池，调用者不能再使用。
+ */
+int tms_pacer_pool_write(TmsPacerPool *pool, struct ast_frame *f, int64_t deadline_us);
+
+#endif
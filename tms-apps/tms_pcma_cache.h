@@ -0,0 +1,285 @@
+#ifndef TMS_PCMA_CACHE_H
+#define TMS_PCMA_CACHE_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tms_metrics.h"
+
+#define TMS_PCMA_CACHE_MAGIC "TMSPCMA1"
+#define TMS_PCMA_CACHE_EXT ".pcma"
+#define TMS_PCMA_CACHE_SAMPLE_RATE 8000
+
+#define TMS_PCMA_CACHE_NONE 0  // 不使用缓存，需要编码
+#define TMS_PCMA_CACHE_READ 1  // 缓存有效，直接读取alaw采样
+#define TMS_PCMA_CACHE_WRITE 2 // 缓存无效，播放时记录编码结果
+
+/**
+ * 缓存文件头，后面是8k单声道alaw采样
+ *
+ * 记录源文件的修改时间和大小，源文件变化后缓存失效。
+ */
+typedef struct TmsPcmaCacheHeader
+{
+  char magic[8];
+  int64_t src_mtime;
+  int64_t src_size;
+  uint32_t sample_rate;
+  uint32_t nb_samples;
+} TmsPcmaCacheHeader;
+
+/**
+ * 音频的alaw转码结果缓存
+ *
+ * 第一次播放时把编码出的alaw采样写入源文件旁边的缓存文件（或者配置的目录），完整播放后生效。
+ * 后续播放直接映射缓存文件，按帧读取采样，不再解码、重采样和编码。
+ */
+typedef struct TmsPcmaCache
+{
+  int state;
+  char path[PATH_MAX];
+  /* 读取 */
+  uint8_t *map;
+  size_t map_size;
+  uint8_t *samples;
+  size_t nb_samples;
+  size_t pos; // 下一个要读取的采样
+  /* 写入 */
+  FILE *fp;
+  char tmp_path[PATH_MAX];
+  struct stat src_st;
+  size_t nb_written;
+} TmsPcmaCache;
+
+static int tms_pcma_cache_enabled = 1;
+static char tms_pcma_cache_dir[PATH_MAX];
+
+void tms_pcma_cache_config(int enabled, const char *dir);
+
+int tms_pcma_cache_open(TmsPcmaCache *cache, const char *src);
+
+size_t tms_pcma_cache_read(TmsPcmaCache *cache, size_t max_samples, uint8_t **out);
+
+int tms_pcma_cache_write(TmsPcmaCache *cache, const uint8_t *data, size_t len);
+
+void tms_pcma_cache_close(TmsPcmaCache *cache, int complete);
+
+/* 设置是否使用缓存和缓存文件目录，目录为空时缓存文件放在源文件旁边 */
+void tms_pcma_cache_config(int enabled, const char *dir)
+{
+  tms_pcma_cache_enabled = enabled;
+  ast_copy_string(tms_pcma_cache_dir, S_OR(dir, ""), sizeof(tms_pcma_cache_dir));
+
+  ast_debug(1, "alaw转码缓存 enabled = %d dir = %s\n", enabled, tms_pcma_cache_dir);
+}
+
+/* 生成缓存文件路径，指定目录时用源文件的完整路径生成文件名，避免重名 */
+static int tms_pcma_cache_path(const char *src, char *path, size_t size)
+{
+  int len;
+
+  if (ast_strlen_zero(tms_pcma_cache_dir))
+  {
+    len = snprintf(path, size, "%s" TMS_PCMA_CACHE_EXT, src);
+  }
+  else
+  {
+    char *p;
+    len = snprintf(path, size, "%s/", tms_pcma_cache_dir);
+    if (len < size)
+    {
+      p = path + len;
+      len += snprintf(p, size - len, "%s" TMS_PCMA_CACHE_EXT, src);
+      for (; *p; p++)
+      {
+        if (*p == '/')
+          *p = '_';
+      }
+    }
+  }
+
+  return len < size ? 0 : -1;
+}
+
+/* 映射缓存文件，检查是否和源文件一致 */
+static int tms_pcma_cache_map(TmsPcmaCache *cache)
+{
+  int fd;
+  struct stat st;
+  TmsPcmaCacheHeader *hdr;
+
+  if ((fd = open(cache->path, O_RDONLY)) < 0)
+    return -1;
+
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(TmsPcmaCacheHeader))
+  {
+    close(fd);
+    return -1;
+  }
+
+  cache->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (cache->map == MAP_FAILED)
+  {
+    cache->map = NULL;
+    return -1;
+  }
+  cache->map_size = st.st_size;
+
+  hdr = (TmsPcmaCacheHeader *)cache->map;
+  if (memcmp(hdr->magic, TMS_PCMA_CACHE_MAGIC, sizeof(hdr->magic)) ||
+      hdr->src_mtime != cache->src_st.st_mtime ||
+      hdr->src_size != cache->src_st.st_size ||
+      hdr->sample_rate != TMS_PCMA_CACHE_SAMPLE_RATE ||
+      sizeof(TmsPcmaCacheHeader) + hdr->nb_samples > cache->map_size)
+  {
+    ast_debug(1, "alaw转码缓存 %s 已经失效\n", cache->path);
+    munmap(cache->map, cache->map_size);
+    cache->map = NULL;
+    return -1;
+  }
+
+  cache->samples = cache->map + sizeof(TmsPcmaCacheHeader);
+  cache->nb_samples = hdr->nb_samples;
+  cache->pos = 0;
+
+  madvise(cache->map, cache->map_size, MADV_SEQUENTIAL);
+
+  return 0;
+}
+
+/* 建立临时文件，记录编码结果 */
+static int tms_pcma_cache_create(TmsPcmaCache *cache)
+{
+  TmsPcmaCacheHeader hdr;
+
+  snprintf(cache->tmp_path, sizeof(cache->tmp_path), "%s.%d.%08lx", cache->path, (int)getpid(), ast_random());
+  if (!(cache->fp = fopen(cache->tmp_path, "wb")))
+  {
+    ast_debug(1, "无法建立alaw转码缓存文件 %s %s\n", cache->tmp_path, strerror(errno));
+    return -1;
+  }
+
+  /* 先写入空的文件头，完成时再更新 */
+  memset(&hdr, 0, sizeof(hdr));
+  if (fwrite(&hdr, sizeof(hdr), 1, cache->fp) != 1)
+  {
+    fclose(cache->fp);
+    cache->fp = NULL;
+    unlink(cache->tmp_path);
+    return -1;
+  }
+  cache->nb_written = 0;
+
+  return 0;
+}
+
+/**
+ * 打开源文件对应的alaw缓存
+ *
+ * @return TMS_PCMA_CACHE_READ 缓存有效；TMS_PCMA_CACHE_WRITE 需要编码，编码结果写入缓存；TMS_PCMA_CACHE_NONE 不使用缓存
+ */
+int tms_pcma_cache_open(TmsPcmaCache *cache, const char *src)
+{
+  memset(cache, 0, sizeof(TmsPcmaCache));
+  cache->state = TMS_PCMA_CACHE_NONE;
+
+  if (!tms_pcma_cache_enabled)
+    return cache->state;
+
+  if (stat(src, &cache->src_st) < 0 || tms_pcma_cache_path(src, cache->path, sizeof(cache->path)) < 0)
+    return cache->state;
+
+  if (tms_pcma_cache_map(cache) == 0)
+  {
+    ast_debug(1, "使用alaw转码缓存 %s，共 %zu 个采样\n", cache->path, cache->nb_samples);
+    cache->state = TMS_PCMA_CACHE_READ;
+  }
+  else if (tms_pcma_cache_create(cache) == 0)
+  {
+    cache->state = TMS_PCMA_CACHE_WRITE;
+  }
+  tms_metrics_pcma_cache(cache->state == TMS_PCMA_CACHE_READ);
+
+  return cache->state;
+}
+
+/* 读取最多max_samples个采样，返回读取的采样数，out指向映射的缓存，不需要复制 */
+size_t tms_pcma_cache_read(TmsPcmaCache *cache, size_t max_samples, uint8_t **out)
+{
+  size_t nb_samples;
+
+  if (cache->state != TMS_PCMA_CACHE_READ || cache->pos >= cache->nb_samples)
+    return 0;
+
+  nb_samples = FFMIN(max_samples, cache->nb_samples - cache->pos);
+  *out = cache->samples + cache->pos;
+  cache->pos += nb_samples;
+
+  return nb_samples;
+}
+
+/* 记录编码出的alaw采样，写入失败后放弃缓存，不影响播放 */
+int tms_pcma_cache_write(TmsPcmaCache *cache, const uint8_t *data, size_t len)
+{
+  if (cache->state != TMS_PCMA_CACHE_WRITE)
+    return 0;
+
+  if (fwrite(data, 1, len, cache->fp) != len)
+  {
+    ast_log(LOG_WARNING, "写入alaw转码缓存失败 %s %s\n", cache->tmp_path, strerror(errno));
+    tms_pcma_cache_close(cache, 0);
+    return -1;
+  }
+  cache->nb_written += len;
+
+  return 0;
+}
+
+/**
+ * 关闭缓存
+ *
+ * 写入状态下，complete不为0表示源文件已经完整编码，更新文件头后替换缓存文件；否则删除临时文件。
+ */
+void tms_pcma_cache_close(TmsPcmaCache *cache, int complete)
+{
+  if (cache->state == TMS_PCMA_CACHE_READ)
+  {
+    munmap(cache->map, cache->map_size);
+    cache->map = NULL;
+  }
+  else if (cache->state == TMS_PCMA_CACHE_WRITE)
+  {
+    TmsPcmaCacheHeader hdr;
+
+    memcpy(hdr.magic, TMS_PCMA_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.src_mtime = cache->src_st.st_mtime;
+    hdr.src_size = cache->src_st.st_size;
+    hdr.sample_rate = TMS_PCMA_CACHE_SAMPLE_RATE;
+    hdr.nb_samples = cache->nb_written;
+
+    int ok = complete && cache->nb_written > 0 &&
+             fseek(cache->fp, 0, SEEK_SET) == 0 &&
+             fwrite(&hdr, sizeof(hdr), 1, cache->fp) == 1;
+    if (fclose(cache->fp) != 0)
+      ok = 0;
+    cache->fp = NULL;
+
+    if (ok && rename(cache->tmp_path, cache->path) == 0)
+    {
+      ast_debug(1, "生成alaw转码缓存 %s，共 %zu 个采样\n", cache->path, cache->nb_written);
+    }
+    else
+    {
+      if (ok)
+        ast_log(LOG_WARNING, "生成alaw转码缓存失败 %s %s\n", cache->path, strerror(errno));
+      unlink(cache->tmp_path);
+    }
+  }
+
+  cache->state = TMS_PCMA_CACHE_NONE;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef TMS_PLAYBACK_H
+#define TMS_PLAYBACK_H
+
+/**
+ * 播放过程的AMI事件，由res_tms模块实现
+ *
+ * 播放应用开始时调用tms_playback_start发送TMSPlaybackStart，返回前调用tms_playback_end发送TMSPlaybackEnd。
+ * 播放记录在通道的datastore中，期间建立的发送调度会话自动关联到播放：会话设置播放位置时按tms.conf中的间隔
+ * 发送TMSPlaybackProgress，会话关闭时把发送的帧数、发送延迟等累加到播放，TMSPlaybackEnd报告整个播放的统计。
+ * 只在通道线程中调用。
+ */
+
+#include "asterisk/channel.h"
+
+#define TMS_PLAYBACK_DTMF_VAR "TMSDTMFKEY" // 记录停止播放的按键的通道变量
+
+/* 结束播放的原因 */
+typedef enum TmsPlaybackReason
+{
+  TMS_PLAYBACK_COMPLETE = 0, // 播放完成
+  TMS_PLAYBACK_STOP,         // 按了停止键
+  TMS_PLAYBACK_HANGUP,       // 通道已经挂机
+  TMS_PLAYBACK_TIMEOUT,      // 达到指定的播放时长
+  TMS_PLAYBACK_ERROR,        // 打开文件失败、发送失败等
+} TmsPlaybackReason;
+
+typedef struct TmsPlayback TmsPlayback;
+
+/**
+ * 开始播放，发送TMSPlaybackStart事件
+ *
+ * @param filename 播放的文件，播放列表时是文件列表
+ * @return 播放记录，调用者持有1个引用，由tms_playback_end释放；失败时返回NULL，其他函数按没有播放记录处理
+ */
+TmsPlayback *tms_playback_start(struct ast_channel *chan, const char *app, const char *filename);
+
+/**
+ * 结束播放，发送TMSPlaybackEnd事件，释放tms_playback_start返回的引用
+ *
+ * 应该在关闭所有发送调度会话之后调用。reason为TMS_PLAYBACK_STOP时事件中包含通道变量TMSDTMFKEY记录的按键。
+ */
+void tms_playback_end(TmsPlayback *playback, TmsPlaybackReason reason);
+
+#endif
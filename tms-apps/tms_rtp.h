@@ -1,10 +1,34 @@
 #ifndef TMS_RTP_H
 #define TMS_RTP_H
 
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include "asterisk/channel.h"
+#include "asterisk/pbx.h"
+
+#include <libavutil/intreadwrite.h>
+
+#include "tms_pacer.h"
+#include "tms_timeline.h"
 
 #define RTP_VERSION 2
 #define RTCP_SR 200
+#define RTCP_RR 201
+#define RTCP_RTPFB 205 // RFC 4585，FMT等于1是generic NACK
+#define RTCP_PSFB 206  // RFC 4585，FMT等于1是PLI；RFC 5104，FMT等于4是FIR
+#define RTCP_XR 207
+
+#define RTCP_FMT_NACK 1
+#define RTCP_FMT_PLI 1
+#define RTCP_FMT_FIR 4
+
+#define RTCP_XR_VOIP_METRICS 7 // RFC 3611 4.7
+
+#define TMS_RTCP_SR_SIZE 28            // 不带接收报告块的SR长度
+#define TMS_RTCP_INTERVAL_US 5000000   // SR的平均发送间隔，RFC 3550中的最小间隔5秒
 
 #define RTP_H264_TIME_BASE 90000 // RTP中h264流的时间基
 
@@ -16,6 +40,34 @@
 #define PKT_SIZE (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET + PKT_PAYLOAD)
 #define PKT_OFFSET (sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET)
 
+/**
+ * 1个媒体流的发送统计，用于生成SR
+ *
+ * 记录最近1个RTP包的时间戳和发送时间，SR中的RTP时间戳按时钟频率从这个包推算到SR的发送时间。
+ */
+typedef struct TmsRtcpStream
+{
+  uint32_t ssrc;
+  struct sockaddr_in addr; // 对端rtcp地址
+  int clock_rate;
+  unsigned int packet_count;
+  unsigned int octet_count;   // 只计算载荷
+  unsigned int prior_packet_count; // 同一个通道上之前的播放发送的包数，SR中的计数从通道开始发送时累计
+  unsigned int prior_octet_count;
+  uint32_t last_rtp_ts;       // 最近1个包的RTP时间戳
+  int64_t last_deadline_us;   // 最近1个包的发送时间
+  /* 对端的接收报告（RR或XR） */
+  unsigned int nb_reports;
+  int fraction_lost;   // 最近1次报告的丢包率，单位1/256
+  int cumulative_lost; // 累计丢包数
+  int jitter_ms;       // 到达间隔抖动
+  int max_jitter_ms;
+  int rtt_ms;          // 往返时延，-1表示未知
+  unsigned int nb_nacks;        // 收到的NACK数量
+  unsigned int nb_nack_packets; // NACK中报告丢失的包数
+  unsigned int nb_keyframe_requests; // 收到的PLI、FIR和VIDUPDATE数量
+} TmsRtcpStream;
+
 typedef struct TmsPlayerContext
 {
   struct ast_channel *chan;
@@ -37,8 +89,17 @@ typedef struct TmsPlayerContext
   uint32_t rtp_video_ssrc;
   struct sockaddr_in rtp_audio_dest_addr;
   struct sockaddr_in rtp_video_dest_addr;
-  int first_rtcp_auido;
-  int first_rtcp_video;
+  int audio_started; // 已经确定音频的起始时间戳
+  int rtcp_fd;       // 发送rtcp的socket，属于通道的时间线，同一个通道上的播放使用同1个
+  int64_t rtcp_next_us; // 下次发送SR的时间
+  TmsRtcpStream audio_rtcp;
+  TmsRtcpStream video_rtcp;
+  int keyframe_requested; // 对端请求关键帧（PLI、FIR），需要重发关键帧
+  TmsChannelTimeline *timeline; // 通道的媒体时间线，可以为NULL
+  /* 发送调度 */
+  TmsPacerSession *pacer;
+  TmsPacerPool *audio_pool;
+  TmsPacerPool *video_pool;
 } TmsPlayerContext;
 /**
  * 记录视频RTP发送相关数据 
@@ -58,9 +119,17 @@ int tms_ast_channel_get_rtp_ssrc(struct ast_channel *chan, uint32_t *audio_ssrc,
 int tms_init_player_context(struct ast_channel *chan, TmsPlayerContext *player);
 
 /**
- * 构造第一个rtcp包
+ * 构造rtcp SR包，TMS_RTCP_SR_SIZE个字节
  */
-void tms_rtcp_first_sr(uint8_t *buf, uint32_t ssrc, struct timeval tv_ntp, int32_t rtcp_ts);
+void tms_rtcp_sr(uint8_t *buf, uint32_t ssrc, struct timeval tv_ntp, uint32_t rtcp_ts, unsigned int packet_count, unsigned int octet_count);
+
+void tms_rtcp_stream_update(TmsRtcpStream *st, uint32_t rtp_ts, int len, int64_t deadline_us);
+
+void tms_rtcp_poll(TmsPlayerContext *player);
+
+void tms_rtcp_close(TmsPlayerContext *player);
+
+void tms_rtcp_set_channel_vars(TmsPlayerContext *player);
 
 static void timeval2ntp(struct timeval tv, unsigned int *msw, unsigned int *lsw)
 {
@@ -91,7 +160,7 @@ static void timeval2ntp(struct timeval tv, unsigned int *msw, unsigned int *lsw)
   *lsw = frac;
 }
 
-void tms_rtcp_first_sr(uint8_t *buf, uint32_t ssrc, struct timeval tv_ntp, int32_t rtcp_ts)
+void tms_rtcp_sr(uint8_t *buf, uint32_t ssrc, struct timeval tv_ntp, uint32_t rtcp_ts, unsigned int packet_count, unsigned int octet_count)
 {
   uint32_t ntp_msw, ntp_lsw;
   uint8_t *buf_ptr;
@@ -123,21 +192,348 @@ void tms_rtcp_first_sr(uint8_t *buf, uint32_t ssrc, struct timeval tv_ntp, int32
   *buf_ptr++ = (uint8_t)(rtcp_ts >> 16);
   *buf_ptr++ = (uint8_t)(rtcp_ts >> 8);
   *buf_ptr++ = (uint8_t)rtcp_ts;
-  /* packet count = 0 */
-  *buf_ptr++ = 0;
-  *buf_ptr++ = 0;
-  *buf_ptr++ = 0;
-  *buf_ptr++ = 0;
-  /* octet count = 0 */
-  *buf_ptr++ = 0;
-  *buf_ptr++ = 0;
-  *buf_ptr++ = 0;
-  *buf_ptr++ = 0;
-
-  ast_debug(2, "rtcp ssrc = %d(%08x) ntp_time = [%u(%04x),%u(%04x)] rtp_ts = %d(%04x)\n", ssrc, ssrc, ntp_msw, ntp_msw, ntp_lsw, ntp_lsw, rtcp_ts, rtcp_ts);
+  /* packet count */
+  *buf_ptr++ = (uint8_t)(packet_count >> 24);
+  *buf_ptr++ = (uint8_t)(packet_count >> 16);
+  *buf_ptr++ = (uint8_t)(packet_count >> 8);
+  *buf_ptr++ = (uint8_t)packet_count;
+  /* octet count */
+  *buf_ptr++ = (uint8_t)(octet_count >> 24);
+  *buf_ptr++ = (uint8_t)(octet_count >> 16);
+  *buf_ptr++ = (uint8_t)(octet_count >> 8);
+  *buf_ptr++ = (uint8_t)octet_count;
+
+  ast_debug(2, "rtcp ssrc = %u(%08x) ntp_time = [%u(%04x),%u(%04x)] rtp_ts = %u(%04x) packets = %u octets = %u\n", ssrc, ssrc, ntp_msw, ntp_msw, ntp_lsw, ntp_lsw, rtcp_ts, rtcp_ts, packet_count, octet_count);
   ast_debug(2, "rtcp = %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x %02x\n", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8], buf[9], buf[10], buf[11], buf[12], buf[13], buf[14], buf[15], buf[16], buf[17], buf[18], buf[19]);
 }
 
+/* 记录1个已经交给调度器的RTP包 */
+void tms_rtcp_stream_update(TmsRtcpStream *st, uint32_t rtp_ts, int len, int64_t deadline_us)
+{
+  st->packet_count++;
+  st->octet_count += len;
+  st->last_rtp_ts = rtp_ts;
+  st->last_deadline_us = deadline_us ? deadline_us : tms_pacer_now_us();
+}
+
+/* 发送1个媒体流的SR，还没有发送RTP包时不发送 */
+static void tms_rtcp_stream_send_sr(TmsPlayerContext *player, TmsRtcpStream *st, struct timeval tv_ntp, int64_t now_us)
+{
+  uint8_t rtcp[TMS_RTCP_SR_SIZE];
+  uint32_t rtp_ts;
+
+  if (st->packet_count == 0)
+    return;
+
+  /* 排队的包发送时间可能晚于当前时间，差值为负数 */
+  rtp_ts = st->last_rtp_ts + (uint32_t)((now_us - st->last_deadline_us) * st->clock_rate / 1000000);
+  tms_rtcp_sr(rtcp, st->ssrc, tv_ntp, rtp_ts, st->prior_packet_count + st->packet_count, st->prior_octet_count + st->octet_count);
+
+  if (sendto(player->rtcp_fd, rtcp, TMS_RTCP_SR_SIZE, 0, (struct sockaddr *)&st->addr, sizeof(struct sockaddr_in)) < 0)
+  {
+    ast_log(LOG_WARNING, "通道 %s 发送RTCP SR失败 ssrc = %u %s\n", ast_channel_name(player->chan), st->ssrc, strerror(errno));
+  }
+}
+
+/* 按ssrc找到对应的媒体流 */
+static TmsRtcpStream *tms_rtcp_find_stream(TmsPlayerContext *player, uint32_t ssrc)
+{
+  if (player->audio_rtcp.packet_count && ssrc == player->audio_rtcp.ssrc)
+    return &player->audio_rtcp;
+  if (player->video_rtcp.packet_count && ssrc == player->video_rtcp.ssrc)
+    return &player->video_rtcp;
+  return NULL;
+}
+
+/**
+ * 处理1个接收报告块（24字节）
+ *
+ * 往返时延按RFC 3550 6.4.1计算：A - LSR - DLSR，单位1/65536秒，A是收到报告时的NTP时间的中间32位。
+ */
+static void tms_rtcp_handle_report_block(TmsPlayerContext *player, const uint8_t *p, struct timeval tv_ntp)
+{
+  TmsRtcpStream *st;
+  unsigned int ntp_msw, ntp_lsw;
+  uint32_t lsr, dlsr, rtt;
+  int lost;
+
+  if (!(st = tms_rtcp_find_stream(player, AV_RB32(p))))
+    return;
+
+  st->nb_reports++;
+  st->fraction_lost = p[4];
+  lost = (p[5] << 16) | (p[6] << 8) | p[7];
+  st->cumulative_lost = lost & 0x800000 ? lost - 0x1000000 : lost; // 24位有符号数
+  st->jitter_ms = (int64_t)AV_RB32(p + 12) * 1000 / st->clock_rate;
+  if (st->jitter_ms > st->max_jitter_ms)
+    st->max_jitter_ms = st->jitter_ms;
+
+  lsr = AV_RB32(p + 16);
+  dlsr = AV_RB32(p + 20);
+  if (lsr)
+  {
+    timeval2ntp(tv_ntp, &ntp_msw, &ntp_lsw);
+    rtt = ((ntp_msw << 16) | (ntp_lsw >> 16)) - lsr - dlsr;
+    if (rtt < 65536 * 10) // 超过10秒是时钟不一致或者报告错误
+      st->rtt_ms = (int64_t)rtt * 1000 / 65536;
+  }
+
+  ast_debug(2, "通道 %s 收到接收报告 ssrc = %u 丢包率 %d/256 累计丢包 %d 抖动 %d毫秒 往返时延 %d毫秒\n", ast_channel_name(player->chan), st->ssrc, st->fraction_lost, st->cumulative_lost, st->jitter_ms, st->rtt_ms);
+}
+
+/* 处理XR中的VoIP Metrics报告块，其他报告块忽略 */
+static void tms_rtcp_handle_xr(TmsPlayerContext *player, const uint8_t *p, const uint8_t *end)
+{
+  TmsRtcpStream *st;
+  int block_len;
+
+  for (; end - p >= 4; p += block_len)
+  {
+    block_len = (AV_RB16(p + 2) + 1) * 4;
+    if (end - p < block_len)
+      break;
+    if (p[0] != RTCP_XR_VOIP_METRICS || block_len < 36)
+      continue;
+    if (!(st = tms_rtcp_find_stream(player, AV_RB32(p + 4))))
+      continue;
+
+    st->nb_reports++;
+    st->fraction_lost = p[8];
+    if (AV_RB16(p + 16))
+      st->rtt_ms = AV_RB16(p + 16);
+
+    ast_debug(2, "通道 %s 收到XR报告 ssrc = %u 丢包率 %d/256 往返时延 %d毫秒\n", ast_channel_name(player->chan), st->ssrc, st->fraction_lost, st->rtt_ms);
+  }
+}
+
+/**
+ * 处理generic NACK，每个FCI包括PID和BLP，报告1到17个丢失的包
+ *
+ * 只统计，不重发：RTP序号由asterisk分配，不能按序号重发丢失的包；在gop中间重发旧的IDR也修复不了后面的P帧。
+ * 对端需要关键帧时会发送PLI或FIR。
+ */
+static void tms_rtcp_handle_nack(TmsPlayerContext *player, const uint8_t *p, const uint8_t *end)
+{
+  TmsRtcpStream *st;
+  int nb_lost = 0;
+
+  if (end - p < 12 || !(st = tms_rtcp_find_stream(player, AV_RB32(p + 8))))
+    return;
+
+  for (p += 12; end - p >= 4; p += 4)
+    nb_lost += 1 + __builtin_popcount(AV_RB16(p + 2));
+
+  st->nb_nacks++;
+  st->nb_nack_packets += nb_lost;
+
+  ast_debug(2, "通道 %s 收到NACK ssrc = %u 丢失 %d 个包\n", ast_channel_name(player->chan), st->ssrc, nb_lost);
+}
+
+/**
+ * 处理PLI和FIR
+ *
+ * PLI的media source是视频流的ssrc；FIR的media source为0，请求的ssrc在FCI中。
+ */
+static void tms_rtcp_handle_keyframe_request(TmsPlayerContext *player, const uint8_t *p, const uint8_t *end)
+{
+  uint32_t ssrc;
+
+  if (end - p < 12)
+    return;
+  ssrc = AV_RB32(p + 8);
+  if (!ssrc && end - p >= 20)
+    ssrc = AV_RB32(p + 12);
+  if (tms_rtcp_find_stream(player, ssrc) != &player->video_rtcp)
+    return;
+
+  player->video_rtcp.nb_keyframe_requests++;
+  player->keyframe_requested = 1;
+
+  ast_debug(2, "通道 %s 收到%s ssrc = %u\n", ast_channel_name(player->chan), (p[0] & 0x1f) == RTCP_FMT_FIR ? "FIR" : "PLI", ssrc);
+}
+
+/* 复制1个媒体流的接收质量 */
+static void tms_rtcp_stream_stats(const TmsRtcpStream *st, TmsPacerRtcp *rtcp)
+{
+  rtcp->nb_reports = st->nb_reports;
+  rtcp->fraction_lost = st->fraction_lost;
+  rtcp->cumulative_lost = st->cumulative_lost;
+  rtcp->jitter_ms = st->jitter_ms;
+  rtcp->max_jitter_ms = st->max_jitter_ms;
+  rtcp->rtt_ms = st->rtt_ms;
+  rtcp->nb_nacks = st->nb_nacks;
+  rtcp->nb_keyframe_requests = st->nb_keyframe_requests;
+}
+
+/* 把接收质量更新到发送会话，在CLI命令tms show players和tms show player中显示 */
+static void tms_rtcp_update_session(TmsPlayerContext *player)
+{
+  TmsPacerRtcp audio, video;
+
+  tms_rtcp_stream_stats(&player->audio_rtcp, &audio);
+  tms_rtcp_stream_stats(&player->video_rtcp, &video);
+  tms_pacer_session_set_rtcp(player->pacer, &audio, &video);
+}
+
+/**
+ * 读取对端发回的rtcp包（复合包），处理其中的SR、RR、XR、NACK、PLI和FIR
+ *
+ * 对端使用对称rtcp时，接收报告发送到发送SR的socket。socket是非阻塞读取，没有数据时立即返回。
+ */
+static void tms_rtcp_receive(TmsPlayerContext *player)
+{
+  uint8_t buf[1500];
+  const uint8_t *p, *end;
+  struct timeval tv_ntp;
+  int len, pkt_len, pt, rc, i, offset, received = 0;
+
+  while ((len = recv(player->rtcp_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+  {
+    tv_ntp = ast_tvnow();
+    for (p = buf, end = buf + len; end - p >= 8; p += pkt_len)
+    {
+      pkt_len = (AV_RB16(p + 2) + 1) * 4;
+      if ((p[0] >> 6) != RTP_VERSION || end - p < pkt_len)
+        break;
+      pt = p[1];
+      rc = p[0] & 0x1f;
+      if (pt == RTCP_SR || pt == RTCP_RR)
+      {
+        offset = pt == RTCP_SR ? 28 : 8; // SR的报告块在发送者信息之后
+        for (i = 0; i < rc && offset + 24 <= pkt_len; i++, offset += 24)
+          tms_rtcp_handle_report_block(player, p + offset, tv_ntp);
+      }
+      else if (pt == RTCP_XR)
+      {
+        tms_rtcp_handle_xr(player, p + 8, p + pkt_len);
+      }
+      else if (pt == RTCP_RTPFB && rc == RTCP_FMT_NACK)
+      {
+        tms_rtcp_handle_nack(player, p, p + pkt_len);
+      }
+      else if (pt == RTCP_PSFB && (rc == RTCP_FMT_PLI || rc == RTCP_FMT_FIR))
+      {
+        tms_rtcp_handle_keyframe_request(player, p, p + pkt_len);
+      }
+    }
+    received = 1;
+  }
+
+  if (received)
+    tms_rtcp_update_session(player);
+}
+
+/**
+ * 到达发送时间时发送音频和视频流的SR，处理对端发回的接收报告
+ *
+ * 在通道线程中调用。第1次有RTP包后立即发送，之后的间隔在0.5到1.5倍TMS_RTCP_INTERVAL_US之间随机（RFC 3550 6.3.1）。
+ */
+void tms_rtcp_poll(TmsPlayerContext *player)
+{
+  int64_t now_us = tms_pacer_now_us();
+  struct timeval tv_ntp;
+
+  if (player->rtcp_fd < 0)
+    return;
+
+  tms_rtcp_receive(player);
+
+  if (now_us < player->rtcp_next_us)
+    return;
+  if (player->audio_rtcp.packet_count == 0 && player->video_rtcp.packet_count == 0)
+    return;
+
+  tv_ntp = ast_tvnow();
+  tms_rtcp_stream_send_sr(player, &player->audio_rtcp, tv_ntp, now_us);
+  tms_rtcp_stream_send_sr(player, &player->video_rtcp, tv_ntp, now_us);
+
+  player->rtcp_next_us = now_us + TMS_RTCP_INTERVAL_US / 2 + ast_random() % TMS_RTCP_INTERVAL_US;
+}
+
+/* 设置1个媒体流的通道变量，例如TMS_RTCP_AUDIO_JITTER */
+static void tms_rtcp_set_stream_vars(struct ast_channel *chan, const char *media, TmsRtcpStream *st)
+{
+  char name[64], value[32];
+
+#define TMS_RTCP_SET_VAR(key, fmt, val)                         \
+  do                                                            \
+  {                                                             \
+    snprintf(name, sizeof(name), "TMS_RTCP_%s_%s", media, key); \
+    snprintf(value, sizeof(value), fmt, val);                   \
+    pbx_builtin_setvar_helper(chan, name, value);               \
+  } while (0)
+
+  TMS_RTCP_SET_VAR("PACKETS", "%u", st->packet_count);
+  TMS_RTCP_SET_VAR("OCTETS", "%u", st->octet_count);
+  TMS_RTCP_SET_VAR("REPORTS", "%u", st->nb_reports);
+  TMS_RTCP_SET_VAR("NACKS", "%u", st->nb_nacks);
+  TMS_RTCP_SET_VAR("NACK_PACKETS", "%u", st->nb_nack_packets);
+  TMS_RTCP_SET_VAR("KEYFRAME_REQUESTS", "%u", st->nb_keyframe_requests);
+  if (st->nb_reports)
+  {
+    TMS_RTCP_SET_VAR("FRACTION_LOST", "%.1f", st->fraction_lost * 100.0 / 256);
+    TMS_RTCP_SET_VAR("LOST", "%d", st->cumulative_lost);
+    TMS_RTCP_SET_VAR("JITTER", "%d", st->jitter_ms);
+    TMS_RTCP_SET_VAR("MAX_JITTER", "%d", st->max_jitter_ms);
+    TMS_RTCP_SET_VAR("RTT", "%d", st->rtt_ms);
+  }
+
+#undef TMS_RTCP_SET_VAR
+}
+
+/**
+ * 播放结束时把发送统计和对端的接收质量写入通道变量，拨号计划中可以读取
+ *
+ * 没有收到接收报告时只设置PACKETS、OCTETS和REPORTS（等于0）。
+ */
+void tms_rtcp_set_channel_vars(TmsPlayerContext *player)
+{
+  if (!player->chan)
+    return;
+
+  if (player->rtcp_fd >= 0)
+    tms_rtcp_receive(player);
+
+  tms_rtcp_set_stream_vars(player->chan, "AUDIO", &player->audio_rtcp);
+  tms_rtcp_set_stream_vars(player->chan, "VIDEO", &player->video_rtcp);
+}
+
+/**
+ * 结束播放，把最后发送的RTP包记录到通道的时间线，下次播放从这里继续
+ *
+ * rtcp的socket属于时间线，通道销毁时关闭；没有时间线时直接关闭。
+ */
+void tms_rtcp_close(TmsPlayerContext *player)
+{
+  TmsRtcpStream *audio = &player->audio_rtcp, *video = &player->video_rtcp;
+
+  if (player->timeline)
+  {
+    tms_timeline_end(player->timeline, AST_FRAME_VOICE, audio->last_rtp_ts, audio->last_deadline_us, audio->packet_count, audio->octet_count);
+    tms_timeline_end(player->timeline, AST_FRAME_VIDEO, video->last_rtp_ts, video->last_deadline_us, video->packet_count, video->octet_count);
+    player->timeline->rtcp_next_us = player->rtcp_next_us;
+    player->rtcp_fd = -1;
+    return;
+  }
+
+  if (player->rtcp_fd >= 0)
+  {
+    close(player->rtcp_fd);
+    player->rtcp_fd = -1;
+  }
+}
+
+/* 初始化媒体流的发送统计，rtcp端口等于rtp端口加1 */
+static void tms_rtcp_stream_init(TmsRtcpStream *st, uint32_t ssrc, const struct sockaddr_in *rtp_addr, int clock_rate)
+{
+  memset(st, 0, sizeof(TmsRtcpStream));
+  st->ssrc = ssrc;
+  st->addr = *rtp_addr;
+  st->addr.sin_port = htons(ntohs(rtp_addr->sin_port) + 1);
+  st->clock_rate = clock_rate;
+  st->rtt_ms = -1;
+}
+
 /* 解析字符串形式的地址，给结构体赋值 */
 static int tms_addr_str_to_stuct(char *str, struct sockaddr_in *addr)
 {
@@ -249,6 +645,11 @@ int tms_init_player_context(struct ast_channel *chan, TmsPlayerContext *player)
   player->nb_audio_frames = 0;
   player->nb_audio_rtp_samples = 0;
   player->nb_audio_rtps = 0;
+  player->audio_started = 0;
+  player->rtcp_fd = -1;
+  player->rtcp_next_us = 0;
+  player->keyframe_requested = 0;
+  player->timeline = NULL;
 
   if (tms_ast_channel_get_rtp_dest(chan, &player->rtp_audio_dest_addr, &player->rtp_video_dest_addr) < 0)
   {
@@ -261,6 +662,36 @@ int tms_init_player_context(struct ast_channel *chan, TmsPlayerContext *player)
 
   ast_debug(1, "音频 RTP 地址 %s:%d，视频 RTP 地址 %s:%d，音频 ssrc %d，视频 ssrc %d\n", ast_inet_ntoa(player->rtp_audio_dest_addr.sin_addr), ntohs(player->rtp_audio_dest_addr.sin_port), ast_inet_ntoa(player->rtp_video_dest_addr.sin_addr), ntohs(player->rtp_video_dest_addr.sin_port), player->rtp_audio_ssrc, player->rtp_video_ssrc);
 
+  tms_rtcp_stream_init(&player->audio_rtcp, player->rtp_audio_ssrc, &player->rtp_audio_dest_addr, RTP_PCMA_TIME_BASE);
+  tms_rtcp_stream_init(&player->video_rtcp, player->rtp_video_ssrc, &player->rtp_video_dest_addr, RTP_H264_TIME_BASE);
+
+  /* 同一个通道上的播放共用时间线，rtcp的socket和SR的累计计数从上次播放继续 */
+  if ((player->timeline = tms_timeline_get(chan)))
+  {
+    player->rtcp_fd = player->timeline->rtcp_fd;
+    player->rtcp_next_us = player->timeline->rtcp_next_us;
+    player->audio_rtcp.prior_packet_count = player->timeline->audio.packet_count;
+    player->audio_rtcp.prior_octet_count = player->timeline->audio.octet_count;
+    player->video_rtcp.prior_packet_count = player->timeline->video.packet_count;
+    player->video_rtcp.prior_octet_count = player->timeline->video.octet_count;
+  }
+  if (player->rtcp_fd < 0)
+  {
+    if ((player->rtcp_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+      ast_log(LOG_WARNING, "通道 %s 建立rtcp socket失败 %s，不发送SR\n", ast_channel_name(chan), strerror(errno));
+    else if (player->timeline)
+      player->timeline->rtcp_fd = player->rtcp_fd;
+  }
+
+  player->pacer = tms_pacer_session_create(chan);
+  player->audio_pool = tms_pacer_pool_create(player->pacer, AST_FRAME_VOICE, ast_format_alaw, NULL, 1);
+  player->video_pool = tms_pacer_pool_create(player->pacer, AST_FRAME_VIDEO, ast_format_h264, NULL, 1);
+  if (!player->audio_pool || !player->video_pool)
+  {
+    ast_log(LOG_ERROR, "通道 %s 建立发送会话失败\n", ast_channel_name(chan));
+    return -1;
+  }
+
   return 0;
 }
 
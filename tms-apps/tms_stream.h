@@ -5,7 +5,10 @@
 typedef struct TmsInputStream
 {
   int stream_index;
-  AVStream *st;
+  AVCodecParameters *codecpar;
+  AVRational time_base;
+  AVRational avg_frame_rate;
+  int64_t duration;
   AVCodecContext *dec_ctx;
   AVCodec *codec;
   int bytes_per_sample;
@@ -20,13 +23,24 @@ typedef struct TmsInputStream
 
 int tms_init_input_stream(AVFormatContext *fctx, int index, TmsInputStream *ist);
 
+int tms_init_input_stream_par(int index, AVCodecParameters *codecpar, AVRational time_base, AVRational avg_frame_rate, int64_t duration, TmsInputStream *ist);
+
+void tms_free_input_stream(TmsInputStream *ist);
+
 void tms_dump_stream_format(TmsInputStream *ist);
 
 /* 生成自己使用的输入媒体流对象。只支持音频流和视频流。 */
 int tms_init_input_stream(AVFormatContext *fctx, int index, TmsInputStream *ist)
+{
+  AVStream *st = fctx->streams[index];
+
+  return tms_init_input_stream_par(index, st->codecpar, st->time_base, st->avg_frame_rate, st->duration, ist);
+}
+
+/* 用媒体流参数生成输入媒体流对象，参数可以来自打开的文件或媒体缓存 */
+int tms_init_input_stream_par(int index, AVCodecParameters *codecpar, AVRational time_base, AVRational avg_frame_rate, int64_t duration, TmsInputStream *ist)
 {
   int ret;
-  AVStream *st;
   AVCodec *codec;
   AVCodecContext *cctx;
 
@@ -36,11 +50,10 @@ int tms_init_input_stream(AVFormatContext *fctx, int index, TmsInputStream *ist)
     return -1;
   }
 
-  st = fctx->streams[index];
-  codec = avcodec_find_decoder(st->codecpar->codec_id);
+  codec = avcodec_find_decoder(codecpar->codec_id);
   if (!codec)
   {
-    ast_log(LOG_WARNING, "stream #%d codec_id = %d 没有找到解码器\n", index, st->codecpar->codec_id);
+    ast_log(LOG_WARNING, "stream #%d codec_id = %d 没有找到解码器\n", index, codecpar->codec_id);
     return -1;
   }
 
@@ -61,16 +74,20 @@ int tms_init_input_stream(AVFormatContext *fctx, int index, TmsInputStream *ist)
   // }
 
   cctx = avcodec_alloc_context3(codec);
-  avcodec_parameters_to_context(cctx, st->codecpar);
+  avcodec_parameters_to_context(cctx, codecpar);
   if ((ret = avcodec_open2(cctx, codec, NULL)) < 0)
   {
     ast_log(LOG_WARNING, "stream #%d 读取媒体流基本信息势失败 %s\n", index, av_err2str(ret));
+    avcodec_free_context(&cctx);
     return -1;
   }
 
   memset(ist, 0, sizeof(TmsInputStream));
   ist->stream_index = index;
-  ist->st = st;
+  ist->codecpar = codecpar;
+  ist->time_base = time_base;
+  ist->avg_frame_rate = avg_frame_rate;
+  ist->duration = duration;
   ist->dec_ctx = cctx;
   ist->codec = codec;
   ist->bytes_per_sample = av_get_bytes_per_sample(cctx->sample_fmt);
@@ -81,14 +98,20 @@ int tms_init_input_stream(AVFormatContext *fctx, int index, TmsInputStream *ist)
   return 0;
 }
 
+/* 释放输入媒体流的解码器 */
+void tms_free_input_stream(TmsInputStream *ist)
+{
+  if (ist->dec_ctx)
+    avcodec_free_context(&ist->dec_ctx);
+}
+
 /* 输出媒体流格式信息 */
 void tms_dump_stream_format(TmsInputStream *ist)
 {
-  AVStream *st = ist->st;
   AVCodecContext *cctx = ist->dec_ctx;
   AVCodec *codec = ist->codec;
 
-  ast_debug(1, "媒体流 #%d is %s\n", st->index, codec->type == AVMEDIA_TYPE_VIDEO ? "video" : "audio");
+  ast_debug(1, "媒体流 #%d is %s\n", ist->stream_index, codec->type == AVMEDIA_TYPE_VIDEO ? "video" : "audio");
   ast_debug(1, "-- codec.name %s\n", codec->name);
 
   /* 音频采样信息 */
@@ -103,9 +126,9 @@ void tms_dump_stream_format(TmsInputStream *ist)
     ast_debug(1, "-- ccxt.channel_layout = %s\n", buf);
   }
 
-  ast_debug(1, "-- stream.avg_frame_rate(%d, %d)\n", st->avg_frame_rate.num, st->avg_frame_rate.den);
-  ast_debug(1, "-- stream.tbn(%d, %d)\n", st->time_base.num, st->time_base.den);
-  ast_debug(1, "-- stream.duration = %s\n", av_ts2str(st->duration));
+  ast_debug(1, "-- stream.avg_frame_rate(%d, %d)\n", ist->avg_frame_rate.num, ist->avg_frame_rate.den);
+  ast_debug(1, "-- stream.tbn(%d, %d)\n", ist->time_base.num, ist->time_base.den);
+  ast_debug(1, "-- stream.duration = %s\n", av_ts2str(ist->duration));
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef TMS_TIMELINE_H
+#define TMS_TIMELINE_H
+
+/**
+ * 通道的媒体时间线，由res_tms模块实现
+ *
+ * 时间线保存在通道的datastore中，同一个通道上先后执行的播放应用（TMSMp4Play、TMSH264Play、TMSMp3Play等）
+ * 从上1个应用最后发送的RTP时间戳继续，加上两次发送之间经过的时间，对端的抖动缓冲不需要重新同步。
+ * 发送rtcp的socket和SR中的累计发送计数也保存在时间线中，通道销毁时释放。
+ * 同一个通道上的应用在通道线程中依次执行，访问时间线不需要加锁。
+ */
+
+#include "asterisk/channel.h"
+#include "asterisk/frame.h"
+
+/* 1个媒体流的RTP时钟 */
+typedef struct TmsTimelineClock
+{
+  int clock_rate;
+  int started;               // 已经发送过RTP包
+  uint32_t last_rtp_ts;      // 最后1个包的RTP时间戳
+  int64_t last_deadline_us;  // 最后1个包的发送时间
+  unsigned int packet_count; // 之前的应用累计发送的包数
+  unsigned int octet_count;  // 之前的应用累计发送的载荷字节数
+} TmsTimelineClock;
+
+typedef struct TmsChannelTimeline
+{
+  TmsTimelineClock audio;
+  TmsTimelineClock video;
+  int rtcp_fd;          // 发送rtcp的socket，没有建立时为-1
+  int64_t rtcp_next_us; // 下次发送SR的时间
+  unsigned int nb_plays; // 在通道上执行的播放次数
+} TmsChannelTimeline;
+
+/**
+ * 获得通道的时间线，第1次调用时建立
+ *
+ * @return 时间线，属于通道；失败时返回NULL，调用者按没有时间线处理
+ */
+TmsChannelTimeline *tms_timeline_get(struct ast_channel *chan);
+
+/* 时间线中指定媒体流的时钟，type为AST_FRAME_VOICE或AST_FRAME_VIDEO；timeline为NULL时返回NULL */
+TmsTimelineClock *tms_timeline_clock(TmsChannelTimeline *timeline, enum ast_frame_type type);
+
+/**
+ * 开始发送时的RTP时间戳
+ *
+ * 等于最后1个包的时间戳加上从它的发送时间到start_us经过的时长，start_us早于最后1个包的发送时间
+ * （上次停止播放时丢弃了排队的包）时向前推算。还没有发送过RTP包时由当前时间生成。
+ *
+ * @param start_us 媒体位置0的发送时间，和tms_pacer_now_us()的时间基准一致
+ */
+uint32_t tms_timeline_start(TmsChannelTimeline *timeline, enum ast_frame_type type, int64_t start_us);
+
+/**
+ * 结束发送时记录最后1个包，下1个应用从这里继续
+ *
+ * @param packet_count 本次发送的包数，为0时不改变时间线
+ */
+void tms_timeline_end(TmsChannelTimeline *timeline, enum ast_frame_type type, uint32_t rtp_ts, int64_t deadline_us, unsigned int packet_count, unsigned int octet_count);
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef TMS_VIDEO_HISTORY_H
+#define TMS_VIDEO_HISTORY_H
+
+/**
+ * 记录最近发送的关键帧，用于对端请求关键帧时重发
+ *
+ * 只记录RTP载荷，发送由播放应用完成。只在通道线程中使用，不需要加锁。
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "asterisk/logger.h"
+#include "asterisk/utils.h"
+
+#include "tms_pacer.h"
+
+#define TMS_VIDEO_HISTORY_MAX_PACKETS 1024     // 关键帧最多记录的RTP包数
+#define TMS_VIDEO_HISTORY_MAX_SIZE (1024 * 1024) // 关键帧最多记录的字节数
+#define TMS_VIDEO_RESEND_INTERVAL_US 500000    // 重发关键帧的最小间隔
+
+/**
+ * 最近1个关键帧（sps、pps和IDR）的RTP包
+ *
+ * 对端请求关键帧（FIR、PLI、VIDUPDATE）时，把整个关键帧按新的时间戳重发1次。重发的IDR在gop中间时，
+ * 后面的P帧参考的图像和frame_num、POC都对不上，所以重发后丢弃非关键帧，直到文件中的下1个IDR，
+ * 对端停在重发的画面上，不会花屏。
+ * RTP序号由asterisk的RTP模块分配，ast_write的帧不能指定序号，所以不能按NACK中的序号原样重发丢失的包，NACK只统计。
+ */
+typedef struct TmsVideoHistory
+{
+  uint8_t *buf;
+  int size;
+  int capacity;
+  int nb_packets;
+  int offsets[TMS_VIDEO_HISTORY_MAX_PACKETS];
+  int lens[TMS_VIDEO_HISTORY_MAX_PACKETS];
+  uint8_t markers[TMS_VIDEO_HISTORY_MAX_PACKETS];
+  int recording;           // 正在记录关键帧
+  int complete;            // 已经记录了完整的关键帧
+  int64_t last_resend_us;  // 上次重发的时间
+  int nb_resends;
+  int dropping;            // 重发后丢弃非关键帧，直到下1个关键帧
+  int nb_dropped;          // 重发后丢弃的帧数
+} TmsVideoHistory;
+
+int tms_video_history_begin(TmsVideoHistory *history, int key);
+
+void tms_video_history_add(TmsVideoHistory *history, const uint8_t *data, int len, int m);
+
+int tms_video_history_due(TmsVideoHistory *history);
+
+void tms_video_history_free(TmsVideoHistory *history);
+
+/**
+ * 开始发送1个视频帧
+ *
+ * 关键帧替换之前记录的关键帧；其他帧不记录，保留最近的关键帧。
+ *
+ * @return 1 发送这个帧；0 重发关键帧后还没有到下1个关键帧，丢弃这个帧
+ */
+int tms_video_history_begin(TmsVideoHistory *history, int key)
+{
+  if (!key)
+  {
+    history->recording = 0;
+    if (history->dropping)
+    {
+      history->nb_dropped++;
+      return 0;
+    }
+    return 1;
+  }
+
+  history->dropping = 0;
+  history->size = 0;
+  history->nb_packets = 0;
+  history->recording = 1;
+  history->complete = 0;
+
+  return 1;
+}
+
+/* 释放记录的关键帧 */
+void tms_video_history_free(TmsVideoHistory *history)
+{
+  ast_free(history->buf);
+  history->buf = NULL;
+  history->size = history->capacity = history->nb_packets = 0;
+  history->recording = history->complete = history->dropping = 0;
+}
+
+/* 记录关键帧的1个RTP包，超出范围时放弃这个关键帧 */
+void tms_video_history_add(TmsVideoHistory *history, const uint8_t *data, int len, int m)
+{
+  uint8_t *buf;
+  int capacity;
+
+  if (history->nb_packets >= TMS_VIDEO_HISTORY_MAX_PACKETS || history->size + len > TMS_VIDEO_HISTORY_MAX_SIZE)
+  {
+    ast_debug(1, "关键帧超过 %d 个包或者 %d 字节，不记录\n", TMS_VIDEO_HISTORY_MAX_PACKETS, TMS_VIDEO_HISTORY_MAX_SIZE);
+    history->recording = 0;
+    return;
+  }
+  if (history->size + len > history->capacity)
+  {
+    capacity = history->capacity ? history->capacity * 2 : 64 * 1024;
+    while (capacity < history->size + len)
+      capacity *= 2;
+    if (!(buf = ast_realloc(history->buf, capacity)))
+    {
+      history->recording = 0;
+      return;
+    }
+    history->buf = buf;
+    history->capacity = capacity;
+  }
+
+  memcpy(history->buf + history->size, data, len);
+  history->offsets[history->nb_packets] = history->size;
+  history->lens[history->nb_packets] = len;
+  history->markers[history->nb_packets] = m;
+  history->nb_packets++;
+  history->size += len;
+  if (m)
+  {
+    history->recording = 0;
+    history->complete = 1;
+  }
+}
+
+/**
+ * 检查是否可以重发
+ *
+ * 两次重发的间隔不小于TMS_VIDEO_RESEND_INTERVAL_US，1个关键帧的多个分片丢失时只重发1次。
+ *
+ * @return 1 可以重发，记录重发时间；0 没有完整的关键帧或者间隔太短
+ */
+int tms_video_history_due(TmsVideoHistory *history)
+{
+  int64_t now_us = tms_pacer_now_us();
+
+  if (!history->complete || now_us - history->last_resend_us < TMS_VIDEO_RESEND_INTERVAL_US)
+    return 0;
+
+  history->last_resend_us = now_us;
+  history->nb_resends++;
+
+  return 1;
+}
+
+#endif